@@ -0,0 +1,246 @@
+// Load generator for cache-server.
+//
+// usage: cache-bench <socket path> [connections] [depth] [seconds] [keys]
+//                    [get%] [multiget] [socket|ring]
+//
+// Every connection runs on its own thread and keeps `depth` requests in flight:
+// it sends a batch, then waits for all of its replies. With multiget > 1 reads
+// are sent as MultiGet of that many keys. Latency of a request is measured from
+// sending its batch to receiving its reply.
+//
+// The ring transport goes through the shared memory rings of the server
+// (<socket path>.ring). It only serves lookups, so get% is ignored: every batch
+// is one findMany() of depth * multiget keys.
+
+#include "cache-client.h"
+#include "ring-channel.h"
+#include "singleton.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Key = int;
+using Value = sentinel::CacheValue<>;
+using Client = LRUC::CacheClient<Key, Value>;
+using RingClient = LRUC::RingClient<Key, Value>;
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  std::string path;
+  size_t connections = 64;
+  size_t depth = 16;
+  double seconds = 5;
+  size_t keys = 1 << 20;
+  unsigned getPercent = 90;
+  size_t multiGet = 1;
+  bool ring = false;
+};
+
+struct Result {
+  uint64_t ops = 0;
+  uint64_t errors = 0;
+  // nanoseconds
+  std::vector<uint32_t> latencies;
+};
+
+void runRing(const Options &opts, std::atomic<bool> &stop, Result &result,
+             unsigned seed) {
+  RingClient client;
+  if (!client.connect(opts.path + ".ring")) {
+    result.errors++;
+    return;
+  }
+
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<Key> keyDist(0, static_cast<Key>(opts.keys - 1));
+  size_t count = opts.depth * opts.multiGet;
+  std::vector<Key> keys(count);
+  std::vector<Value> values(count);
+  std::unique_ptr<bool[]> found(new bool[count]);
+  result.latencies.reserve(1 << 16);
+
+  while (!stop.load(std::memory_order_relaxed)) {
+    for (auto &k : keys) {
+      k = keyDist(rng);
+    }
+
+    auto sent = Clock::now();
+    if (client.findMany(keys.data(), count, values.data(), found.get()) == 0 &&
+        !client.connected()) {
+      result.errors++;
+      return;
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  Clock::now() - sent)
+                  .count();
+    for (size_t i = 0; i < opts.depth; i++) {
+      result.latencies.push_back(static_cast<uint32_t>(
+          std::min<int64_t>(ns, std::numeric_limits<uint32_t>::max())));
+    }
+    result.ops += count;
+  }
+}
+
+void run(const Options &opts, std::atomic<bool> &stop, Result &result,
+         unsigned seed) {
+  if (opts.ring) {
+    runRing(opts, stop, result, seed);
+    return;
+  }
+
+  Client client;
+  if (!client.connect(opts.path)) {
+    result.errors++;
+    return;
+  }
+
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<Key> keyDist(0, static_cast<Key>(opts.keys - 1));
+  std::uniform_int_distribution<unsigned> opDist(0, 99);
+  std::vector<Key> batch(opts.multiGet);
+  result.latencies.reserve(1 << 16);
+
+  while (!stop.load(std::memory_order_relaxed)) {
+    for (size_t i = 0; i < opts.depth; i++) {
+      Key key = keyDist(rng);
+      if (opDist(rng) >= opts.getPercent) {
+        client.queueInsert(key, Value(key), 0, true);
+      } else if (opts.multiGet > 1) {
+        for (auto &k : batch) {
+          k = keyDist(rng);
+        }
+        client.queueFindMany(batch.data(), batch.size());
+      } else {
+        client.queueFind(key);
+      }
+    }
+
+    auto sent = Clock::now();
+    if (!client.flush()) {
+      result.errors++;
+      return;
+    }
+
+    Client::Reply reply;
+    for (size_t i = 0; i < opts.depth; i++) {
+      if (!client.receive(reply)) {
+        result.errors++;
+        return;
+      }
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    Clock::now() - sent)
+                    .count();
+      result.latencies.push_back(static_cast<uint32_t>(
+          std::min<int64_t>(ns, std::numeric_limits<uint32_t>::max())));
+      result.ops += reply.status_ == LRUC::CacheStatus::Ok &&
+                            reply.count_ > 1
+                        ? reply.count_
+                        : 1;
+    }
+  }
+}
+
+double percentile(const std::vector<uint32_t> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t idx = static_cast<size_t>(p * (sorted.size() - 1));
+  return sorted[idx] / 1000.0;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::fprintf(stderr,
+                 "usage: %s <socket path> [connections] [depth] [seconds] "
+                 "[keys] [get%%] [multiget] [socket|ring]\n",
+                 argv[0]);
+    return 1;
+  }
+
+  Options opts;
+  opts.path = argv[1];
+  if (argc > 2)
+    opts.connections = std::strtoull(argv[2], nullptr, 10);
+  if (argc > 3)
+    opts.depth = std::max<size_t>(1, std::strtoull(argv[3], nullptr, 10));
+  if (argc > 4)
+    opts.seconds = std::strtod(argv[4], nullptr);
+  if (argc > 5)
+    opts.keys = std::max<size_t>(1, std::strtoull(argv[5], nullptr, 10));
+  if (argc > 6)
+    opts.getPercent = static_cast<unsigned>(std::strtoul(argv[6], nullptr, 10));
+  if (argc > 7)
+    opts.multiGet = std::min<size_t>(
+        LRUC::MaxMultiGet,
+        std::max<size_t>(1, std::strtoull(argv[7], nullptr, 10)));
+  if (argc > 8)
+    opts.ring = std::string(argv[8]) == "ring";
+
+  // warm up so reads hit.
+  {
+    Client client;
+    if (!client.connect(opts.path)) {
+      std::fprintf(stderr, "cannot connect to %s\n", opts.path.c_str());
+      return 1;
+    }
+    Client::Reply reply;
+    for (size_t k = 0; k < opts.keys; k += 1024) {
+      size_t end = std::min(opts.keys, k + 1024);
+      for (size_t i = k; i < end; i++) {
+        client.queueInsert(static_cast<Key>(i), Value(static_cast<int64_t>(i)));
+      }
+      client.flush();
+      for (size_t i = k; i < end; i++) {
+        client.receive(reply);
+      }
+    }
+  }
+
+  std::atomic<bool> stop{false};
+  std::vector<Result> results(opts.connections);
+  std::vector<std::thread> threads;
+  auto start = Clock::now();
+  for (size_t i = 0; i < opts.connections; i++) {
+    threads.emplace_back(run, std::cref(opts), std::ref(stop),
+                         std::ref(results[i]), static_cast<unsigned>(i + 1));
+  }
+
+  std::this_thread::sleep_for(std::chrono::duration<double>(opts.seconds));
+  stop.store(true);
+  for (auto &t : threads) {
+    t.join();
+  }
+  double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+  uint64_t ops = 0;
+  uint64_t errors = 0;
+  std::vector<uint32_t> latencies;
+  for (auto &r : results) {
+    ops += r.ops;
+    errors += r.errors;
+    latencies.insert(latencies.end(), r.latencies.begin(), r.latencies.end());
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  std::printf("%s connections %zu depth %zu multiget %zu get%% %u\n",
+              opts.ring ? "ring" : "socket", opts.connections, opts.depth,
+              opts.multiGet, opts.ring ? 100 : opts.getPercent);
+  std::printf("ops/s %.0f requests %zu errors %llu\n", ops / elapsed,
+              latencies.size(), static_cast<unsigned long long>(errors));
+  std::printf("latency us p50 %.1f p99 %.1f p99.9 %.1f max %.1f\n",
+              percentile(latencies, 0.5), percentile(latencies, 0.99),
+              percentile(latencies, 0.999), percentile(latencies, 1.0));
+  return errors > 0 ? 1 : 0;
+}
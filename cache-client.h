@@ -0,0 +1,288 @@
+/**
+ * @author shchang
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "cache-protocol.h"
+
+namespace LRUC {
+
+/**
+ * CacheClient talks to the cache sidecar over its Unix socket, see cache-protocol.h.
+ *
+ * Requests are queued with the queue*() calls and sent together by flush(), replies
+ * are then read in order with receive(). The blocking calls find(), insert() etc. are
+ * a queue + flush + receive round trip.
+ *
+ * Not thread-safe, use one client per thread.
+ *
+ * Type concepts:
+ *  TKey and TValue must be trivially copyable and match the server.
+ */
+template <class TKey, class TValue>
+class CacheClient final {
+  static_assert(std::is_trivially_copyable<TKey>::value && std::is_trivially_copyable<TValue>::value,
+                "CacheClient requires trivially copyable key and value");
+
+ public:
+  /**
+   * One response. body_ points into the client buffer and stays valid until the
+   * next receive().
+   */
+  struct Reply {
+    uint32_t id_;
+    CacheStatus status_;
+    uint16_t count_;
+    const char* body_;
+    uint32_t length_;
+  };
+
+ private:
+  int sock_;
+  uint32_t nextId_;
+  std::vector<char> out_;
+  std::vector<char> in_;
+  // unread bytes of in_ are [inBegin_, inEnd_)
+  size_t inBegin_;
+  size_t inEnd_;
+
+ private:
+  uint32_t queue(CacheOp op, uint8_t tag, uint16_t count, const void* body, size_t length) {
+    RequestHeader header{static_cast<uint32_t>(length), nextId_++, op, tag, count};
+    size_t offset = out_.size();
+    out_.resize(offset + sizeof(header) + length);
+    std::memcpy(out_.data() + offset, &header, sizeof(header));
+    if (length > 0) {
+      std::memcpy(out_.data() + offset + sizeof(header), body, length);
+    }
+    return header.id_;
+  }
+
+  /**
+   * Read until at least bytes unread bytes are buffered.
+   */
+  bool fill(size_t bytes) {
+    if (inEnd_ - inBegin_ >= bytes) {
+      return true;
+    }
+
+    if (inBegin_ > 0) {
+      std::memmove(in_.data(), in_.data() + inBegin_, inEnd_ - inBegin_);
+      inEnd_ -= inBegin_;
+      inBegin_ = 0;
+    }
+    if (in_.size() < bytes) {
+      in_.resize(bytes);
+    }
+
+    while (inEnd_ < bytes) {
+      ssize_t n = ::recv(sock_, in_.data() + inEnd_, in_.size() - inEnd_, 0);
+      if (n <= 0) {
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      inEnd_ += static_cast<size_t>(n);
+    }
+    return true;
+  }
+
+  bool roundTrip(Reply& reply) {
+    return flush() && receive(reply) && reply.status_ != CacheStatus::BadRequest;
+  }
+
+ public:
+  CacheClient() : sock_(-1), nextId_(0), in_(64 * 1024), inBegin_(0), inEnd_(0) {}
+
+  ~CacheClient() {
+    close();
+  }
+
+  CacheClient(const CacheClient&) = delete;
+  CacheClient& operator=(const CacheClient&) = delete;
+
+  /**
+   * Connect to the sidecar listening on path.
+   */
+  bool connect(const std::string& path) {
+    close();
+
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+      return false;
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+    sock_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock_ < 0) {
+      return false;
+    }
+    if (::connect(sock_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close() {
+    if (sock_ >= 0) {
+      ::close(sock_);
+      sock_ = -1;
+    }
+    out_.clear();
+    inBegin_ = inEnd_ = 0;
+  }
+
+  bool connected() const {
+    return sock_ >= 0;
+  }
+
+  // ---- pipelined interface, each call returns the request id ----
+  uint32_t queueFind(const TKey& key) {
+    return queue(CacheOp::Get, 0, 0, &key, sizeof(key));
+  }
+
+  /**
+   * Queue a multi-get of count keys, count must not exceed MaxMultiGet.
+   */
+  uint32_t queueFindMany(const TKey* keys, size_t count) {
+    return queue(CacheOp::MultiGet, 0, static_cast<uint16_t>(count), keys, count * sizeof(TKey));
+  }
+
+  uint32_t queueInsert(const TKey& key, const TValue& value, uint8_t tag = 0, bool assign = false) {
+    char body[sizeof(TKey) + sizeof(TValue)];
+    std::memcpy(body, &key, sizeof(key));
+    std::memcpy(body + sizeof(key), &value, sizeof(value));
+    return queue(assign ? CacheOp::InsertOrAssign : CacheOp::Insert, tag, 0, body, sizeof(body));
+  }
+
+  uint32_t queueErase(const TKey& key) {
+    return queue(CacheOp::Erase, 0, 0, &key, sizeof(key));
+  }
+
+  uint32_t queuePing() {
+    return queue(CacheOp::Ping, 0, 0, nullptr, 0);
+  }
+
+  /**
+   * Send all queued requests.
+   */
+  bool flush() {
+    size_t sent = 0;
+    while (sent < out_.size()) {
+      ssize_t n = ::send(sock_, out_.data() + sent, out_.size() - sent, MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      sent += static_cast<size_t>(n);
+    }
+    out_.clear();
+    return true;
+  }
+
+  /**
+   * Block until the next reply arrived. Return false on connection error.
+   */
+  bool receive(Reply& reply) {
+    ResponseHeader header;
+    if (!fill(sizeof(header))) {
+      return false;
+    }
+    std::memcpy(&header, in_.data() + inBegin_, sizeof(header));
+    if (header.length_ > MaxBodySize || !fill(sizeof(header) + header.length_)) {
+      return false;
+    }
+
+    reply.id_ = header.id_;
+    reply.status_ = header.status_;
+    reply.count_ = header.count_;
+    reply.body_ = in_.data() + inBegin_ + sizeof(header);
+    reply.length_ = header.length_;
+    inBegin_ += sizeof(header) + header.length_;
+    return true;
+  }
+
+  // ---- blocking interface ----
+  /**
+   * Copy the value of key into value. Return true if key exists.
+   */
+  bool find(const TKey& key, TValue& value) {
+    Reply reply;
+    queueFind(key);
+    if (!roundTrip(reply) || reply.status_ != CacheStatus::Ok || reply.length_ != sizeof(TValue)) {
+      return false;
+    }
+    std::memcpy(&value, reply.body_, sizeof(TValue));
+    return true;
+  }
+
+  /**
+   * Look up count keys at once, found[i] tells whether values[i] was filled.
+   * Return number of keys found, 0 on error.
+   */
+  size_t findMany(const TKey* keys, size_t count, TValue* values, bool* found) {
+    Reply reply;
+    queueFindMany(keys, count);
+    if (!roundTrip(reply) || reply.length_ != count * (1 + sizeof(TValue))) {
+      return 0;
+    }
+
+    size_t hits = 0;
+    const char* flags = reply.body_;
+    const char* payload = reply.body_ + count;
+    for (size_t i = 0; i < count; i++) {
+      found[i] = flags[i] != 0;
+      if (found[i]) {
+        std::memcpy(&values[i], payload + i * sizeof(TValue), sizeof(TValue));
+        hits++;
+      }
+    }
+    return hits;
+  }
+
+  /**
+   * Return true if key was inserted, false if it existed or on error.
+   */
+  bool insert(const TKey& key, const TValue& value, uint8_t tag = 0) {
+    Reply reply;
+    queueInsert(key, value, tag, false);
+    return roundTrip(reply) && reply.count_ == 1;
+  }
+
+  bool insertOrAssign(const TKey& key, const TValue& value, uint8_t tag = 0) {
+    Reply reply;
+    queueInsert(key, value, tag, true);
+    return roundTrip(reply) && reply.count_ == 1;
+  }
+
+  size_t erase(const TKey& key) {
+    Reply reply;
+    queueErase(key);
+    return roundTrip(reply) ? reply.count_ : 0;
+  }
+
+  bool ping() {
+    Reply reply;
+    queuePing();
+    return roundTrip(reply) && reply.status_ == CacheStatus::Ok;
+  }
+};
+}  // namespace LRUC
@@ -0,0 +1,192 @@
+/**
+ * @author shchang
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace LRUC {
+
+/**
+ * Unix domain socket helpers for handing a cache segment over to a restarted process.
+ *
+ * The old process listens on a socket path and sends the segment fd with SCM_RIGHTS,
+ * together with a magic number so a stray peer is not mistaken for a cache. The new
+ * process maps the received fd, validates the segment header and answers with a
+ * one-byte acknowledgement. Nothing is serialized or copied, both processes map the
+ * same pages.
+ *
+ * All calls take a timeout in milliseconds and return false / -1 on failure.
+ */
+struct Handover final {
+  static constexpr uint64_t Magic = 0x31444e484355524cULL;  // "LRUCHND1" little-endian
+
+  /**
+   * Fill addr with path, return false if path doesn't fit.
+   */
+  static bool address(const std::string& path, sockaddr_un& addr) {
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+      return false;
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size());
+    return true;
+  }
+
+  static bool waitFor(int sock, short events, int timeoutMs) {
+    pollfd pfd{sock, events, 0};
+    int rc;
+    do {
+      rc = ::poll(&pfd, 1, timeoutMs);
+    } while (rc < 0 && errno == EINTR);
+    return rc > 0;
+  }
+
+  /**
+   * Listen on path, replacing a stale socket file. Return the socket, -1 on error.
+   */
+  static int listen(const std::string& path) {
+    sockaddr_un addr;
+    if (!address(path, addr)) {
+      return -1;
+    }
+
+    int sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+      return -1;
+    }
+
+    ::unlink(path.c_str());
+    if (::bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(sock, 1) != 0) {
+      ::close(sock);
+      return -1;
+    }
+    return sock;
+  }
+
+  /**
+   * Accept one peer on listening socket sock. Return the connection, -1 on timeout.
+   */
+  static int accept(int sock, int timeoutMs) {
+    if (!waitFor(sock, POLLIN, timeoutMs)) {
+      return -1;
+    }
+    return ::accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+  }
+
+  /**
+   * Connect to path, retrying until the old process starts listening or timeoutMs passed.
+   */
+  static int connect(const std::string& path, int timeoutMs) {
+    sockaddr_un addr;
+    if (!address(path, addr)) {
+      return -1;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (true) {
+      int sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (sock < 0) {
+        return -1;
+      }
+      if (::connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+        return sock;
+      }
+      ::close(sock);
+
+      if ((errno != ENOENT && errno != ECONNREFUSED) || std::chrono::steady_clock::now() > deadline) {
+        return -1;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+
+  /**
+   * Send fd over connected socket sock.
+   */
+  static bool sendFd(int sock, int fd) {
+    uint64_t magic = Magic;
+    iovec iov{&magic, sizeof(magic)};
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    std::memset(control, 0, sizeof(control));
+
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    ssize_t n;
+    do {
+      n = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return n == static_cast<ssize_t>(sizeof(magic));
+  }
+
+  /**
+   * Receive an fd sent by sendFd(). Return it, -1 on timeout or a malformed message.
+   */
+  static int receiveFd(int sock, int timeoutMs) {
+    if (!waitFor(sock, POLLIN, timeoutMs)) {
+      return -1;
+    }
+
+    uint64_t magic = 0;
+    iovec iov{&magic, sizeof(magic)};
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+      n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+
+    int fd = -1;
+    cmsghdr* cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : nullptr;
+    if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+      std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if (fd >= 0 && (n != static_cast<ssize_t>(sizeof(magic)) || magic != Magic || (msg.msg_flags & MSG_CTRUNC))) {
+      ::close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  static bool sendAck(int sock, bool ok) {
+    char ack = ok ? 1 : 0;
+    return ::send(sock, &ack, 1, MSG_NOSIGNAL) == 1;
+  }
+
+  static bool receiveAck(int sock, int timeoutMs) {
+    char ack = 0;
+    return waitFor(sock, POLLIN, timeoutMs) && ::recv(sock, &ack, 1, 0) == 1 && ack == 1;
+  }
+};
+}  // namespace LRUC
@@ -0,0 +1,79 @@
+/**
+ * @author shchang
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace LRUC {
+
+/**
+ * Binary protocol of the cache sidecar (cache-server.cpp), for components that can't
+ * link the cache itself.
+ *
+ * A connection carries a stream of requests, each a RequestHeader followed by `length`
+ * body bytes. Clients may pipeline: send any number of requests without waiting, the
+ * server answers every request with one ResponseHeader + body, in request order. `id`
+ * is echoed back untouched.
+ *
+ * Integers, keys and values are raw bytes in host order, the sidecar is local only.
+ *
+ * Request bodies, K = sizeof(key), V = sizeof(value):
+ *  Get            key                 -> Ok + value | NotFound
+ *  MultiGet       count * key         -> Ok + count found bytes (0/1) + count * value
+ *  Insert         key, value (+ tag)  -> Ok, count 1 if inserted, 0 if key existed
+ *  InsertOrAssign key, value (+ tag)  -> Ok, count 1 if inserted, 0 if assigned
+ *  Erase          key                 -> Ok, count = erased elements
+ *  Ping           -                   -> Ok
+ * A malformed request gets BadRequest and the server closes the connection.
+ */
+enum class CacheOp : uint8_t { Get = 1, MultiGet, Insert, InsertOrAssign, Erase, Ping };
+
+enum class CacheStatus : uint8_t { Ok = 0, NotFound, BadRequest };
+
+struct RequestHeader final {
+  // body bytes following the header
+  uint32_t length_;
+  uint32_t id_;
+  CacheOp op_;
+  uint8_t tag_;
+  // number of keys of MultiGet
+  uint16_t count_;
+};
+
+struct ResponseHeader final {
+  uint32_t length_;
+  uint32_t id_;
+  CacheStatus status_;
+  uint8_t reserved_;
+  uint16_t count_;
+};
+
+static_assert(sizeof(RequestHeader) == 12 && sizeof(ResponseHeader) == 12, "wire headers must stay packed");
+
+// upper bound of a request or response body, larger requests are rejected.
+constexpr size_t MaxBodySize = 1 << 20;
+constexpr size_t MaxMultiGet = 4096;
+
+/**
+ * Expected request body size for op, 0 if op is unknown or count is out of range.
+ * Ping has an empty body and is handled separately.
+ */
+inline size_t requestBodySize(CacheOp op, uint16_t count, size_t keySize, size_t valueSize) {
+  switch (op) {
+    case CacheOp::Get:
+    case CacheOp::Erase:
+      return keySize;
+    case CacheOp::MultiGet:
+      return count > 0 && count <= MaxMultiGet ? count * keySize : 0;
+    case CacheOp::Insert:
+    case CacheOp::InsertOrAssign:
+      return keySize + valueSize;
+    default:
+      return 0;
+  }
+}
+}  // namespace LRUC
@@ -0,0 +1,373 @@
+// Cache sidecar: serves a SoftIpCache over a Unix domain socket, see
+// cache-protocol.h for the wire format.
+//
+// usage: cache-server <socket path> [capacity] [shards] [threads]
+//                     [ring threads]
+//
+// Every worker thread runs its own epoll loop. The listening socket is shared
+// with EPOLLEXCLUSIVE, so a connection stays on the thread that accepted it.
+// All complete requests read in one wakeup are answered with a single write.
+//
+// Lookups are also served through shared memory rings (ring-channel.h) for
+// callers needing lower latency, registration happens on <socket path>.ring.
+// ring threads = 0 disables them.
+//
+// Statistics are exported to shared memory by the main thread every second,
+// inspect them with cachectl <pid>.
+// SIGUSR2 dumps the flight recorder of recent cache operations to stderr.
+
+#include "cache-protocol.h"
+#include "ring-channel.h"
+#include "singleton.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+using Key = int;
+using Value = sentinel::CacheValue<>;
+
+// stop reading from a connection while this much output is pending.
+constexpr size_t MaxPendingOutput = 4 << 20;
+// or while this much input is buffered but not yet processed, the rest waits
+// in the socket.
+constexpr size_t MaxPendingInput = 4 << 20;
+constexpr size_t ReadChunk = 64 * 1024;
+constexpr std::chrono::milliseconds StatsInterval{1000};
+
+std::atomic<bool> stopping{false};
+
+void onSignal(int) { stopping.store(true); }
+
+struct Connection {
+  int fd;
+  std::vector<char> in;
+  size_t inBegin = 0;
+  std::vector<char> out;
+  size_t outSent = 0;
+  bool writing = false;
+  bool closing = false;
+};
+
+void appendResponse(Connection &conn, uint32_t id, LRUC::CacheStatus status,
+                    uint16_t count, size_t length) {
+  LRUC::ResponseHeader header{static_cast<uint32_t>(length), id, status, 0,
+                              count};
+  size_t offset = conn.out.size();
+  conn.out.resize(offset + sizeof(header) + length);
+  std::memcpy(conn.out.data() + offset, &header, sizeof(header));
+}
+
+// Body of the response appended last.
+char *lastBody(Connection &conn, size_t length) {
+  return conn.out.data() + conn.out.size() - length;
+}
+
+// Execute one validated request.
+void execute(sentinel::SoftIpCache &cache, Connection &conn,
+             const LRUC::RequestHeader &req, const char *body) {
+  Key key;
+  Value value;
+
+  switch (req.op_) {
+  case LRUC::CacheOp::Get: {
+    sentinel::SoftIpCache::ConstAccessor ac;
+    std::memcpy(&key, body, sizeof(key));
+    if (cache.find(ac, key)) {
+      appendResponse(conn, req.id_, LRUC::CacheStatus::Ok, 1, sizeof(Value));
+      std::memcpy(lastBody(conn, sizeof(Value)), ac.get(), sizeof(Value));
+    } else {
+      appendResponse(conn, req.id_, LRUC::CacheStatus::NotFound, 0, 0);
+    }
+    return;
+  }
+  case LRUC::CacheOp::MultiGet: {
+    size_t length = req.count_ * (1 + sizeof(Value));
+    appendResponse(conn, req.id_, LRUC::CacheStatus::Ok, req.count_, length);
+    char *flags = lastBody(conn, length);
+    char *values = flags + req.count_;
+    std::memset(flags, 0, length);
+
+    for (size_t i = 0; i < req.count_; i++) {
+      sentinel::SoftIpCache::ConstAccessor ac;
+      std::memcpy(&key, body + i * sizeof(Key), sizeof(key));
+      if (cache.find(ac, key)) {
+        flags[i] = 1;
+        std::memcpy(values + i * sizeof(Value), ac.get(), sizeof(Value));
+      }
+    }
+    return;
+  }
+  case LRUC::CacheOp::Insert:
+  case LRUC::CacheOp::InsertOrAssign: {
+    std::memcpy(&key, body, sizeof(key));
+    std::memcpy(&value, body + sizeof(key), sizeof(value));
+    bool inserted = req.op_ == LRUC::CacheOp::Insert
+                        ? cache.insert(key, value, req.tag_)
+                        : cache.insertOrAssign(key, value, req.tag_);
+    appendResponse(conn, req.id_, LRUC::CacheStatus::Ok, inserted ? 1 : 0, 0);
+    return;
+  }
+  case LRUC::CacheOp::Erase:
+    std::memcpy(&key, body, sizeof(key));
+    appendResponse(conn, req.id_, LRUC::CacheStatus::Ok,
+                   static_cast<uint16_t>(cache.erase(key)), 0);
+    return;
+  case LRUC::CacheOp::Ping:
+    appendResponse(conn, req.id_, LRUC::CacheStatus::Ok, 0, 0);
+    return;
+  }
+}
+
+// Answer all complete requests buffered in conn.
+void process(sentinel::SoftIpCache &cache, Connection &conn) {
+  while (!conn.closing && conn.out.size() < MaxPendingOutput) {
+    size_t available = conn.in.size() - conn.inBegin;
+    if (available < sizeof(LRUC::RequestHeader)) {
+      break;
+    }
+
+    LRUC::RequestHeader req;
+    std::memcpy(&req, conn.in.data() + conn.inBegin, sizeof(req));
+    size_t expected = LRUC::requestBodySize(req.op_, req.count_, sizeof(Key),
+                                            sizeof(Value));
+    bool valid = req.op_ == LRUC::CacheOp::Ping
+                     ? req.length_ == 0
+                     : expected > 0 && req.length_ == expected;
+    if (!valid) {
+      appendResponse(conn, req.id_, LRUC::CacheStatus::BadRequest, 0, 0);
+      conn.closing = true;
+      break;
+    }
+
+    if (available < sizeof(req) + req.length_) {
+      break;
+    }
+    execute(cache, conn, req, conn.in.data() + conn.inBegin + sizeof(req));
+    conn.inBegin += sizeof(req) + req.length_;
+  }
+
+  // drop consumed input.
+  if (conn.inBegin > 0) {
+    conn.in.erase(conn.in.begin(), conn.in.begin() + conn.inBegin);
+    conn.inBegin = 0;
+  }
+}
+
+// Return false if the peer is gone.
+bool readInput(Connection &conn) {
+  while (conn.in.size() - conn.inBegin < MaxPendingInput) {
+    size_t offset = conn.in.size();
+    conn.in.resize(offset + ReadChunk);
+    ssize_t n = ::recv(conn.fd, conn.in.data() + offset, ReadChunk, 0);
+    conn.in.resize(offset + (n > 0 ? static_cast<size_t>(n) : 0));
+
+    if (n > 0) {
+      if (static_cast<size_t>(n) < ReadChunk) {
+        return true;
+      }
+      continue;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+  }
+  // level-triggered, epoll reports the remaining input again.
+  return true;
+}
+
+// Return false on a write error.
+bool writeOutput(Connection &conn) {
+  while (conn.outSent < conn.out.size()) {
+    ssize_t n = ::send(conn.fd, conn.out.data() + conn.outSent,
+                       conn.out.size() - conn.outSent, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    conn.outSent += static_cast<size_t>(n);
+  }
+  conn.out.clear();
+  conn.outSent = 0;
+  return true;
+}
+
+void worker(sentinel::SoftIpCache &cache, int listener) {
+  int epfd = ::epoll_create1(EPOLL_CLOEXEC);
+  epoll_event ev{};
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.fd = listener;
+  ::epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &ev);
+
+  std::unordered_map<int, std::unique_ptr<Connection>> conns;
+  std::vector<epoll_event> events(256);
+
+  auto close = [&](Connection &conn) {
+    int fd = conn.fd;
+    ::epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+    ::close(fd);
+    conns.erase(fd);
+  };
+
+  while (!stopping.load(std::memory_order_relaxed)) {
+    int n = ::epoll_wait(epfd, events.data(), static_cast<int>(events.size()),
+                         100);
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+
+      if (fd == listener) {
+        int client;
+        while ((client = ::accept4(listener, nullptr, nullptr,
+                                   SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+          auto conn = std::make_unique<Connection>();
+          conn->fd = client;
+          epoll_event cev{};
+          cev.events = EPOLLIN | EPOLLRDHUP;
+          cev.data.fd = client;
+          ::epoll_ctl(epfd, EPOLL_CTL_ADD, client, &cev);
+          conns.emplace(client, std::move(conn));
+        }
+        continue;
+      }
+
+      auto it = conns.find(fd);
+      if (it == conns.end()) {
+        continue;
+      }
+      Connection &conn = *it->second;
+
+      bool alive = true;
+      if (events[i].events & EPOLLIN) {
+        alive = readInput(conn);
+      }
+      process(cache, conn);
+      // answer what was processed even if the peer half-closed.
+      if (!writeOutput(conn) || (!alive && conn.out.empty()) ||
+          (events[i].events & (EPOLLERR | EPOLLHUP)) ||
+          (conn.closing && conn.out.empty())) {
+        close(conn);
+        continue;
+      }
+
+      // wait for the socket to drain before reading more.
+      bool writing = !conn.out.empty();
+      if (writing != conn.writing) {
+        conn.writing = writing;
+        epoll_event cev{};
+        cev.events = writing ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+        cev.data.fd = fd;
+        ::epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &cev);
+      }
+    }
+  }
+
+  for (auto &entry : conns) {
+    ::close(entry.first);
+  }
+  ::close(epfd);
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::fprintf(stderr,
+                 "usage: %s <socket path> [capacity] [shards] [threads] "
+                 "[ring threads]\n",
+                 argv[0]);
+    return 1;
+  }
+
+  std::string path = argv[1];
+  size_t capacity = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1 << 20;
+  size_t shards = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 0;
+  size_t threads = argc > 4 ? std::strtoull(argv[4], nullptr, 10)
+                            : std::thread::hardware_concurrency();
+  threads = threads > 0 ? threads : 1;
+  size_t ringThreads = argc > 5 ? std::strtoull(argv[5], nullptr, 10) : 1;
+
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    std::fprintf(stderr, "socket path too long\n");
+    return 1;
+  }
+  std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+  int listener =
+      ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  ::unlink(path.c_str());
+  if (listener < 0 ||
+      ::bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) !=
+          0 ||
+      ::listen(listener, SOMAXCONN) != 0) {
+    std::perror("listen");
+    return 1;
+  }
+
+  std::signal(SIGINT, onSignal);
+  std::signal(SIGTERM, onSignal);
+  std::signal(SIGPIPE, SIG_IGN);
+
+  sentinel::SoftIpCache cache{capacity, shards};
+  // build shards before serving rather than on the first requests.
+  cache.preconstruct();
+  // read with cachectl <pid>.
+  cache.enableLatencyHistograms();
+  if (!cache.exportStats(LRUC::statsSegmentName(::getpid()), StatsInterval)) {
+    std::perror("stats segment");
+  }
+  // kill -USR2 dumps the last operations of every thread to stderr.
+  cache.enableFlightRecorder();
+  LRUC::installFlightRecorderSignal(SIGUSR2);
+  std::fprintf(stderr, "cache-server: %s capacity %zu shards %zu threads %zu\n",
+               path.c_str(), cache.capacity(), cache.shardCount(), threads);
+
+  LRUC::RingService<Key, Value, sentinel::SoftIpCache> rings{cache,
+                                                             ringThreads};
+  if (ringThreads > 0 && !rings.start(path + ".ring")) {
+    std::perror("ring service");
+    return 1;
+  }
+
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < threads; i++) {
+    workers.emplace_back(worker, std::ref(cache), listener);
+  }
+  // republish statistics here rather than on a request thread.
+  auto nextPublish = std::chrono::steady_clock::now();
+  while (!stopping.load(std::memory_order_relaxed)) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (std::chrono::steady_clock::now() >= nextPublish) {
+      cache.publishStats();
+      nextPublish += StatsInterval;
+    }
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+
+  ::close(listener);
+  ::unlink(path.c_str());
+  return 0;
+}
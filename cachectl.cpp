@@ -0,0 +1,208 @@
+// Inspect the statistics a running process exports with
+// ScalableLRUCache::exportStats(), see lrucache-stats-segment.h.
+//
+// usage: cachectl <pid | segment name> [text|prometheus] [watch seconds]
+//
+// A pid stands for its default segment, statsSegmentName(pid). The segment is
+// only read, the process is neither signalled nor contacted. With watch
+// seconds, the stats are printed again every that many seconds.
+
+#include "lrucache-stats-segment.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace {
+
+using LRUC::CacheStats;
+using LRUC::LatencyHistogram;
+using LRUC::LatencyOp;
+using LRUC::ShardStatsRecord;
+using LRUC::StatsImage;
+
+const char *const OpNames[] = {"find", "insert", "erase"};
+
+struct Counter {
+  const char *name;
+  const char *help;
+  uint64_t CacheStats::*field;
+};
+
+const Counter Counters[] = {
+    {"hits", "Lookups finding their key.", &CacheStats::hits_},
+    {"misses", "Lookups not finding their key.", &CacheStats::misses_},
+    {"inserts", "New keys inserted.", &CacheStats::inserts_},
+    {"updates", "Existing keys overwritten.", &CacheStats::updates_},
+    {"rejected_inserts", "Inserts of existing keys.",
+     &CacheStats::rejectedInserts_},
+    {"rejected_admissions", "New keys refused by admission throttling.",
+     &CacheStats::rejectedAdmissions_},
+    {"evictions", "Keys evicted.", &CacheStats::evictions_},
+    {"lost_promotions", "Hits not promoted as the list lock was taken.",
+     &CacheStats::lostPromotions_},
+    {"erases", "Keys erased.", &CacheStats::erases_},
+};
+
+double secondsSince(int64_t unixNanos) {
+  int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::system_clock::now().time_since_epoch())
+                    .count();
+  return static_cast<double>(now - unixNanos) / 1e9;
+}
+
+void printText(const StatsImage &image) {
+  CacheStats total = image.total();
+  std::printf("pid %lld, published %.1fs ago (#%llu)\n",
+              static_cast<long long>(image.pid_),
+              secondsSince(image.payload_.publishedAt_),
+              static_cast<unsigned long long>(image.payload_.publishes_));
+  std::printf("size %llu / %llu, hit ratio %.4f\n",
+              static_cast<unsigned long long>(image.payload_.size_),
+              static_cast<unsigned long long>(image.payload_.capacity_),
+              total.hitRatio());
+  for (const Counter &counter : Counters) {
+    std::printf("  %-20s %llu\n", counter.name,
+                static_cast<unsigned long long>(total.*counter.field));
+  }
+
+  if (image.payload_.sampleEvery_ > 0) {
+    std::printf("latency, 1 in %llu calls sampled:\n",
+                static_cast<unsigned long long>(image.payload_.sampleEvery_));
+    for (size_t op = 0; op < static_cast<size_t>(LatencyOp::Count); op++) {
+      LatencyHistogram histogram = image.latency(static_cast<LatencyOp>(op));
+      std::printf("  %-7s samples %-10llu p50 %8.0fns p99 %8.0fns "
+                  "p999 %8.0fns\n",
+                  OpNames[op], static_cast<unsigned long long>(histogram.count_),
+                  histogram.percentile(0.5), histogram.percentile(0.99),
+                  histogram.percentile(0.999));
+    }
+  }
+
+  std::printf("%5s %10s %10s %12s %12s %10s %9s %10s %10s\n", "shard", "size",
+              "capacity", "hits", "misses", "evictions", "throttled",
+              "list-cont", "table-cont");
+  for (size_t i = 0; i < image.shards_.size(); i++) {
+    const ShardStatsRecord &shard = image.shards_[i];
+    if (shard.built_ == 0) {
+      std::printf("%5zu %10s\n", i, "unbuilt");
+      continue;
+    }
+    std::printf("%5zu %10llu %10llu %12llu %12llu %10llu %9s %10llu %10llu\n", i,
+                static_cast<unsigned long long>(shard.size_),
+                static_cast<unsigned long long>(shard.capacity_),
+                static_cast<unsigned long long>(shard.stats_.hits_),
+                static_cast<unsigned long long>(shard.stats_.misses_),
+                static_cast<unsigned long long>(shard.stats_.evictions_),
+                shard.throttled_ != 0 ? "yes" : "no",
+                static_cast<unsigned long long>(shard.listContended_),
+                static_cast<unsigned long long>(shard.tableContended_));
+  }
+}
+
+void printShardMetric(const char *name, const char *type, const char *help,
+                      const StatsImage &image,
+                      uint64_t (*value)(const ShardStatsRecord &)) {
+  std::printf("# HELP lrucache_%s %s\n# TYPE lrucache_%s %s\n", name, help, name,
+              type);
+  for (size_t i = 0; i < image.shards_.size(); i++) {
+    std::printf("lrucache_%s{shard=\"%zu\"} %llu\n", name, i,
+                static_cast<unsigned long long>(value(image.shards_[i])));
+  }
+}
+
+void printPrometheus(const StatsImage &image) {
+  for (const Counter &counter : Counters) {
+    std::printf("# HELP lrucache_%s_total %s\n# TYPE lrucache_%s_total counter\n",
+                counter.name, counter.help, counter.name);
+    for (size_t i = 0; i < image.shards_.size(); i++) {
+      std::printf("lrucache_%s_total{shard=\"%zu\"} %llu\n", counter.name, i,
+                  static_cast<unsigned long long>(image.shards_[i].stats_.*
+                                                  counter.field));
+    }
+  }
+
+  printShardMetric("size", "gauge", "Elements held.", image,
+                   [](const ShardStatsRecord &s) { return s.size_; });
+  printShardMetric("capacity", "gauge", "Element capacity.", image,
+                   [](const ShardStatsRecord &s) { return s.capacity_; });
+  printShardMetric("admission_throttled", "gauge",
+                   "1 while admission is throttled.", image,
+                   [](const ShardStatsRecord &s) { return s.throttled_; });
+  printShardMetric("list_lock_contended_total", "counter",
+                   "Contended list lock acquisitions.", image,
+                   [](const ShardStatsRecord &s) { return s.listContended_; });
+  printShardMetric("table_lock_contended_total", "counter",
+                   "Slow hash table accessor acquisitions.", image,
+                   [](const ShardStatsRecord &s) { return s.tableContended_; });
+
+  if (image.payload_.sampleEvery_ > 0) {
+    std::printf("# HELP lrucache_op_latency_seconds Sampled operation "
+                "latency.\n# TYPE lrucache_op_latency_seconds summary\n");
+    for (size_t op = 0; op < static_cast<size_t>(LatencyOp::Count); op++) {
+      LatencyHistogram histogram = image.latency(static_cast<LatencyOp>(op));
+      for (double q : {0.5, 0.9, 0.99, 0.999}) {
+        std::printf("lrucache_op_latency_seconds{op=\"%s\",quantile=\"%g\"} "
+                    "%.9f\n",
+                    OpNames[op], q, histogram.percentile(q) / 1e9);
+      }
+      std::printf("lrucache_op_latency_seconds_count{op=\"%s\"} %llu\n",
+                  OpNames[op],
+                  static_cast<unsigned long long>(histogram.count_));
+    }
+  }
+
+  std::printf("# HELP lrucache_stats_age_seconds Time since the stats were "
+              "published.\n# TYPE lrucache_stats_age_seconds gauge\n"
+              "lrucache_stats_age_seconds %.3f\n",
+              secondsSince(image.payload_.publishedAt_));
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::fprintf(stderr,
+                 "usage: %s <pid | segment name> [text|prometheus] "
+                 "[watch seconds]\n",
+                 argv[0]);
+    return 1;
+  }
+
+  std::string name = argv[1];
+  char *end;
+  long long pid = std::strtoll(argv[1], &end, 10);
+  if (*end == '\0') {
+    name = LRUC::statsSegmentName(pid);
+  }
+  bool prometheus = argc > 2 && std::strcmp(argv[2], "prometheus") == 0;
+  double watch = argc > 3 ? std::strtod(argv[3], nullptr) : 0;
+
+  std::unique_ptr<LRUC::StatsSegmentReader> reader =
+      LRUC::StatsSegmentReader::open(name);
+  if (reader == nullptr) {
+    std::fprintf(stderr, "cachectl: no stats segment %s\n", name.c_str());
+    return 1;
+  }
+
+  StatsImage image;
+  do {
+    if (!reader->read(image)) {
+      std::fprintf(stderr, "cachectl: %s not published yet\n", name.c_str());
+      return 1;
+    }
+    if (prometheus) {
+      printPrometheus(image);
+    } else {
+      printText(image);
+    }
+    std::fflush(stdout);
+    if (watch > 0) {
+      std::this_thread::sleep_for(std::chrono::duration<double>(watch));
+    }
+  } while (watch > 0);
+  return 0;
+}
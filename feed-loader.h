@@ -0,0 +1,333 @@
+/**
+ * @author shchang
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define LRUC_FEED_AVX2 1
+#endif
+
+namespace LRUC {
+
+/**
+ * Counters of one loadFeed() run.
+ */
+struct FeedStats {
+  // lines holding an address, blank lines and # comments excluded
+  uint64_t lines_ = 0;
+  uint64_t loaded_ = 0;
+  uint64_t inserted_ = 0;
+  uint64_t skippedIpv6_ = 0;
+  uint64_t malformed_ = 0;
+};
+
+/**
+ * Parse an IPv4 address with an optional /prefix, surrounding blanks and a trailing
+ * '\r' allowed. address is returned in host byte order, masked to its network.
+ * Return false if [begin, end) is no such address.
+ */
+inline bool parseIpv4(const char* begin, const char* end, uint32_t& address, unsigned& prefixLen) {
+  while (begin < end && (*begin == ' ' || *begin == '\t')) {
+    begin++;
+  }
+  while (end > begin && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) {
+    end--;
+  }
+
+  uint32_t result = 0;
+  const char* p = begin;
+  for (int octet = 0; octet < 4; octet++) {
+    if (octet > 0) {
+      if (p == end || *p != '.') {
+        return false;
+      }
+      p++;
+    }
+    unsigned value = 0;
+    const char* digits = p;
+    while (p < end && p - digits < 3 && static_cast<unsigned>(*p - '0') < 10) {
+      value = value * 10 + static_cast<unsigned>(*p - '0');
+      p++;
+    }
+    if (p == digits || value > 255) {
+      return false;
+    }
+    result = (result << 8) | value;
+  }
+
+  prefixLen = 32;
+  if (p < end && *p == '/') {
+    p++;
+    unsigned value = 0;
+    const char* digits = p;
+    while (p < end && p - digits < 2 && static_cast<unsigned>(*p - '0') < 10) {
+      value = value * 10 + static_cast<unsigned>(*p - '0');
+      p++;
+    }
+    if (p == digits || value > 32) {
+      return false;
+    }
+    prefixLen = value;
+  }
+  if (p != end) {
+    return false;
+  }
+
+  address = prefixLen == 0 ? 0 : result & ~((uint64_t(1) << (32 - prefixLen)) - 1);
+  return true;
+}
+
+namespace feed {
+
+/**
+ * Call fn(lineBegin, lineEnd, hasColon) for every line of [begin, end), the last
+ * line may lack its '\n'. hasColon flags IPv6 lines without a second scan.
+ */
+template <class Fn>
+void forEachLineScalar(const char* begin, const char* end, Fn&& fn) {
+  const char* line = begin;
+  while (line < end) {
+    const char* eol = static_cast<const char*>(std::memchr(line, '\n', end - line));
+    if (eol == nullptr) {
+      eol = end;
+    }
+    fn(line, eol, std::memchr(line, ':', eol - line) != nullptr);
+    line = eol + 1;
+  }
+}
+
+#ifdef LRUC_FEED_AVX2
+/**
+ * Same as forEachLineScalar(), classifying 32 bytes at a time: one compare each for
+ * '\n' and ':' yields bitmasks, lines are cut at the set bits of the newline mask.
+ */
+template <class Fn>
+__attribute__((target("avx2"))) void forEachLineAvx2(const char* begin, const char* end, Fn&& fn) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  const __m256i colon = _mm256_set1_epi8(':');
+
+  const char* line = begin;
+  bool colonSeen = false;
+  const char* block = begin;
+  for (; end - block >= 32; block += 32) {
+    __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block));
+    uint32_t newlines = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, newline)));
+    uint32_t colons = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, colon)));
+
+    while (newlines != 0) {
+      unsigned bit = static_cast<unsigned>(__builtin_ctz(newlines));
+      bool hasColon = colonSeen || (colons & ((1u << bit) - 1)) != 0;
+      fn(line, block + bit, hasColon);
+      line = block + bit + 1;
+      colonSeen = false;
+      // drop colons up to and including this newline, 2u << 31 wraps to 0.
+      colons &= ~((2u << bit) - 1);
+      newlines &= newlines - 1;
+    }
+    colonSeen = colonSeen || colons != 0;
+  }
+
+  // tail shorter than a block
+  forEachLineScalar(line, end, [&](const char* b, const char* e, bool hasColon) {
+    fn(b, e, hasColon || (b == line && colonSeen));
+  });
+}
+#endif
+
+template <class Fn>
+void forEachLine(const char* begin, const char* end, Fn&& fn) {
+#ifdef LRUC_FEED_AVX2
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  if (avx2) {
+    forEachLineAvx2(begin, end, fn);
+    return;
+  }
+#endif
+  forEachLineScalar(begin, end, fn);
+}
+
+/**
+ * FeedFile maps a feed read-only for one sequential pass.
+ */
+class FeedFile final {
+ public:
+  FeedFile() : data_(nullptr), size_(0) {}
+
+  ~FeedFile() {
+    if (data_ != nullptr) {
+      ::munmap(const_cast<char*>(data_), size_);
+    }
+  }
+
+  FeedFile(const FeedFile&) = delete;
+  FeedFile& operator=(const FeedFile&) = delete;
+
+  bool open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      return false;
+    }
+
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_ == 0) {
+      ::close(fd);
+      return true;
+    }
+
+    void* addr = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+      size_ = 0;
+      return false;
+    }
+    data_ = static_cast<const char*>(addr);
+    ::madvise(addr, size_, MADV_SEQUENTIAL);
+    return true;
+  }
+
+  const char* data() const {
+    return data_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+ private:
+  const char* data_;
+  size_t size_;
+};
+}  // namespace feed
+
+/**
+ * Bulk load a newline-separated text feed of IPv4 addresses and CIDR networks into
+ * cache, e.g. a blocklist at startup.
+ *
+ * The feed is memory-mapped and cut into chunks at line boundaries, chunks are parsed
+ * in parallel by threads threads (0: all cores). Lines are found with AVX2 where the
+ * CPU supports it. Every address is inserted or assigned, keyed by its network address
+ * in host byte order, with makeValue(address, prefixLen) as value and tag as tag.
+ * Inserts are batched per chunk and grouped by shard, see ScalableLRUCache::insertMany().
+ * IPv6 lines are skipped and counted, as keys are IPv4 only.
+ *
+ * Type concepts:
+ *  TCache is a ScalableLRUCache with an integral key of at least 32 bits.
+ * Returns false if path can't be read, stats tells how many lines were loaded.
+ */
+template <class TCache, class MakeValue>
+bool loadFeed(TCache& cache, const std::string& path, MakeValue&& makeValue, FeedStats& stats,
+              typename TCache::Tag tag = 0, size_t threads = 0) {
+  constexpr size_t BatchSize = 4096;
+  constexpr size_t MinChunk = 1 << 20;
+
+  stats = FeedStats();
+  feed::FeedFile file;
+  if (!file.open(path)) {
+    return false;
+  }
+  const char* data = file.data();
+  size_t size = file.size();
+  if (size == 0) {
+    return true;
+  }
+
+  tbb::task_arena arena(threads > 0 ? static_cast<int>(threads) : tbb::task_arena::automatic);
+  size_t chunkCount = std::max<size_t>(1, std::min(size / MinChunk, static_cast<size_t>(arena.max_concurrency()) * 4));
+
+  // chunk i covers [starts[i], starts[i + 1]), every start follows a '\n'.
+  std::vector<size_t> starts(chunkCount + 1, size);
+  starts[0] = 0;
+  for (size_t i = 1; i < chunkCount; i++) {
+    size_t nominal = std::max(size / chunkCount * i, starts[i - 1]);
+    const char* eol = static_cast<const char*>(std::memchr(data + nominal, '\n', size - nominal));
+    starts[i] = eol == nullptr ? size : static_cast<size_t>(eol - data) + 1;
+  }
+
+  using Key = typename TCache::Key;
+  using Value = typename TCache::Value;
+
+  std::atomic<uint64_t> lines{0}, loaded{0}, inserted{0}, skippedIpv6{0}, malformed{0};
+  arena.execute([&] {
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, chunkCount, 1), [&](const tbb::blocked_range<size_t>& range) {
+      std::vector<Key> keys;
+      std::vector<Value> values;
+      keys.reserve(BatchSize);
+      values.reserve(BatchSize);
+      FeedStats local;
+
+      auto flush = [&] {
+        local.inserted_ += cache.insertMany(keys.data(), values.data(), keys.size(), tag, true);
+        keys.clear();
+        values.clear();
+      };
+
+      for (size_t i = range.begin(); i != range.end(); i++) {
+        feed::forEachLine(data + starts[i], data + starts[i + 1], [&](const char* b, const char* e, bool hasColon) {
+          while (b < e && (*b == ' ' || *b == '\t')) {
+            b++;
+          }
+          if (b == e || *b == '#' || *b == '\r') {
+            return;
+          }
+          local.lines_++;
+          if (hasColon) {
+            local.skippedIpv6_++;
+            return;
+          }
+
+          uint32_t address;
+          unsigned prefixLen;
+          if (!parseIpv4(b, e, address, prefixLen)) {
+            local.malformed_++;
+            return;
+          }
+          local.loaded_++;
+          keys.push_back(static_cast<Key>(address));
+          values.push_back(makeValue(address, prefixLen));
+          if (keys.size() == BatchSize) {
+            flush();
+          }
+        });
+      }
+      flush();
+
+      lines += local.lines_;
+      loaded += local.loaded_;
+      inserted += local.inserted_;
+      skippedIpv6 += local.skippedIpv6_;
+      malformed += local.malformed_;
+    });
+  });
+
+  stats.lines_ = lines;
+  stats.loaded_ = loaded;
+  stats.inserted_ = inserted;
+  stats.skippedIpv6_ = skippedIpv6;
+  stats.malformed_ = malformed;
+  return true;
+}
+}  // namespace LRUC
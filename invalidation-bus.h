@@ -0,0 +1,551 @@
+/**
+ * @author shchang
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include <dirent.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace LRUC {
+
+/**
+ * Invalidation bus: a worker learning that verdicts changed publishes key / prefix
+ * invalidations, every other process on the host erases them from its own cache.
+ *
+ * Message (one datagram):
+ *  InvalidationHeader
+ *  count * entry: kind (uint8), prefix length (uint8), key bytes
+ *
+ * Every publisher numbers its messages. A subscriber tracks the last sequence per
+ * publisher, a gap means messages were lost (e.g. a full receive buffer), and as it
+ * can't know which keys it missed, it invalidates its whole cache. An idle publisher
+ * sends heartbeats, messages without entries repeating its last sequence, so losing
+ * its last messages is noticed too.
+ */
+struct InvalidationHeader final {
+  static constexpr uint64_t Magic = 0x31564e494355524cULL;  // "LRUCINV1" little-endian
+
+  uint64_t magic_;
+  uint64_t publisher_;
+  uint64_t sequence_;
+  uint32_t keySize_;
+  uint32_t count_;
+};
+
+enum class InvalidationKind : uint8_t { Key = 1, Prefix, All };
+
+// datagram payload limit, keeps messages well below socket buffer sizes.
+constexpr size_t MaxInvalidationMessage = 4096;
+
+/**
+ * Publishes invalidations through a sender transport.
+ * Invalidations are batched and sent by a background thread flushInterval after the
+ * first one, or as soon as a message is full. While idle, a heartbeat is sent every
+ * heartbeatInterval. Thread-safe.
+ *
+ * Type concepts:
+ *  TKey must be trivially copyable.
+ *  TSender provides bool send(const void* data, size_t size).
+ */
+template <class TKey, class TSender>
+class InvalidationPublisher final {
+  static_assert(std::is_trivially_copyable<TKey>::value, "InvalidationPublisher requires a trivially copyable key");
+
+  static constexpr size_t EntrySize = 2 + sizeof(TKey);
+  static constexpr size_t MaxEntries = (MaxInvalidationMessage - sizeof(InvalidationHeader)) / EntrySize;
+
+ private:
+  TSender& sender_;
+  std::chrono::milliseconds flushInterval_;
+  std::chrono::milliseconds heartbeatInterval_;
+  uint64_t publisher_;
+  uint64_t sequence_;
+
+  std::mutex mutex_;
+  std::condition_variable flushed_;
+  std::vector<char> pending_;
+  uint32_t pendingCount_;
+  bool stopping_;
+  std::thread flusher_;
+
+ private:
+  /**
+   * Send pending entries as one message. Caller holds mutex_.
+   */
+  bool sendPending() {
+    if (pendingCount_ == 0) {
+      return true;
+    }
+
+    InvalidationHeader header{InvalidationHeader::Magic, publisher_, ++sequence_, sizeof(TKey), pendingCount_};
+    std::memcpy(pending_.data(), &header, sizeof(header));
+    // the sequence is consumed even if sending failed, so subscribers see the gap.
+    bool sent = sender_.send(pending_.data(), pending_.size());
+
+    pending_.resize(sizeof(InvalidationHeader));
+    pendingCount_ = 0;
+    // the flusher stops waiting for a batch already sent.
+    flushed_.notify_one();
+    return sent;
+  }
+
+  /**
+   * Send the last sequence without entries. Caller holds mutex_, nothing is pending.
+   */
+  void sendHeartbeat() {
+    InvalidationHeader header{InvalidationHeader::Magic, publisher_, sequence_, sizeof(TKey), 0};
+    std::memcpy(pending_.data(), &header, sizeof(header));
+    sender_.send(pending_.data(), pending_.size());
+  }
+
+  void add(InvalidationKind kind, uint8_t prefixLen, const TKey& key) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    size_t offset = pending_.size();
+    pending_.resize(offset + EntrySize);
+    pending_[offset] = static_cast<char>(kind);
+    pending_[offset + 1] = static_cast<char>(prefixLen);
+    std::memcpy(pending_.data() + offset + 2, &key, sizeof(key));
+
+    if (++pendingCount_ == MaxEntries) {
+      sendPending();
+    } else if (pendingCount_ == 1) {
+      lock.unlock();
+      flushed_.notify_one();
+    }
+  }
+
+  void flushLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+      if (pendingCount_ == 0) {
+        if (!flushed_.wait_for(lock, heartbeatInterval_, [this] { return stopping_ || pendingCount_ > 0; })) {
+          sendHeartbeat();
+        }
+        continue;
+      }
+      // let more invalidations join the message.
+      flushed_.wait_for(lock, flushInterval_, [this] { return stopping_ || pendingCount_ == 0; });
+      sendPending();
+    }
+  }
+
+ public:
+  /**
+   * flushInterval bounds how long an invalidation waits for others to share its message.
+   * heartbeatInterval bounds how long subscribers take to notice a lost last message.
+   */
+  explicit InvalidationPublisher(TSender& sender,
+                                 std::chrono::milliseconds flushInterval = std::chrono::milliseconds(1),
+                                 std::chrono::milliseconds heartbeatInterval = std::chrono::seconds(1))
+    : sender_(sender),
+      flushInterval_(flushInterval),
+      heartbeatInterval_(heartbeatInterval),
+      publisher_(0),
+      sequence_(0),
+      pending_(sizeof(InvalidationHeader)),
+      pendingCount_(0),
+      stopping_(false) {
+    // distinct across processes and restarts.
+    publisher_ = static_cast<uint64_t>(::getpid()) << 32 ^
+                 static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count()) ^
+                 reinterpret_cast<uintptr_t>(this);
+    flusher_ = std::thread([this] { flushLoop(); });
+  }
+
+  ~InvalidationPublisher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    flushed_.notify_one();
+    flusher_.join();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    sendPending();
+  }
+
+  InvalidationPublisher(const InvalidationPublisher&) = delete;
+  InvalidationPublisher& operator=(const InvalidationPublisher&) = delete;
+
+  void invalidate(const TKey& key) {
+    add(InvalidationKind::Key, 0, key);
+  }
+
+  /**
+   * Invalidate every key sharing the leading prefixLen bits with prefix,
+   * see ScalableLRUCache::erasePrefix().
+   */
+  void invalidatePrefix(const TKey& prefix, unsigned prefixLen) {
+    add(InvalidationKind::Prefix, static_cast<uint8_t>(prefixLen), prefix);
+  }
+
+  void invalidateAll() {
+    add(InvalidationKind::All, 0, TKey{});
+  }
+
+  /**
+   * Send pending invalidations now. Return false if the transport failed.
+   */
+  bool flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return sendPending();
+  }
+
+  uint64_t publisherId() const {
+    return publisher_;
+  }
+};
+
+/**
+ * Applies invalidations received through a receiver transport to cache, on a
+ * background thread. Keys of one message are erased as a batch.
+ *
+ * Type concepts:
+ *  TCache provides eraseMany(keys, count), erasePrefix(prefix, len) and invalidateAll(),
+ *  e.g. ScalableLRUCache with KeyIndex.
+ *  TReceiver provides ssize_t receive(void* buffer, size_t capacity, int timeoutMs),
+ *  returning the message size, or <= 0 if none arrived.
+ */
+template <class TKey, class TCache, class TReceiver>
+class InvalidationSubscriber final {
+  static constexpr size_t EntrySize = 2 + sizeof(TKey);
+  static constexpr int PollMs = 100;
+
+ private:
+  TCache& cache_;
+  TReceiver& receiver_;
+  // publisher id -> last applied sequence
+  std::unordered_map<uint64_t, uint64_t> sequences_;
+  std::atomic<uint64_t> applied_;
+  std::atomic<uint64_t> gaps_;
+  std::atomic<bool> stopping_;
+  std::thread thread_;
+
+ private:
+  void apply(const char* data, size_t size) {
+    InvalidationHeader header;
+    if (size < sizeof(header)) {
+      return;
+    }
+    std::memcpy(&header, data, sizeof(header));
+    if (header.magic_ != InvalidationHeader::Magic || header.keySize_ != sizeof(TKey) ||
+        size != sizeof(header) + header.count_ * EntrySize) {
+      return;
+    }
+
+    auto it = sequences_.find(header.publisher_);
+    if (it != sequences_.end()) {
+      // a heartbeat repeats the last sequence, a message takes the next one.
+      uint64_t expected = it->second + (header.count_ > 0 ? 1 : 0);
+      if (header.sequence_ < expected) {
+        // duplicate
+        return;
+      }
+      if (header.sequence_ != expected) {
+        // lost messages, which keys is unknown.
+        gaps_.fetch_add(1, std::memory_order_relaxed);
+        cache_.invalidateAll();
+      }
+    }
+    sequences_[header.publisher_] = header.sequence_;
+
+    std::vector<TKey> keys;
+    keys.reserve(header.count_);
+    const char* entry = data + sizeof(header);
+    for (uint32_t i = 0; i < header.count_; i++, entry += EntrySize) {
+      TKey key;
+      std::memcpy(&key, entry + 2, sizeof(key));
+      switch (static_cast<InvalidationKind>(entry[0])) {
+        case InvalidationKind::Key:
+          keys.push_back(key);
+          break;
+        case InvalidationKind::Prefix:
+          cache_.erasePrefix(key, static_cast<uint8_t>(entry[1]));
+          break;
+        case InvalidationKind::All:
+          cache_.invalidateAll();
+          break;
+      }
+    }
+
+    cache_.eraseMany(keys.data(), keys.size());
+    applied_.fetch_add(header.count_, std::memory_order_relaxed);
+  }
+
+  void receiveLoop() {
+    std::vector<char> buffer(MaxInvalidationMessage);
+    while (!stopping_.load(std::memory_order_relaxed)) {
+      ssize_t size = receiver_.receive(buffer.data(), buffer.size(), PollMs);
+      if (size > 0) {
+        apply(buffer.data(), static_cast<size_t>(size));
+      }
+    }
+  }
+
+ public:
+  InvalidationSubscriber(TCache& cache, TReceiver& receiver)
+    : cache_(cache), receiver_(receiver), applied_(0), gaps_(0), stopping_(false) {
+    thread_ = std::thread([this] { receiveLoop(); });
+  }
+
+  ~InvalidationSubscriber() {
+    stopping_.store(true);
+    thread_.join();
+  }
+
+  InvalidationSubscriber(const InvalidationSubscriber&) = delete;
+  InvalidationSubscriber& operator=(const InvalidationSubscriber&) = delete;
+
+  /**
+   * Number of invalidation entries applied.
+   */
+  uint64_t applied() const {
+    return applied_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Number of sequence gaps, each of which invalidated the whole cache.
+   */
+  uint64_t gaps() const {
+    return gaps_.load(std::memory_order_relaxed);
+  }
+};
+
+/**
+ * Unix datagram transport. Every subscriber binds a socket inside a shared directory,
+ * publishers send each message to every socket found there. Sockets of exited
+ * subscribers are removed by the next publisher failing to reach them.
+ */
+class DatagramSender final {
+  static constexpr auto RescanInterval = std::chrono::seconds(1);
+
+ private:
+  std::string directory_;
+  int sock_;
+  std::vector<std::string> peers_;
+  std::chrono::steady_clock::time_point rescanned_;
+
+ private:
+  void rescan() {
+    peers_.clear();
+    DIR* dir = ::opendir(directory_.c_str());
+    if (dir == nullptr) {
+      return;
+    }
+    while (dirent* entry = ::readdir(dir)) {
+      std::string name = entry->d_name;
+      if (name.size() > 5 && name.compare(name.size() - 5, 5, ".sock") == 0) {
+        peers_.push_back(directory_ + "/" + name);
+      }
+    }
+    ::closedir(dir);
+    rescanned_ = std::chrono::steady_clock::now();
+  }
+
+ public:
+  explicit DatagramSender(const std::string& directory)
+    : directory_(directory), sock_(::socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) {
+    rescan();
+  }
+
+  ~DatagramSender() {
+    if (sock_ >= 0) {
+      ::close(sock_);
+    }
+  }
+
+  DatagramSender(const DatagramSender&) = delete;
+  DatagramSender& operator=(const DatagramSender&) = delete;
+
+  /**
+   * Send data to every subscriber. Return false if any could not be reached, it will
+   * detect the gap.
+   */
+  bool send(const void* data, size_t size) {
+    if (std::chrono::steady_clock::now() - rescanned_ > RescanInterval) {
+      rescan();
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < peers_.size();) {
+      sockaddr_un addr{};
+      addr.sun_family = AF_UNIX;
+      std::strncpy(addr.sun_path, peers_[i].c_str(), sizeof(addr.sun_path) - 1);
+
+      if (::sendto(sock_, data, size, 0, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) >= 0) {
+        i++;
+        continue;
+      }
+
+      if (errno == ECONNREFUSED || errno == ENOENT) {
+        // subscriber exited without cleaning up.
+        ::unlink(peers_[i].c_str());
+        peers_.erase(peers_.begin() + i);
+        continue;
+      }
+      // EAGAIN: the subscriber is behind, it will see a gap.
+      ok = false;
+      i++;
+    }
+    return ok;
+  }
+};
+
+class DatagramReceiver final {
+ private:
+  std::string path_;
+  int sock_;
+
+ public:
+  /**
+   * Bind a socket named after this process in directory, which must exist.
+   */
+  explicit DatagramReceiver(const std::string& directory) : sock_(-1) {
+    static std::atomic<uint32_t> instances{0};
+    path_ = directory + "/" + std::to_string(::getpid()) + "-" + std::to_string(instances.fetch_add(1)) + ".sock";
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path_.size() >= sizeof(addr.sun_path)) {
+      return;
+    }
+    std::memcpy(addr.sun_path, path_.c_str(), path_.size());
+
+    sock_ = ::socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    ::unlink(path_.c_str());
+    if (sock_ >= 0 && ::bind(sock_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+      ::close(sock_);
+      sock_ = -1;
+    }
+  }
+
+  ~DatagramReceiver() {
+    if (sock_ >= 0) {
+      ::close(sock_);
+      ::unlink(path_.c_str());
+    }
+  }
+
+  DatagramReceiver(const DatagramReceiver&) = delete;
+  DatagramReceiver& operator=(const DatagramReceiver&) = delete;
+
+  bool isOpen() const {
+    return sock_ >= 0;
+  }
+
+  ssize_t receive(void* buffer, size_t capacity, int timeoutMs) {
+    pollfd pfd{sock_, POLLIN, 0};
+    if (sock_ < 0 || ::poll(&pfd, 1, timeoutMs) <= 0) {
+      return -1;
+    }
+    return ::recv(sock_, buffer, capacity, MSG_DONTWAIT);
+  }
+};
+
+/**
+ * In-process stand-in for the datagram transport, e.g. for tests: every message sent
+ * through sender() is delivered to every receiver(). dropNext() loses messages on
+ * purpose to exercise gap detection.
+ */
+class LoopbackBus final {
+ public:
+  class Receiver final {
+    friend class LoopbackBus;
+
+   private:
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<std::vector<char>> messages_;
+
+   public:
+    ssize_t receive(void* buffer, size_t capacity, int timeoutMs) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (!ready_.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this] { return !messages_.empty(); })) {
+        return -1;
+      }
+      std::vector<char> message = std::move(messages_.front());
+      messages_.pop_front();
+      size_t size = std::min(capacity, message.size());
+      std::memcpy(buffer, message.data(), size);
+      return static_cast<ssize_t>(size);
+    }
+  };
+
+  class Sender final {
+    friend class LoopbackBus;
+
+   private:
+    LoopbackBus& bus_;
+    explicit Sender(LoopbackBus& bus) : bus_(bus) {}
+
+   public:
+    bool send(const void* data, size_t size) {
+      return bus_.deliver(data, size);
+    }
+  };
+
+ private:
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<Receiver>> receivers_;
+  std::vector<std::unique_ptr<Sender>> senders_;
+  size_t drop_ = 0;
+
+  bool deliver(const void* data, size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (drop_ > 0) {
+      drop_--;
+      return false;
+    }
+    for (auto& receiver : receivers_) {
+      {
+        std::lock_guard<std::mutex> receiverLock(receiver->mutex_);
+        const char* bytes = static_cast<const char*>(data);
+        receiver->messages_.emplace_back(bytes, bytes + size);
+      }
+      receiver->ready_.notify_one();
+    }
+    return true;
+  }
+
+ public:
+  Sender& sender() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    senders_.emplace_back(new Sender(*this));
+    return *senders_.back();
+  }
+
+  Receiver& receiver() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    receivers_.emplace_back(new Receiver());
+    return *receivers_.back();
+  }
+
+  /**
+   * Lose the next count messages.
+   */
+  void dropNext(size_t count) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    drop_ = count;
+  }
+};
+}  // namespace LRUC
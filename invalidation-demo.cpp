@@ -0,0 +1,146 @@
+// Self-check of the invalidation bus (invalidation-bus.h) over LoopbackBus: one
+// publisher and one subscriber in this process, no sockets involved.
+//
+// usage: invalidation-demo
+//
+// Checks that invalidations are batched into one message, that a message delivered
+// twice is applied once, and that a lost message, also the last one a publisher
+// sent, makes the subscriber invalidate the whole cache. Prints one line per
+// check, exits 1 if any failed.
+
+#include "invalidation-bus.h"
+#include "scale-lrucache.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Key = int;
+using Cache = LRUC::ScalableLRUCache<Key, int, tbb::tbb_hash_compare<Key>, true>;
+
+// forwards to the bus, remembering what was sent. lose drops that many messages
+// carrying invalidations, heartbeats still pass.
+struct RecordingSender {
+  LRUC::LoopbackBus::Sender &bus;
+  size_t messages = 0;
+  std::vector<char> last;
+  std::atomic<size_t> lose{0};
+
+  explicit RecordingSender(LRUC::LoopbackBus::Sender &bus) : bus(bus) {}
+
+  bool send(const void *data, size_t size) {
+    if (size > sizeof(LRUC::InvalidationHeader) && lose > 0) {
+      lose--;
+      return false;
+    }
+    messages++;
+    const char *bytes = static_cast<const char *>(data);
+    last.assign(bytes, bytes + size);
+    return bus.send(data, size);
+  }
+};
+
+using Publisher = LRUC::InvalidationPublisher<Key, RecordingSender>;
+using Subscriber =
+    LRUC::InvalidationSubscriber<Key, Cache, LRUC::LoopbackBus::Receiver>;
+
+int failures = 0;
+
+void check(bool ok, const char *what) {
+  std::printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  if (!ok)
+    failures++;
+}
+
+template <class Ready> bool waitFor(Ready &&ready) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (!ready()) {
+    if (std::chrono::steady_clock::now() > deadline)
+      return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return true;
+}
+
+bool cached(Cache &cache, Key key) {
+  Cache::ConstAccessor accessor;
+  return cache.find(accessor, key);
+}
+
+size_t countCached(Cache &cache, Key lo, Key hi) {
+  size_t count = 0;
+  for (Key key = lo; key < hi; key++)
+    count += cached(cache, key);
+  return count;
+}
+
+} // namespace
+
+int main() {
+  Cache cache(1024, 4);
+  LRUC::LoopbackBus bus;
+  RecordingSender sender(bus.sender());
+  Subscriber subscriber(cache, bus.receiver());
+  // only explicit flush() sends, so batches are deterministic.
+  Publisher publisher(sender, std::chrono::hours(1), std::chrono::hours(1));
+
+  for (Key key = 0; key < 100; key++)
+    cache.insert(key, key);
+
+  // batching: 50 invalidations, one message.
+  for (Key key = 0; key < 50; key++)
+    publisher.invalidate(key);
+  publisher.flush();
+  check(sender.messages == 1, "50 invalidations sent as one message");
+  check(waitFor([&] { return subscriber.applied() == 50; }),
+        "subscriber applied 50 entries");
+  check(countCached(cache, 0, 50) == 0 && countCached(cache, 50, 100) == 50,
+        "exactly the invalidated keys are gone");
+
+  // duplicate suppression: the same message again must not erase anything.
+  for (Key key = 0; key < 50; key++)
+    cache.insert(key, key);
+  bus.sender().send(sender.last.data(), sender.last.size());
+  publisher.invalidate(60);
+  publisher.flush();
+  check(waitFor([&] { return subscriber.applied() == 51; }),
+        "duplicate skipped, next message applied");
+  check(countCached(cache, 0, 50) == 50 && !cached(cache, 60),
+        "duplicate left re-inserted keys alone");
+  check(subscriber.gaps() == 0, "no gap reported so far");
+
+  // gap detection: a lost message invalidates the whole cache.
+  bus.dropNext(1);
+  publisher.invalidate(70);
+  check(!publisher.flush(), "flush reports the lost message");
+  publisher.invalidate(80);
+  publisher.flush();
+  check(waitFor([&] { return subscriber.gaps() == 1; }),
+        "subscriber detected the gap");
+  check(waitFor([&] { return countCached(cache, 0, 100) == 0; }),
+        "gap invalidated the whole cache");
+
+  // tail loss: nothing follows the lost message but the heartbeat.
+  RecordingSender tailSender(bus.sender());
+  Publisher tail(tailSender, std::chrono::hours(1), std::chrono::milliseconds(10));
+  for (Key key = 0; key < 100; key++)
+    cache.insert(key, key);
+  tail.invalidate(90);
+  tail.flush();
+  check(waitFor([&] { return subscriber.applied() == 53; }),
+        "second publisher's message applied");
+  tailSender.lose = 1;
+  tail.invalidate(91);
+  check(!tail.flush(), "flush reports the lost last message");
+  check(waitFor([&] { return subscriber.gaps() == 2; }),
+        "heartbeat revealed the lost last message");
+  check(waitFor([&] { return countCached(cache, 0, 100) == 0; }),
+        "tail loss invalidated the whole cache");
+
+  std::printf("%s\n", failures == 0 ? "all checks passed" : "checks failed");
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,314 @@
+/**
+ * @author shchang
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace LRUC {
+
+/**
+ * Kind of a change-data-capture event.
+ * Insert/Update carry key and value, Erase/Evict the key, InvalidateTag the tag.
+ */
+enum class ChangeKind : uint8_t { Insert = 1, Update, Erase, Evict, InvalidateAll, InvalidateTag, Clear };
+
+template <class TKey, class TValue>
+struct ChangeEvent {
+  uint64_t sequence_;
+  ChangeKind kind_;
+  uint8_t tag_;
+  TKey key_;
+  TValue value_;
+};
+
+/**
+ * ChangeRing is a bounded, lossy ring of mutations of one LRUCache shard.
+ *
+ * Writers never wait: each claims a sequence number with one fetch_add and writes its
+ * slot under a per-slot seqlock, overwriting the event one lap older. Readers never
+ * block writers: they copy a slot and check its version before and after, so a reader
+ * falling more than a lap behind learns it lost events and has to resync.
+ *
+ * Events of one key are published while the shard holds that key's lock, so they
+ * appear in sequence order.
+ *
+ * Type concepts:
+ *  TKey and TValue must be trivially copyable, events are copied racily.
+ */
+template <class TKey, class TValue>
+class ChangeRing final {
+ public:
+  using Key = TKey;
+  using Value = TValue;
+  using Event = ChangeEvent<TKey, TValue>;
+
+  enum class ReadStatus { Ok, Empty, Lost };
+
+ private:
+  struct alignas(64) Slot {
+    // 2 * sequence + 1 while written, 2 * sequence + 2 once complete
+    std::atomic<uint64_t> version_;
+    Event event_;
+  };
+
+ private:
+  std::unique_ptr<Slot[]> slots_;
+  size_t mask_;
+  alignas(64) std::atomic<uint64_t> next_;
+
+ public:
+  /**
+   * capacity is rounded up to a power of 2.
+   */
+  explicit ChangeRing(size_t capacity) : next_(0) {
+    // checked here rather than on the class, caches only hold pointers to rings.
+    static_assert(std::is_trivially_copyable<TKey>::value && std::is_trivially_copyable<TValue>::value,
+                  "ChangeRing requires trivially copyable key and value");
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    slots_.reset(new Slot[size]);
+    mask_ = size - 1;
+    for (size_t i = 0; i < size; i++) {
+      slots_[i].version_.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  ChangeRing(const ChangeRing&) = delete;
+  ChangeRing& operator=(const ChangeRing&) = delete;
+
+  /**
+   * Publish an event, key and value may be nullptr if kind doesn't carry them.
+   */
+  void publish(ChangeKind kind, uint8_t tag, const TKey* key, const TValue* value) {
+    uint64_t sequence = next_.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = slots_[sequence & mask_];
+
+    slot.version_.store(2 * sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.event_.sequence_ = sequence;
+    slot.event_.kind_ = kind;
+    slot.event_.tag_ = tag;
+    if (key != nullptr) {
+      std::memcpy(&slot.event_.key_, key, sizeof(TKey));
+    }
+    if (value != nullptr) {
+      std::memcpy(&slot.event_.value_, value, sizeof(TValue));
+    }
+
+    slot.version_.store(2 * sequence + 2, std::memory_order_release);
+  }
+
+  /**
+   * Copy event sequence into event.
+   * Empty: not published yet. Lost: already overwritten.
+   */
+  ReadStatus read(uint64_t sequence, Event& event) const {
+    const Slot& slot = slots_[sequence & mask_];
+    uint64_t expected = 2 * sequence + 2;
+
+    uint64_t before = slot.version_.load(std::memory_order_acquire);
+    if (before < expected) {
+      // not claimed yet or still being written
+      return ReadStatus::Empty;
+    }
+    if (before > expected) {
+      return ReadStatus::Lost;
+    }
+
+    std::memcpy(static_cast<void*>(&event), &slot.event_, sizeof(Event));
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    uint64_t after = slot.version_.load(std::memory_order_relaxed);
+    return after == expected && event.sequence_ == sequence ? ReadStatus::Ok : ReadStatus::Lost;
+  }
+
+  /**
+   * Sequence of the next event to be published.
+   */
+  uint64_t head() const {
+    return next_.load(std::memory_order_acquire);
+  }
+
+  size_t capacity() const {
+    return mask_ + 1;
+  }
+};
+
+/**
+ * ChangeFeedReader tails the change rings of every shard of a cache, starting at
+ * their current heads.
+ * Not thread-safe, one reader per consumer.
+ */
+template <class TKey, class TValue>
+class ChangeFeedReader final {
+ public:
+  using Ring = ChangeRing<TKey, TValue>;
+  using Event = typename Ring::Event;
+
+ private:
+  std::vector<Ring*> rings_;
+  std::vector<uint64_t> positions_;
+
+ public:
+  explicit ChangeFeedReader(const std::vector<Ring*>& rings) : rings_(rings), positions_(rings.size()) {
+    seekToHead();
+  }
+
+  /**
+   * Skip everything published so far, e.g. before a resync.
+   */
+  void seekToHead() {
+    for (size_t i = 0; i < rings_.size(); i++) {
+      positions_[i] = rings_[i]->head();
+    }
+  }
+
+  /**
+   * Call fn(event) for up to maxEvents pending events of every shard.
+   * Return false if events were lost since the last poll, the consumer must resync.
+   */
+  template <class Fn>
+  bool poll(Fn&& fn, size_t maxEvents = std::numeric_limits<size_t>::max()) {
+    Event event;
+    for (size_t i = 0; i < rings_.size(); i++) {
+      for (size_t n = 0; n < maxEvents; n++) {
+        typename Ring::ReadStatus status = rings_[i]->read(positions_[i], event);
+        if (status == Ring::ReadStatus::Empty) {
+          break;
+        }
+        if (status == Ring::ReadStatus::Lost) {
+          return false;
+        }
+        fn(static_cast<const Event&>(event));
+        positions_[i]++;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Events published but not consumed yet, summed over shards.
+   */
+  uint64_t lag() const {
+    uint64_t lag = 0;
+    for (size_t i = 0; i < rings_.size(); i++) {
+      lag += rings_[i]->head() - positions_[i];
+    }
+    return lag;
+  }
+};
+
+/**
+ * CacheFollower keeps replica in sync with the change feed of source, e.g. a read
+ * replica on another NUMA node. Whenever events were lost or lag exceeds maxLag, the
+ * replica is rebuilt from a snapshot of source written to resyncPath; events published
+ * meanwhile are replayed on top, which converges as every event carries the full state
+ * of its key. Replica evicts on its own as well, give it at least the capacity of source.
+ *
+ * Type concepts:
+ *  TSource and TReplica are ScalableLRUCache instantiations with equal key and value,
+ *  source has the change feed enabled.
+ */
+template <class TSource, class TReplica>
+class CacheFollower final {
+ public:
+  using Ring = typename TSource::ChangeFeed;
+  using Reader = ChangeFeedReader<typename Ring::Key, typename Ring::Value>;
+  using Event = typename Reader::Event;
+
+ private:
+  TSource& source_;
+  TReplica& replica_;
+  Reader reader_;
+  std::string resyncPath_;
+  uint64_t maxLag_;
+  uint64_t resyncs_;
+  bool resyncPending_;
+
+ private:
+  /**
+   * Apply one event. Invalidations and clear() are published by every shard and not
+   * ordered against events of other shards, they are applied by a resync instead.
+   */
+  void apply(const Event& event) {
+    if (resyncPending_) {
+      return;
+    }
+    switch (event.kind_) {
+      case ChangeKind::Insert:
+      case ChangeKind::Update:
+        replica_.insertOrAssign(event.key_, event.value_, event.tag_);
+        break;
+      case ChangeKind::Erase:
+      case ChangeKind::Evict:
+        replica_.erase(event.key_);
+        break;
+      case ChangeKind::InvalidateAll:
+      case ChangeKind::InvalidateTag:
+      case ChangeKind::Clear:
+        resyncPending_ = true;
+        break;
+    }
+  }
+
+ public:
+  CacheFollower(TSource& source, TReplica& replica, const std::string& resyncPath, uint64_t maxLag)
+    : source_(source),
+      replica_(replica),
+      reader_(source.changeRings()),
+      resyncPath_(resyncPath),
+      maxLag_(maxLag),
+      resyncs_(0),
+      resyncPending_(false) {}
+
+  /**
+   * Rebuild replica from a snapshot of source.
+   * Return false if the snapshot could not be written or loaded.
+   */
+  bool resync() {
+    resyncs_++;
+    resyncPending_ = false;
+    // events from here on are replayed after loading.
+    reader_.seekToHead();
+    if (!source_.snapshot(resyncPath_)) {
+      return false;
+    }
+    replica_.clear();
+    return replica_.load(resyncPath_);
+  }
+
+  /**
+   * Apply pending events, resyncing if the follower fell behind.
+   * Return false if a resync failed.
+   */
+  bool poll() {
+    if (reader_.lag() > maxLag_) {
+      return resync();
+    }
+    if (!reader_.poll([this](const Event& event) { apply(event); }) || resyncPending_) {
+      return resync();
+    }
+    return true;
+  }
+
+  uint64_t lag() const {
+    return reader_.lag();
+  }
+
+  uint64_t resyncs() const {
+    return resyncs_;
+  }
+};
+}  // namespace LRUC
@@ -0,0 +1,197 @@
+/**
+ * @author shchang
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include "lrucache-latency.h"
+
+namespace LRUC {
+
+/**
+ * Contention of one lock, histograms in ticks, see LatencyHistogram.
+ */
+struct LockStats {
+  uint64_t acquisitions_ = 0;
+  // acquisitions that had to wait, and try_lock() calls that failed
+  uint64_t contended_ = 0;
+  uint64_t failedTries_ = 0;
+  // wait of contended acquisitions, and time held
+  LatencyHistogram wait_;
+  LatencyHistogram hold_;
+};
+
+/**
+ * Contention of the locks of one shard, see ScalableLRUCache::topContendedShards().
+ */
+struct ShardContention {
+  size_t shard_ = 0;
+  // listMutex_, and the hash table's bucket and element locks
+  LockStats list_;
+  LockStats table_;
+};
+
+/**
+ * LatencyHistogram filled concurrently with relaxed increments.
+ */
+class AtomicHistogram final {
+ private:
+  std::atomic<uint64_t> buckets_[LatencyHistogram::BucketCount];
+
+ public:
+  AtomicHistogram() {
+    for (auto& bucket : buckets_) {
+      bucket.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void record(uint64_t ticks) {
+    buckets_[LatencyHistogram::bucketOf(ticks)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  LatencyHistogram snapshot() const {
+    LatencyHistogram histogram;
+    histogram.nanosPerTick_ = nanosPerTick();
+    for (size_t i = 0; i < LatencyHistogram::BucketCount; i++) {
+      histogram.buckets_[i] = buckets_[i].load(std::memory_order_relaxed);
+      histogram.count_ += histogram.buckets_[i];
+    }
+    return histogram;
+  }
+};
+
+/**
+ * ProfiledMutex is a std::mutex recording acquisitions, contended acquisitions with
+ * their wait, and hold times. An acquisition is contended if try_lock() fails first.
+ * Counters other than the wait of a contended acquisition are written while holding
+ * the mutex, so they add no contention of their own. Costs two TSC reads per
+ * acquisition.
+ */
+class ProfiledMutex final {
+ private:
+  std::mutex mutex_;
+  // TSC at acquisition, written and read under mutex_
+  uint64_t acquiredAt_ = 0;
+  std::atomic<uint64_t> acquisitions_{0};
+  std::atomic<uint64_t> contended_{0};
+  std::atomic<uint64_t> failedTries_{0};
+  AtomicHistogram wait_;
+  AtomicHistogram hold_;
+
+ public:
+  ProfiledMutex() = default;
+  ProfiledMutex(const ProfiledMutex&) = delete;
+  ProfiledMutex& operator=(const ProfiledMutex&) = delete;
+
+  void lock() {
+    if (!mutex_.try_lock()) {
+      uint64_t start = latencyTicks();
+      mutex_.lock();
+      acquiredAt_ = latencyTicks();
+      contended_.fetch_add(1, std::memory_order_relaxed);
+      wait_.record(acquiredAt_ - start);
+    } else {
+      acquiredAt_ = latencyTicks();
+    }
+    acquisitions_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  bool try_lock() {
+    if (!mutex_.try_lock()) {
+      failedTries_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    acquiredAt_ = latencyTicks();
+    acquisitions_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  void unlock() {
+    hold_.record(latencyTicks() - acquiredAt_);
+    mutex_.unlock();
+  }
+
+  LockStats stats() const {
+    LockStats stats;
+    stats.acquisitions_ = acquisitions_.load(std::memory_order_relaxed);
+    stats.contended_ = contended_.load(std::memory_order_relaxed);
+    stats.failedTries_ = failedTries_.load(std::memory_order_relaxed);
+    stats.wait_ = wait_.snapshot();
+    stats.hold_ = hold_.snapshot();
+    return stats;
+  }
+};
+
+inline LockStats lockStats(const ProfiledMutex& mutex) {
+  return mutex.stats();
+}
+
+inline LockStats lockStats(const std::mutex&) {
+  return LockStats();
+}
+
+#ifdef LRUC_PROFILE_LOCKS
+constexpr bool LockProfiling = true;
+
+/**
+ * TableLockProfile times how long lookups of the hash table take to return an
+ * accessor, which includes waiting for its bucket and element locks. TBB's locks
+ * can't be wrapped, so an acquisition counts as contended if it took longer than
+ * ContendedTicks, well above an uncontended lookup.
+ */
+class TableLockProfile final {
+ public:
+  static constexpr uint64_t ContendedTicks = 2048;
+
+ private:
+  std::atomic<uint64_t> acquisitions_{0};
+  std::atomic<uint64_t> contended_{0};
+  AtomicHistogram wait_;
+
+ public:
+  uint64_t begin() const {
+    return latencyTicks();
+  }
+
+  /**
+   * Record an accessor acquired since begin() returned start.
+   */
+  void acquired(uint64_t start) {
+    uint64_t ticks = latencyTicks() - start;
+    acquisitions_.fetch_add(1, std::memory_order_relaxed);
+    if (ticks > ContendedTicks) {
+      contended_.fetch_add(1, std::memory_order_relaxed);
+      wait_.record(ticks);
+    }
+  }
+
+  LockStats stats() const {
+    LockStats stats;
+    stats.acquisitions_ = acquisitions_.load(std::memory_order_relaxed);
+    stats.contended_ = contended_.load(std::memory_order_relaxed);
+    stats.wait_ = wait_.snapshot();
+    return stats;
+  }
+};
+#else
+constexpr bool LockProfiling = false;
+
+class TableLockProfile final {
+ public:
+  uint64_t begin() const {
+    return 0;
+  }
+
+  void acquired(uint64_t) {}
+
+  LockStats stats() const {
+    return LockStats();
+  }
+};
+#endif
+}  // namespace LRUC
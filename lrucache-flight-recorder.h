@@ -0,0 +1,338 @@
+/**
+ * @author shchang
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "lrucache-latency.h"
+
+namespace LRUC {
+
+enum class FlightOp : uint8_t { Find, Insert, InsertOrAssign, Erase };
+
+/**
+ * One recorded cache operation, 24 bytes.
+ */
+struct FlightEvent {
+  // latencyTicks() at completion
+  uint64_t ticks_;
+  uint64_t keyHash_;
+  uint32_t shard_;
+  FlightOp op_;
+  // 1: hit, inserted or erased
+  uint8_t outcome_;
+  // elements evicted by the operation, saturating
+  uint8_t evictions_;
+  // duration below 2^durationLog2_ ticks, 0: no time at all
+  uint8_t durationLog2_;
+};
+
+/**
+ * Evictions performed by the calling thread, counted by LRUCache::popFront() so that
+ * recorded operations can tell how many elements they evicted.
+ */
+inline thread_local uint32_t threadEvictions = 0;
+
+/**
+ * FlightRecorder keeps the last RingEvents cache operations of every thread, for
+ * postmortem analysis of a latency spike: eviction bursts show up as evictions_,
+ * lock convoys as runs of long durations across threads.
+ *
+ * Every thread writes its own ring, claimed on its first event and handed to a later
+ * thread once it exits, so recording takes no lock and no shared write. Rings are
+ * lossy: old events are overwritten, and an event overwritten while being dumped is
+ * dropped. Up to MaxThreads threads record at once, further ones don't.
+ *
+ * dump() is async-signal-safe, see installFlightRecorderSignal().
+ */
+class FlightRecorder final {
+ public:
+  static constexpr size_t RingEvents = 2048;
+  static constexpr size_t MaxThreads = 512;
+
+ private:
+  struct Ring {
+    // events written so far, the ring holds the last RingEvents of them.
+    std::atomic<uint64_t> head_{0};
+    std::atomic<bool> owned_{false};
+    uint64_t thread_ = 0;
+    FlightEvent events_[RingEvents];
+  };
+
+  /**
+   * Releases the ring of a thread on exit.
+   */
+  struct RingHandle {
+    Ring* ring_ = nullptr;
+    bool claimed_ = false;
+
+    ~RingHandle() {
+      if (ring_ != nullptr) {
+        ring_->owned_.store(false, std::memory_order_release);
+      }
+    }
+  };
+
+  // rings are never freed, so a signal handler can walk them at any time.
+  std::atomic<Ring*> rings_[MaxThreads];
+  std::atomic<size_t> ringCount_;
+  std::atomic<uint64_t> nextThread_;
+  // nanosPerTick() as calibrated before any dump, read by signal handlers.
+  std::atomic<double> nanosPerTick_;
+
+  FlightRecorder() : ringCount_(0), nextThread_(0), nanosPerTick_(0) {
+    for (auto& ring : rings_) {
+      ring.store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  Ring* claimRing() {
+    Ring* ring = nullptr;
+    size_t count = ringCount_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count && ring == nullptr; i++) {
+      Ring* candidate = rings_[i].load(std::memory_order_acquire);
+      bool free = false;
+      if (candidate != nullptr && candidate->owned_.compare_exchange_strong(free, true)) {
+        ring = candidate;
+      }
+    }
+    if (ring == nullptr) {
+      size_t index = ringCount_.fetch_add(1, std::memory_order_acq_rel);
+      if (index >= MaxThreads) {
+        ringCount_.store(MaxThreads, std::memory_order_release);
+        return nullptr;
+      }
+      ring = new Ring();
+      ring->owned_.store(true, std::memory_order_relaxed);
+      rings_[index].store(ring, std::memory_order_release);
+    }
+    ring->thread_ = nextThread_.fetch_add(1, std::memory_order_relaxed);
+    return ring;
+  }
+
+  Ring* threadRing() {
+    static thread_local RingHandle handle;
+    if (!handle.claimed_) {
+      handle.claimed_ = true;
+      handle.ring_ = claimRing();
+    }
+    return handle.ring_;
+  }
+
+  static void writeAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+      ssize_t n = ::write(fd, data, size);
+      if (n <= 0) {
+        return;
+      }
+      data += n;
+      size -= static_cast<size_t>(n);
+    }
+  }
+
+  static char* formatUnsigned(char* out, uint64_t value, unsigned base = 10) {
+    char digits[24];
+    size_t n = 0;
+    do {
+      digits[n++] = "0123456789abcdef"[value % base];
+      value /= base;
+    } while (value > 0);
+    while (n > 0) {
+      *out++ = digits[--n];
+    }
+    return out;
+  }
+
+  static char* formatText(char* out, const char* text) {
+    size_t length = std::strlen(text);
+    std::memcpy(out, text, length);
+    return out + length;
+  }
+
+ public:
+  static FlightRecorder& instance() {
+    static FlightRecorder* recorder = new FlightRecorder();
+    return *recorder;
+  }
+
+  FlightRecorder(const FlightRecorder&) = delete;
+  FlightRecorder& operator=(const FlightRecorder&) = delete;
+
+  /**
+   * Calibrate the tick rate, done by ScalableLRUCache::enableFlightRecorder().
+   */
+  void calibrate() {
+    nanosPerTick_.store(nanosPerTick(), std::memory_order_relaxed);
+  }
+
+  /**
+   * Record an operation that started at startTicks, see latencyTicks().
+   */
+  void record(FlightOp op, size_t shard, uint64_t keyHash, bool outcome, uint32_t evictions,
+              uint64_t startTicks) {
+    Ring* ring = threadRing();
+    if (ring == nullptr) {
+      return;
+    }
+    uint64_t now = latencyTicks();
+    uint64_t duration = now - startTicks;
+
+    uint64_t head = ring->head_.load(std::memory_order_relaxed);
+    FlightEvent& event = ring->events_[head % RingEvents];
+    event.ticks_ = now;
+    event.keyHash_ = keyHash;
+    event.shard_ = static_cast<uint32_t>(shard);
+    event.op_ = op;
+    event.outcome_ = outcome ? 1 : 0;
+    event.evictions_ = static_cast<uint8_t>(std::min<uint32_t>(evictions, 255));
+    event.durationLog2_ = static_cast<uint8_t>(duration == 0 ? 0 : 64 - __builtin_clzll(duration));
+    ring->head_.store(head + 1, std::memory_order_release);
+  }
+
+  /**
+   * Write the recorded events as text to fd, one thread after another, oldest first:
+   *  thread <n> events <total>
+   *  <age us> <op> shard <n> key <hash> <outcome> evicted <n> dur< <ns>
+   * age is the time before the dump. Async-signal-safe.
+   */
+  void dump(int fd) const {
+    static const char* const OpNames[] = {"find", "insert", "insert_or_assign", "erase"};
+    static const char* const Outcomes[][2] = {
+      {"miss", "hit"}, {"rejected", "inserted"}, {"assigned", "inserted"}, {"absent", "erased"}};
+
+    double nanos = nanosPerTick_.load(std::memory_order_relaxed);
+    uint64_t now = latencyTicks();
+    char line[192];
+    size_t count = std::min(ringCount_.load(std::memory_order_acquire), MaxThreads);
+
+    for (size_t r = 0; r < count; r++) {
+      const Ring* ring = rings_[r].load(std::memory_order_acquire);
+      if (ring == nullptr) {
+        continue;
+      }
+      uint64_t head = ring->head_.load(std::memory_order_acquire);
+      char* out = formatText(line, "thread ");
+      out = formatUnsigned(out, ring->thread_);
+      out = formatText(out, " events ");
+      out = formatUnsigned(out, head);
+      *out++ = '\n';
+      writeAll(fd, line, static_cast<size_t>(out - line));
+
+      for (uint64_t seq = head > RingEvents ? head - RingEvents : 0; seq < head; seq++) {
+        FlightEvent event = ring->events_[seq % RingEvents];
+        // the writer may have lapped us meanwhile.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (ring->head_.load(std::memory_order_relaxed) > seq + RingEvents - 1) {
+          continue;
+        }
+        if (static_cast<size_t>(event.op_) >= sizeof(OpNames) / sizeof(OpNames[0])) {
+          continue;
+        }
+
+        uint64_t ageTicks = now > event.ticks_ ? now - event.ticks_ : 0;
+        uint64_t durationTicks = event.durationLog2_ == 0 ? 0 : uint64_t(1) << (event.durationLog2_ - 1) << 1;
+        out = line;
+        *out++ = '-';
+        out = formatUnsigned(out, static_cast<uint64_t>(static_cast<double>(ageTicks) * nanos / 1000));
+        out = formatText(out, "us ");
+        out = formatText(out, OpNames[static_cast<size_t>(event.op_)]);
+        out = formatText(out, " shard ");
+        out = formatUnsigned(out, event.shard_);
+        out = formatText(out, " key ");
+        out = formatUnsigned(out, event.keyHash_, 16);
+        *out++ = ' ';
+        out = formatText(out, Outcomes[static_cast<size_t>(event.op_)][event.outcome_ & 1]);
+        out = formatText(out, " evicted ");
+        out = formatUnsigned(out, event.evictions_);
+        out = formatText(out, " dur<");
+        out = formatUnsigned(out, static_cast<uint64_t>(static_cast<double>(durationTicks) * nanos));
+        out = formatText(out, "ns\n");
+        writeAll(fd, line, static_cast<size_t>(out - line));
+      }
+    }
+  }
+
+  /**
+   * Copy the recorded events of all threads, ordered by time.
+   */
+  std::vector<FlightEvent> snapshot() const {
+    std::vector<FlightEvent> events;
+    size_t count = std::min(ringCount_.load(std::memory_order_acquire), MaxThreads);
+    for (size_t r = 0; r < count; r++) {
+      const Ring* ring = rings_[r].load(std::memory_order_acquire);
+      if (ring == nullptr) {
+        continue;
+      }
+      uint64_t head = ring->head_.load(std::memory_order_acquire);
+      uint64_t first = head > RingEvents ? head - RingEvents : 0;
+      size_t begin = events.size();
+      for (uint64_t seq = first; seq < head; seq++) {
+        events.push_back(ring->events_[seq % RingEvents]);
+      }
+      // drop events overwritten, or being overwritten, while copying.
+      std::atomic_thread_fence(std::memory_order_acquire);
+      uint64_t after = ring->head_.load(std::memory_order_relaxed);
+      uint64_t firstIntact = after >= RingEvents ? after - RingEvents + 1 : 0;
+      uint64_t dropped = std::min<uint64_t>(firstIntact > first ? firstIntact - first : 0, head - first);
+      events.erase(events.begin() + begin, events.begin() + begin + static_cast<ptrdiff_t>(dropped));
+    }
+    std::sort(events.begin(), events.end(),
+              [](const FlightEvent& a, const FlightEvent& b) { return a.ticks_ < b.ticks_; });
+    return events;
+  }
+};
+
+namespace detail {
+inline std::atomic<int> flightDumpFd{-1};
+inline char flightDumpPath[256];
+
+inline void onFlightRecorderSignal(int) {
+  int savedErrno = errno;
+  int fd = flightDumpFd.load(std::memory_order_relaxed);
+  if (fd < 0) {
+    fd = ::open(flightDumpPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  }
+  if (fd >= 0) {
+    FlightRecorder::instance().dump(fd);
+    if (fd != flightDumpFd.load(std::memory_order_relaxed)) {
+      ::close(fd);
+    }
+  }
+  errno = savedErrno;
+}
+}  // namespace detail
+
+/**
+ * Dump the flight recorder when signo arrives, e.g. kill -USR2 <pid>, appending to
+ * path, or to stderr if path is empty.
+ * Returns false if path is too long or the handler can't be installed.
+ */
+inline bool installFlightRecorderSignal(int signo = SIGUSR2, const std::string& path = std::string()) {
+  if (path.size() >= sizeof(detail::flightDumpPath)) {
+    return false;
+  }
+  std::memcpy(detail::flightDumpPath, path.c_str(), path.size() + 1);
+  detail::flightDumpFd.store(path.empty() ? STDERR_FILENO : -1, std::memory_order_relaxed);
+  FlightRecorder::instance().calibrate();
+
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = detail::onFlightRecorderSignal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  return ::sigaction(signo, &action, nullptr) == 0;
+}
+}  // namespace LRUC
@@ -0,0 +1,584 @@
+/**
+ * @author shchang
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+
+#include "lrucache-snapshot.h"
+
+namespace LRUC {
+
+/**
+ * Mutation recorded in a Journal.
+ * Keyed operations carry the key, Insert/InsertOrAssign the value and EraseRange the
+ * upper bound key as payload.
+ */
+enum class JournalOp : uint8_t {
+  Insert = 1,
+  InsertOrAssign = 2,
+  Erase = 3,
+  EraseRange = 4,
+  InvalidateAll = 5,
+  InvalidateTag = 6,
+};
+
+struct JournalHeader final {
+  static constexpr uint64_t Magic = 0x31524e4a4355524cULL;  // "LRUCJNR1" little-endian
+  static constexpr uint32_t Version = 1;
+
+  uint64_t magic_;
+  uint32_t version_;
+  uint32_t shardCount_;
+  uint32_t keySize_;
+  uint32_t valueSize_;
+  // checksum64 over the preceding header fields.
+  uint64_t checksum_;
+};
+
+struct JournalBatchHeader final {
+  uint32_t shard_;
+  uint32_t count_;
+  uint64_t bytes_;
+  // checksum64 over the records of this batch.
+  uint64_t checksum_;
+};
+
+/**
+ * Journal is an append-only log of ScalableLRUCache mutations, replayed on top of the
+ * latest snapshot after a crash.
+ *
+ * Records are appended to a per-shard buffer on the request path, which costs one
+ * uncontended lock and a memcpy. A background thread group-commits all pending
+ * buffers every flushInterval, one checksummed batch per shard, with a single
+ * pwritev(). Records of one shard stay in order, so shards replay in parallel.
+ *
+ * A record is logged after the cache applied the mutation, two racing mutations of
+ * the same key may thus be logged in the opposite order. Evictions are not logged.
+ *
+ * A failed or short write, or a failed fdatasync(), rewinds the log to where the group
+ * commit started and keeps its records buffered for the next one, so no batch ever
+ * follows a torn one. Failures are counted by writeErrors(), records pile up in memory
+ * while they persist.
+ *
+ * Compaction rotates the log into `path`.next, takes a snapshot, then renames
+ * `path`.next over `path`, see ScalableLRUCache::checkpoint(). It runs on a thread of
+ * its own, group commits continue into `path`.next meanwhile. Recovery replays `path`
+ * and then `path`.next, which is correct for any snapshot taken after the rotation.
+ *
+ * Construct the Journal after recovery, ScalableLRUCache::recover() consumes the logs.
+ * If `path` or `path`.next still exists, the Journal refuses to start and isOpen() is
+ * false, rather than truncating a log that was never replayed.
+ * Requires trivially copyable TKey and TValue.
+ */
+template <class TKey, class TValue>
+class Journal final {
+ public:
+  using Tag = uint8_t;
+
+  struct Options {
+    // group commit interval of the background writer.
+    std::chrono::milliseconds flushInterval_{10};
+    // fdatasync() after every group commit.
+    bool sync_{false};
+    // call the compaction callback once the log grows beyond this size, 0 disables.
+    uint64_t compactBytes_{0};
+  };
+
+  Journal(const std::string& path, size_t shardCount, Options options = Options());
+  ~Journal();
+
+  Journal(const Journal&) = delete;
+  Journal& operator=(const Journal&) = delete;
+
+  bool isOpen() const {
+    return fd_ >= 0;
+  }
+
+  /**
+   * Append a record to the buffer of shard. payload holds payloadSize bytes as
+   * described by JournalOp, and may be null for operations without payload.
+   * Thread-safe.
+   */
+  void append(size_t shard, JournalOp op, Tag tag, const TKey& key, const void* payload, size_t payloadSize);
+
+  /**
+   * Group-commit all pending records now.
+   * Returns false on I/O error, the records stay pending then.
+   * Thread-safe.
+   */
+  bool flush();
+
+  /**
+   * Number of failed group commits so far.
+   */
+  uint64_t writeErrors() const {
+    return writeErrors_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Set the callback invoked on a compaction thread once the log exceeds
+   * Options::compactBytes_, typically ScalableLRUCache::checkpoint().
+   */
+  void setCompaction(std::function<void()> compact);
+
+  /**
+   * Flush pending records, then continue the log in `path`.next.
+   * Calling rotate() again before commitRotation() keeps the pending rotation.
+   * Returns false on I/O error.
+   */
+  bool rotate();
+
+  /**
+   * Replace `path` with `path`.next once a snapshot covers everything before rotate().
+   */
+  bool commitRotation();
+
+  /**
+   * Replay the log stored in path in parallel per shard.
+   * apply(shard, op, tag, key, payload) is called in log order within a shard.
+   * Replay stops at the first torn or corrupt batch.
+   * Returns false if path can't be read, or its layout or shard count doesn't match.
+   */
+  template <class Apply>
+  static bool replay(const std::string& path, size_t shardCount, Apply&& apply);
+
+ private:
+  /**
+   * Per-shard pending records, padded to avoid false sharing between shards.
+   */
+  struct alignas(64) ShardBuffer {
+    std::mutex mutex_;
+    std::vector<char> records_;
+    uint32_t count_ = 0;
+  };
+
+  /**
+   * Create a log file with a header at path, failing if path exists.
+   */
+  int createLog(const std::string& path);
+
+  /**
+   * Write pending batches of every shard. On failure, rewind to the previous end of the
+   * log and put the records back. Caller holds fileMutex_.
+   */
+  bool writeBatches();
+
+  bool writeAll(struct iovec* iov, int iovcnt);
+
+  void run();
+
+ private:
+  std::string path_;
+  std::string nextPath_;
+  size_t shard_count_;
+  Options options_;
+
+  std::unique_ptr<ShardBuffer[]> buffers_;
+
+  // guards fd_, offset_ and rotation state.
+  std::mutex fileMutex_;
+  int fd_;
+  uint64_t offset_;
+  bool rotating_;
+
+  std::atomic<uint64_t> writeErrors_;
+
+  std::function<void()> compact_;
+  std::atomic<bool> compacting_;
+  // runs compact_, started by the writer.
+  std::thread compactor_;
+
+  std::mutex wakeMutex_;
+  std::condition_variable wake_;
+  bool stop_;
+  std::thread writer_;
+};
+
+template <class TKey, class TValue>
+Journal<TKey, TValue>::Journal(const std::string& path, size_t shardCount, Options options)
+  : path_(path),
+    nextPath_(path + ".next"),
+    shard_count_(shardCount),
+    options_(options),
+    buffers_(new ShardBuffer[shardCount]),
+    fd_(-1),
+    offset_(0),
+    rotating_(false),
+    writeErrors_(0),
+    compacting_(false),
+    stop_(false) {
+  static_assert(std::is_trivially_copyable<TKey>::value && std::is_trivially_copyable<TValue>::value,
+                "Journal requires trivially copyable key and value");
+
+  // a leftover log must be replayed first.
+  if (::access(nextPath_.c_str(), F_OK) == 0) {
+    return;
+  }
+  fd_ = createLog(path_);
+  if (fd_ < 0) {
+    return;
+  }
+  offset_ = sizeof(JournalHeader);
+
+  writer_ = std::thread([this] { run(); });
+}
+
+template <class TKey, class TValue>
+Journal<TKey, TValue>::~Journal() {
+  if (writer_.joinable()) {
+    {
+      std::unique_lock<std::mutex> lock(wakeMutex_);
+      stop_ = true;
+    }
+    wake_.notify_one();
+    writer_.join();
+  }
+  if (compactor_.joinable()) {
+    compactor_.join();
+  }
+
+  flush();
+
+  if (fd_ >= 0) {
+    ::fsync(fd_);
+    ::close(fd_);
+  }
+}
+
+template <class TKey, class TValue>
+void Journal<TKey, TValue>::append(size_t shard, JournalOp op, Tag tag, const TKey& key, const void* payload,
+                                   size_t payloadSize) {
+  ShardBuffer& buffer = buffers_[shard];
+
+  std::unique_lock<std::mutex> lock(buffer.mutex_);
+  std::vector<char>& records = buffer.records_;
+  size_t offset = records.size();
+  records.resize(offset + 2 + sizeof(TKey) + payloadSize);
+
+  char* p = records.data() + offset;
+  p[0] = static_cast<char>(op);
+  p[1] = static_cast<char>(tag);
+  std::memcpy(p + 2, &key, sizeof(TKey));
+  if (payloadSize > 0) {
+    std::memcpy(p + 2 + sizeof(TKey), payload, payloadSize);
+  }
+  buffer.count_++;
+}
+
+template <class TKey, class TValue>
+bool Journal<TKey, TValue>::flush() {
+  std::unique_lock<std::mutex> lock(fileMutex_);
+  return writeBatches();
+}
+
+template <class TKey, class TValue>
+void Journal<TKey, TValue>::setCompaction(std::function<void()> compact) {
+  std::unique_lock<std::mutex> lock(wakeMutex_);
+  compact_ = std::move(compact);
+}
+
+template <class TKey, class TValue>
+bool Journal<TKey, TValue>::rotate() {
+  std::unique_lock<std::mutex> lock(fileMutex_);
+  if (fd_ < 0 || !writeBatches()) {
+    return false;
+  }
+
+  if (rotating_) {
+    return true;
+  }
+
+  int fd = createLog(nextPath_);
+  if (fd < 0) {
+    return false;
+  }
+
+  ::fsync(fd_);
+  ::close(fd_);
+  fd_ = fd;
+  offset_ = sizeof(JournalHeader);
+  rotating_ = true;
+
+  return true;
+}
+
+template <class TKey, class TValue>
+bool Journal<TKey, TValue>::commitRotation() {
+  std::unique_lock<std::mutex> lock(fileMutex_);
+  if (!rotating_) {
+    return true;
+  }
+
+  // fd_ keeps referring to the renamed file.
+  if (::rename(nextPath_.c_str(), path_.c_str()) != 0) {
+    return false;
+  }
+
+  rotating_ = false;
+  return true;
+}
+
+template <class TKey, class TValue>
+template <class Apply>
+bool Journal<TKey, TValue>::replay(const std::string& path, size_t shardCount, Apply&& apply) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(JournalHeader)) {
+    ::close(fd);
+    return false;
+  }
+
+  size_t size = static_cast<size_t>(st.st_size);
+  void* addr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  ::close(fd);
+  if (addr == MAP_FAILED) {
+    return false;
+  }
+  const char* data = static_cast<const char*>(addr);
+
+  JournalHeader header;
+  std::memcpy(&header, data, sizeof(header));
+  if (header.magic_ != JournalHeader::Magic || header.version_ != JournalHeader::Version ||
+      header.checksum_ != checksum64(&header, offsetof(JournalHeader, checksum_)) ||
+      header.keySize_ != sizeof(TKey) || header.valueSize_ != sizeof(TValue) || header.shardCount_ != shardCount) {
+    ::munmap(addr, size);
+    return false;
+  }
+
+  // Index batches per shard, up to the first torn or corrupt one.
+  struct Batch {
+    uint32_t count_;
+    const char* records_;
+    const char* end_;
+  };
+  std::vector<std::vector<Batch>> shardBatches(shardCount);
+
+  size_t offset = sizeof(JournalHeader);
+  while (size - offset >= sizeof(JournalBatchHeader)) {
+    JournalBatchHeader batch;
+    std::memcpy(&batch, data + offset, sizeof(batch));
+    const char* records = data + offset + sizeof(batch);
+    if (batch.shard_ >= shardCount || batch.bytes_ > size - offset - sizeof(batch) ||
+        batch.checksum_ != checksum64(records, batch.bytes_)) {
+      break;
+    }
+
+    shardBatches[batch.shard_].push_back(Batch{batch.count_, records, records + batch.bytes_});
+    offset += sizeof(batch) + batch.bytes_;
+  }
+
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, shardCount, 1), [&](const tbb::blocked_range<size_t>& range) {
+    TKey key;
+    for (size_t shard = range.begin(); shard != range.end(); ++shard) {
+      for (const Batch& batch : shardBatches[shard]) {
+        const char* p = batch.records_;
+        for (uint32_t n = 0; n < batch.count_; n++) {
+          if (batch.end_ - p < static_cast<ptrdiff_t>(2 + sizeof(TKey))) {
+            break;
+          }
+          JournalOp op = static_cast<JournalOp>(p[0]);
+          Tag tag = static_cast<Tag>(p[1]);
+          std::memcpy(&key, p + 2, sizeof(TKey));
+          const char* payload = p + 2 + sizeof(TKey);
+
+          size_t payloadSize = 0;
+          if (op == JournalOp::Insert || op == JournalOp::InsertOrAssign) {
+            payloadSize = sizeof(TValue);
+          } else if (op == JournalOp::EraseRange) {
+            payloadSize = sizeof(TKey);
+          }
+          if (batch.end_ - payload < static_cast<ptrdiff_t>(payloadSize)) {
+            break;
+          }
+
+          apply(shard, op, tag, key, payload);
+          p = payload + payloadSize;
+        }
+      }
+    }
+  });
+
+  ::munmap(addr, size);
+  return true;
+}
+
+// ---- private member functions ----
+template <class TKey, class TValue>
+int Journal<TKey, TValue>::createLog(const std::string& path) {
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+
+  JournalHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.magic_ = JournalHeader::Magic;
+  header.version_ = JournalHeader::Version;
+  header.shardCount_ = static_cast<uint32_t>(shard_count_);
+  header.keySize_ = sizeof(TKey);
+  header.valueSize_ = sizeof(TValue);
+  header.checksum_ = checksum64(&header, offsetof(JournalHeader, checksum_));
+
+  if (::pwrite(fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header))) {
+    ::close(fd);
+    ::unlink(path.c_str());
+    return -1;
+  }
+
+  return fd;
+}
+
+template <class TKey, class TValue>
+bool Journal<TKey, TValue>::writeBatches() {
+  if (fd_ < 0) {
+    return false;
+  }
+
+  // Swap out pending records, the request path only ever waits for a swap.
+  std::vector<JournalBatchHeader> headers(shard_count_);
+  std::vector<std::vector<char>> pending(shard_count_);
+  std::vector<struct iovec> iov;
+  iov.reserve(shard_count_ * 2);
+
+  for (size_t i = 0; i < shard_count_; i++) {
+    ShardBuffer& buffer = buffers_[i];
+    {
+      std::unique_lock<std::mutex> lock(buffer.mutex_);
+      if (buffer.count_ == 0) {
+        continue;
+      }
+      pending[i].swap(buffer.records_);
+      headers[i].count_ = buffer.count_;
+      buffer.count_ = 0;
+    }
+
+    headers[i].shard_ = static_cast<uint32_t>(i);
+    headers[i].bytes_ = pending[i].size();
+    headers[i].checksum_ = checksum64(pending[i].data(), pending[i].size());
+
+    iov.push_back({&headers[i], sizeof(JournalBatchHeader)});
+    iov.push_back({pending[i].data(), pending[i].size()});
+  }
+
+  uint64_t start = offset_;
+  bool ok = true;
+  for (size_t i = 0; i < iov.size() && ok; i += IOV_MAX) {
+    ok = writeAll(iov.data() + i, static_cast<int>(std::min<size_t>(IOV_MAX, iov.size() - i)));
+  }
+
+  if (ok && !iov.empty() && options_.sync_) {
+    ok = ::fdatasync(fd_) == 0;
+  }
+
+  if (!ok) {
+    // Drop the torn tail, the next commit rewrites from start even if this fails.
+    offset_ = start;
+    int rc = ::ftruncate(fd_, static_cast<off_t>(start));
+    (void)rc;
+
+    // Put the records back in front of those appended meanwhile.
+    for (size_t i = 0; i < shard_count_; i++) {
+      if (headers[i].count_ == 0) {
+        continue;
+      }
+      ShardBuffer& buffer = buffers_[i];
+      std::unique_lock<std::mutex> lock(buffer.mutex_);
+      pending[i].insert(pending[i].end(), buffer.records_.begin(), buffer.records_.end());
+      buffer.records_.swap(pending[i]);
+      buffer.count_ += headers[i].count_;
+    }
+    writeErrors_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  return ok;
+}
+
+template <class TKey, class TValue>
+bool Journal<TKey, TValue>::writeAll(struct iovec* iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t n = ::pwritev(fd_, iov, iovcnt, static_cast<off_t>(offset_));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    offset_ += static_cast<uint64_t>(n);
+
+    // skip fully written vectors, resume within a partially written one.
+    size_t written = static_cast<size_t>(n);
+    while (iovcnt > 0 && written >= iov->iov_len) {
+      written -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+      iov->iov_len -= written;
+    }
+  }
+
+  return true;
+}
+
+template <class TKey, class TValue>
+void Journal<TKey, TValue>::run() {
+  std::unique_lock<std::mutex> wakeLock(wakeMutex_);
+  while (!stop_) {
+    wake_.wait_for(wakeLock, options_.flushInterval_, [this] { return stop_; });
+    std::function<void()> compact = compact_;
+    wakeLock.unlock();
+
+    uint64_t size;
+    {
+      // a failure is counted and its records retried next time.
+      std::unique_lock<std::mutex> lock(fileMutex_);
+      writeBatches();
+      size = offset_;
+    }
+
+    // the snapshot takes long, commits must not wait for it.
+    if (options_.compactBytes_ > 0 && size >= options_.compactBytes_ && compact && !compacting_.exchange(true)) {
+      if (compactor_.joinable()) {
+        compactor_.join();
+      }
+      compactor_ = std::thread([this, compact] {
+        compact();
+        compacting_ = false;
+      });
+    }
+
+    wakeLock.lock();
+  }
+}
+// ---- private member functions end ----
+}  // namespace LRUC
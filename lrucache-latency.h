@@ -0,0 +1,226 @@
+/**
+ * @author shchang
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+#include "lrucache-stats.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace LRUC {
+
+/**
+ * Operations timed by LatencyRecorder.
+ */
+enum class LatencyOp : uint8_t { Find, Insert, Erase, Count };
+
+/**
+ * Cheap timestamp in ticks: the TSC on x86, nanoseconds elsewhere.
+ */
+inline uint64_t latencyTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+/**
+ * Nanoseconds per tick of latencyTicks(), measured once against steady_clock over
+ * about 10ms on first call.
+ */
+inline double nanosPerTick() {
+  static const double ratio = [] {
+#if defined(__x86_64__) || defined(__i386__)
+    auto start = std::chrono::steady_clock::now();
+    uint64_t ticks = latencyTicks();
+    std::chrono::steady_clock::duration elapsed;
+    do {
+      elapsed = std::chrono::steady_clock::now() - start;
+    } while (elapsed < std::chrono::milliseconds(10));
+    ticks = latencyTicks() - ticks;
+    return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) /
+           static_cast<double>(ticks);
+#else
+    return 1.0;
+#endif
+  }();
+  return ratio;
+}
+
+/**
+ * Log-linear latency histogram as in HdrHistogram: every power of 2 of ticks is split
+ * into SubBuckets linear buckets, so a value is kept within 1/SubBuckets of itself.
+ * Durations beyond 2^MaxExponent ticks land in the last bucket.
+ */
+struct LatencyHistogram {
+  static constexpr unsigned SubBits = 4;
+  static constexpr uint64_t SubBuckets = uint64_t(1) << SubBits;
+  static constexpr unsigned MaxExponent = 36;
+  static constexpr size_t BucketCount = (MaxExponent - SubBits + 1) * SubBuckets + SubBuckets;
+
+  std::array<uint64_t, BucketCount> buckets_{};
+  uint64_t count_ = 0;
+  double nanosPerTick_ = 1.0;
+
+  static size_t bucketOf(uint64_t ticks) {
+    if (ticks < SubBuckets) {
+      return static_cast<size_t>(ticks);
+    }
+    unsigned exponent = 63 - static_cast<unsigned>(__builtin_clzll(ticks));
+    if (exponent > MaxExponent) {
+      return BucketCount - 1;
+    }
+    uint64_t sub = (ticks >> (exponent - SubBits)) & (SubBuckets - 1);
+    return static_cast<size_t>((exponent - SubBits + 1) * SubBuckets + sub);
+  }
+
+  /**
+   * Lowest tick count of bucket.
+   */
+  static uint64_t bucketFloor(size_t bucket) {
+    if (bucket < SubBuckets) {
+      return bucket;
+    }
+    unsigned exponent = static_cast<unsigned>(bucket / SubBuckets) + SubBits - 1;
+    return (SubBuckets | (bucket % SubBuckets)) << (exponent - SubBits);
+  }
+
+  LatencyHistogram& operator+=(const LatencyHistogram& other) {
+    for (size_t i = 0; i < BucketCount; i++) {
+      buckets_[i] += other.buckets_[i];
+    }
+    count_ += other.count_;
+    return *this;
+  }
+
+  /**
+   * Latency in nanoseconds at quantile q, e.g. 0.99, the middle of its bucket.
+   * 0 if nothing was recorded.
+   */
+  double percentile(double q) const {
+    if (count_ == 0) {
+      return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(count_ - 1));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BucketCount; i++) {
+      seen += buckets_[i];
+      if (seen > rank) {
+        uint64_t floor = bucketFloor(i);
+        uint64_t next = i + 1 < BucketCount ? bucketFloor(i + 1) : floor + 1;
+        return (static_cast<double>(floor) + static_cast<double>(next - floor) / 2) * nanosPerTick_;
+      }
+    }
+    return 0;
+  }
+};
+
+/**
+ * LatencyRecorder samples the latency of one in sampleEvery operations per thread and
+ * records it in per-stripe histograms, see StripedCounters. Unsampled operations cost a
+ * thread-local decrement, sampled ones two timestamps and one relaxed increment.
+ * The sampling countdown is per thread, shared by all recorders. Every stripe holds a
+ * histogram per LatencyOp, about 13KB, so a recorder takes up to 850KB.
+ * snapshot() merges the stripes.
+ */
+class LatencyRecorder final {
+ private:
+  static constexpr size_t OpCount = static_cast<size_t>(LatencyOp::Count);
+
+  struct alignas(64) Stripe {
+    std::atomic<uint64_t> buckets_[OpCount][LatencyHistogram::BucketCount];
+  };
+
+  std::unique_ptr<Stripe[]> stripes_;
+  size_t mask_;
+  uint32_t sampleEvery_;
+
+ public:
+  /**
+   * sampleEvery is rounded up to a power of 2.
+   */
+  explicit LatencyRecorder(uint32_t sampleEvery) {
+    size_t stripes = 1;
+    while (stripes < std::min<size_t>(64, std::thread::hardware_concurrency())) {
+      stripes <<= 1;
+    }
+    stripes_.reset(new Stripe[stripes]);
+    mask_ = stripes - 1;
+    for (size_t i = 0; i < stripes; i++) {
+      for (auto& op : stripes_[i].buckets_) {
+        for (auto& bucket : op) {
+          bucket.store(0, std::memory_order_relaxed);
+        }
+      }
+    }
+
+    sampleEvery_ = 1;
+    while (sampleEvery_ < sampleEvery) {
+      sampleEvery_ <<= 1;
+    }
+    // calibrated here rather than on the first scrape.
+    nanosPerTick();
+  }
+
+  LatencyRecorder(const LatencyRecorder&) = delete;
+  LatencyRecorder& operator=(const LatencyRecorder&) = delete;
+
+  /**
+   * Start timing an operation. Returns 0 unless this one is sampled.
+   */
+  uint64_t begin() const {
+    static thread_local uint32_t countdown = 0;
+    if (countdown-- != 0) {
+      return 0;
+    }
+    countdown = sampleEvery_ - 1;
+    return latencyTicks() | 1;
+  }
+
+  /**
+   * Record an operation started with begin().
+   */
+  void end(LatencyOp op, uint64_t start) {
+    if (start == 0) {
+      return;
+    }
+    uint64_t ticks = latencyTicks() - (start & ~uint64_t(1));
+    size_t bucket = LatencyHistogram::bucketOf(ticks);
+    stripes_[threadStripe() & mask_].buckets_[static_cast<size_t>(op)][bucket].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  uint32_t sampleEvery() const {
+    return sampleEvery_;
+  }
+
+  /**
+   * Merge the stripes of op. Counts are samples, multiply by sampleEvery() for totals.
+   */
+  LatencyHistogram snapshot(LatencyOp op) const {
+    LatencyHistogram histogram;
+    histogram.nanosPerTick_ = nanosPerTick();
+    for (size_t s = 0; s <= mask_; s++) {
+      for (size_t i = 0; i < LatencyHistogram::BucketCount; i++) {
+        uint64_t n = stripes_[s].buckets_[static_cast<size_t>(op)][i].load(std::memory_order_relaxed);
+        histogram.buckets_[i] += n;
+        histogram.count_ += n;
+      }
+    }
+    return histogram;
+  }
+};
+}  // namespace LRUC
@@ -0,0 +1,61 @@
+/**
+ * @author shchang
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <type_traits>
+
+/**
+ * USDT probes of LRUCache, provider "lrucache", e.g.
+ *  bpftrace -e 'usdt:./cache-server:lrucache:find_miss { @[arg1] = count(); }'
+ *
+ * Every probe passes the shard (LRUCache address) as arg0, keyed probes the key as
+ * arg1, see probeKey():
+ *  find_hit, find_miss, erase, evict (key)
+ *  insert (key, result: 0 inserted, 1 assigned, 2 key exists, 3 not admitted)
+ *  promotion_lost (key), a hit left unpromoted as the list lock was taken
+ *  list_lock_wait, list_lock_acquired: around a blocking wait for the list lock
+ *
+ * A probe compiles to a nop and a note in the ELF file, it costs nothing while no
+ * tracer is attached. Probes are built when <sys/sdt.h> (systemtap-sdt-dev) is found,
+ * define LRUC_DISABLE_PROBES to leave them out regardless.
+ */
+#if !defined(LRUC_DISABLE_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define LRUC_PROBES 1
+#endif
+#endif
+
+#ifdef LRUC_PROBES
+#define LRUC_PROBE1(name, a1) DTRACE_PROBE1(lrucache, name, a1)
+#define LRUC_PROBE2(name, a1, a2) DTRACE_PROBE2(lrucache, name, a1, a2)
+#define LRUC_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(lrucache, name, a1, a2, a3)
+#else
+#define LRUC_PROBE1(name, a1) ((void)0)
+#define LRUC_PROBE2(name, a1, a2) ((void)0)
+#define LRUC_PROBE3(name, a1, a2, a3) ((void)0)
+#endif
+
+namespace LRUC {
+
+#ifdef LRUC_PROBES
+constexpr bool ProbesEnabled = true;
+#else
+constexpr bool ProbesEnabled = false;
+#endif
+
+/**
+ * Probe argument of key: its value if integral or an enum, its address otherwise.
+ */
+template <class TKey>
+uint64_t probeKey(const TKey& key) {
+  if constexpr (std::is_integral<TKey>::value || std::is_enum<TKey>::value) {
+    return static_cast<uint64_t>(key);
+  } else {
+    return reinterpret_cast<uintptr_t>(&key);
+  }
+}
+}  // namespace LRUC
@@ -0,0 +1,285 @@
+/**
+ * @author shchang
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace LRUC {
+
+/**
+ * Binary snapshot image of a ScalableLRUCache.
+ *
+ * Layout:
+ *  SnapshotHeader
+ *  chunk*: SnapshotChunkHeader followed by `count` records
+ *
+ * A record is the raw bytes of key, value and tag, packed back to back.
+ * Records of one shard are stored from the least-recently used to the most-recently
+ * used element, chunks of one shard appear in the same order, so inserting them in
+ * file order restores the LRU order. Chunks of different shards interleave, as every
+ * shard is written by its own writer.
+ *
+ * The image is only portable between processes with the same key/value layout and
+ * endianness, header fields are checked on load.
+ */
+struct SnapshotHeader final {
+  static constexpr uint64_t Magic = 0x31504e534355524cULL;  // "LRUCSNP1" little-endian
+  static constexpr uint32_t Version = 1;
+
+  uint64_t magic_;
+  uint32_t version_;
+  uint32_t shardCount_;
+  uint32_t keySize_;
+  uint32_t valueSize_;
+  uint32_t recordSize_;
+  uint32_t reserved_;
+  uint64_t chunkCount_;
+  // file size in bytes, header included.
+  uint64_t fileSize_;
+  // checksum64 over the preceding header fields.
+  uint64_t checksum_;
+};
+
+struct SnapshotChunkHeader final {
+  uint32_t shard_;
+  uint32_t count_;
+  // checksum64 over the records of this chunk.
+  uint64_t checksum_;
+};
+
+/**
+ * Checksum over len bytes, consumed 8 bytes at a time.
+ * Detects torn writes and bit rot, not meant to be cryptographically secure.
+ */
+inline uint64_t checksum64(const void* data, size_t len, uint64_t seed = 0xcbf29ce484222325ULL) {
+  constexpr uint64_t prime = 0x100000001b3ULL;
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  uint64_t h = seed ^ len;
+
+  for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t), p += sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, p, sizeof(word));
+    h = (h ^ word) * prime;
+    h ^= h >> 29;
+  }
+
+  for (; len > 0; --len, ++p) {
+    h = (h ^ *p) * prime;
+  }
+
+  return h ^ (h >> 32);
+}
+
+/**
+ * SnapshotWriter writes an image into `path`.tmp and renames it over `path` on commit(),
+ * so readers never observe a partial image.
+ * writeChunk() is thread-safe, each call reserves its own file range.
+ */
+class SnapshotWriter final {
+ public:
+  SnapshotWriter(const std::string& path, uint32_t shardCount, uint32_t keySize, uint32_t valueSize,
+                 uint32_t recordSize)
+    : path_(path), tmpPath_(path + ".tmp"), fd_(-1), offset_(sizeof(SnapshotHeader)), chunkCount_(0) {
+    std::memset(&header_, 0, sizeof(header_));
+    header_.magic_ = SnapshotHeader::Magic;
+    header_.version_ = SnapshotHeader::Version;
+    header_.shardCount_ = shardCount;
+    header_.keySize_ = keySize;
+    header_.valueSize_ = valueSize;
+    header_.recordSize_ = recordSize;
+
+    fd_ = ::open(tmpPath_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  }
+
+  ~SnapshotWriter() {
+    if (fd_ >= 0) {
+      // not committed
+      ::close(fd_);
+      ::unlink(tmpPath_.c_str());
+    }
+  }
+
+  SnapshotWriter(const SnapshotWriter&) = delete;
+  SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+  bool isOpen() const {
+    return fd_ >= 0;
+  }
+
+  /**
+   * Write count records held in records as one chunk of shard.
+   * Return false on I/O error.
+   */
+  bool writeChunk(uint32_t shard, uint32_t count, const std::vector<char>& records) {
+    SnapshotChunkHeader chunk{shard, count, checksum64(records.data(), records.size())};
+
+    size_t bytes = sizeof(chunk) + records.size();
+    off_t offset = static_cast<off_t>(offset_.fetch_add(bytes));
+    chunkCount_++;
+
+    return writeAll(&chunk, sizeof(chunk), offset) && writeAll(records.data(), records.size(), offset + sizeof(chunk));
+  }
+
+  /**
+   * Write the header, flush to disk and publish the image under path.
+   */
+  bool commit() {
+    header_.chunkCount_ = chunkCount_.load();
+    header_.fileSize_ = offset_.load();
+    header_.checksum_ = checksum64(&header_, offsetof(SnapshotHeader, checksum_));
+
+    bool ok = writeAll(&header_, sizeof(header_), 0) && ::fsync(fd_) == 0;
+    ok = ::close(fd_) == 0 && ok;
+    fd_ = -1;
+
+    if (!ok || ::rename(tmpPath_.c_str(), path_.c_str()) != 0) {
+      ::unlink(tmpPath_.c_str());
+      return false;
+    }
+
+    return true;
+  }
+
+ private:
+  bool writeAll(const void* data, size_t len, off_t offset) {
+    const char* p = static_cast<const char*>(data);
+    while (len > 0) {
+      ssize_t n = ::pwrite(fd_, p, len, offset);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      p += n;
+      len -= static_cast<size_t>(n);
+      offset += n;
+    }
+    return true;
+  }
+
+ private:
+  std::string path_;
+  std::string tmpPath_;
+  int fd_;
+  SnapshotHeader header_;
+  std::atomic<uint64_t> offset_;
+  std::atomic<uint64_t> chunkCount_;
+};
+
+/**
+ * SnapshotReader maps an image read-only and indexes its chunks.
+ * open() validates the header against the expected layout and bounds-checks every
+ * chunk, chunk checksums are left to verify() so they can be checked in parallel.
+ */
+class SnapshotReader final {
+ public:
+  struct Chunk {
+    uint32_t shard_;
+    uint32_t count_;
+    uint64_t checksum_;
+    const char* records_;
+  };
+
+  SnapshotReader() : data_(nullptr), size_(0), recordSize_(0), shardCount_(0) {}
+
+  ~SnapshotReader() {
+    if (data_ != nullptr) {
+      ::munmap(const_cast<char*>(data_), size_);
+    }
+  }
+
+  SnapshotReader(const SnapshotReader&) = delete;
+  SnapshotReader& operator=(const SnapshotReader&) = delete;
+
+  bool open(const std::string& path, uint32_t keySize, uint32_t valueSize, uint32_t recordSize) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+      ::close(fd);
+      return false;
+    }
+
+    size_ = static_cast<size_t>(st.st_size);
+    void* addr = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+      size_ = 0;
+      return false;
+    }
+    data_ = static_cast<const char*>(addr);
+    ::madvise(addr, size_, MADV_SEQUENTIAL);
+
+    SnapshotHeader header;
+    std::memcpy(&header, data_, sizeof(header));
+    if (header.magic_ != SnapshotHeader::Magic || header.version_ != SnapshotHeader::Version ||
+        header.checksum_ != checksum64(&header, offsetof(SnapshotHeader, checksum_)) ||
+        header.keySize_ != keySize || header.valueSize_ != valueSize || header.recordSize_ != recordSize ||
+        header.fileSize_ != size_) {
+      return false;
+    }
+
+    recordSize_ = recordSize;
+    shardCount_ = header.shardCount_;
+
+    size_t offset = sizeof(SnapshotHeader);
+    chunks_.reserve(header.chunkCount_);
+    for (uint64_t i = 0; i < header.chunkCount_; i++) {
+      SnapshotChunkHeader chunk;
+      if (size_ - offset < sizeof(chunk)) {
+        return false;
+      }
+      std::memcpy(&chunk, data_ + offset, sizeof(chunk));
+      offset += sizeof(chunk);
+
+      size_t bytes = static_cast<size_t>(chunk.count_) * recordSize_;
+      if (size_ - offset < bytes) {
+        return false;
+      }
+      chunks_.push_back(Chunk{chunk.shard_, chunk.count_, chunk.checksum_, data_ + offset});
+      offset += bytes;
+    }
+
+    return offset == size_;
+  }
+
+  /**
+   * Return true if chunk content matches its checksum.
+   */
+  bool verify(const Chunk& chunk) const {
+    return chunk.checksum_ == checksum64(chunk.records_, static_cast<size_t>(chunk.count_) * recordSize_);
+  }
+
+  const std::vector<Chunk>& chunks() const {
+    return chunks_;
+  }
+
+  uint32_t shardCount() const {
+    return shardCount_;
+  }
+
+ private:
+  const char* data_;
+  size_t size_;
+  uint32_t recordSize_;
+  uint32_t shardCount_;
+  std::vector<Chunk> chunks_;
+};
+}  // namespace LRUC
@@ -0,0 +1,342 @@
+/**
+ * @author shchang
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lrucache-latency.h"
+#include "lrucache-stats.h"
+
+namespace LRUC {
+
+/**
+ * Statistics of one shard as published to a StatsSegment.
+ */
+struct ShardStatsRecord {
+  CacheStats stats_;
+  uint64_t size_;
+  uint64_t capacity_;
+  // 0 while the shard is not built
+  uint64_t built_;
+  uint64_t throttled_;
+  // lock contention, 0 without LRUC_PROFILE_LOCKS
+  uint64_t listAcquisitions_;
+  uint64_t listContended_;
+  uint64_t listFailedTries_;
+  uint64_t tableAcquisitions_;
+  uint64_t tableContended_;
+};
+
+/**
+ * Cache-wide part of a StatsSegment, rewritten on every publish.
+ */
+struct StatsPayload {
+  uint64_t publishes_;
+  // unix time of the last publish in ns
+  int64_t publishedAt_;
+  uint64_t size_;
+  uint64_t capacity_;
+  // sampled operation latencies in ticks, see LatencyRecorder, sampleEvery_ 0 if disabled.
+  uint64_t sampleEvery_;
+  double nanosPerTick_;
+  uint64_t latency_[static_cast<size_t>(LatencyOp::Count)][LatencyHistogram::BucketCount];
+};
+
+/**
+ * Start of a StatsSegment, followed by shardCount_ ShardStatsRecords.
+ */
+struct StatsSegmentHeader {
+  static constexpr uint64_t Magic = 0x315441544355524cULL;  // "LRUCSTA1" little-endian
+  static constexpr uint32_t Version = 1;
+
+  uint64_t magic_;
+  uint32_t version_;
+  uint32_t shardCount_;
+  uint32_t recordSize_;
+  uint32_t bucketCount_;
+  uint64_t segmentSize_;
+  int64_t pid_;
+  // seqlock over payload_ and the records: odd while a publish is in progress.
+  alignas(64) std::atomic<uint64_t> sequence_;
+  StatsPayload payload_;
+};
+
+static_assert(std::is_trivially_copyable<ShardStatsRecord>::value && std::is_trivially_copyable<StatsPayload>::value,
+              "stats records are copied racily");
+
+/**
+ * Who republishes an exported StatsSegment once per interval:
+ *  Explicit: the owner, by calling publishStats(), e.g. from a timer or idle loop.
+ *  Inline: cache operations themselves, the call noticing the interval passed pays
+ *  for the whole publish.
+ */
+enum class StatsPublishing { Explicit, Inline };
+
+/**
+ * Default segment name of a process.
+ */
+inline std::string statsSegmentName(int64_t pid) {
+  return "/lrucache-stats." + std::to_string(pid);
+}
+
+/**
+ * StatsSegment is the writer side of a shared memory statistics segment, which tools
+ * such as cachectl read without any cooperation of the process: no thread, socket or
+ * signal is involved, publishing happens on the caller's threads.
+ *
+ * Readers copy the segment under a seqlock and retry on a torn copy, they never block
+ * the publisher. The layout holds only fixed-size integers, so readers need not know
+ * the cache's key and value types. The segment is unlinked on destruction, a crashed
+ * process leaves it behind in /dev/shm until its name is reused.
+ */
+class StatsSegment final {
+ private:
+  std::string name_;
+  char* base_;
+  size_t size_;
+  std::chrono::steady_clock::duration interval_;
+  std::atomic<int64_t> nextPublish_;
+  std::atomic<bool> publishing_;
+
+  StatsSegment(const std::string& name, char* base, size_t size, std::chrono::steady_clock::duration interval)
+    : name_(name), base_(base), size_(size), interval_(interval), nextPublish_(0), publishing_(false) {}
+
+  StatsSegmentHeader& header() {
+    return *reinterpret_cast<StatsSegmentHeader*>(base_);
+  }
+
+  ShardStatsRecord* records() {
+    return reinterpret_cast<ShardStatsRecord*>(base_ + sizeof(StatsSegmentHeader));
+  }
+
+ public:
+  static size_t segmentSize(size_t shardCount) {
+    return sizeof(StatsSegmentHeader) + shardCount * sizeof(ShardStatsRecord);
+  }
+
+  /**
+   * Create or replace the segment name, e.g. statsSegmentName(getpid()).
+   * Publishes are spaced at least interval apart, see due().
+   * Returns nullptr on error.
+   */
+  static std::unique_ptr<StatsSegment> create(const std::string& name, size_t shardCount,
+                                              std::chrono::milliseconds interval) {
+    int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      return nullptr;
+    }
+    size_t size = segmentSize(shardCount);
+    if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+      ::close(fd);
+      ::shm_unlink(name.c_str());
+      return nullptr;
+    }
+    void* addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+      ::shm_unlink(name.c_str());
+      return nullptr;
+    }
+
+    std::unique_ptr<StatsSegment> segment(new StatsSegment(name, static_cast<char*>(addr), size, interval));
+    StatsSegmentHeader& header = segment->header();
+    header.magic_ = StatsSegmentHeader::Magic;
+    header.version_ = StatsSegmentHeader::Version;
+    header.shardCount_ = static_cast<uint32_t>(shardCount);
+    header.recordSize_ = sizeof(ShardStatsRecord);
+    header.bucketCount_ = LatencyHistogram::BucketCount;
+    header.segmentSize_ = size;
+    header.pid_ = ::getpid();
+    header.sequence_.store(0, std::memory_order_release);
+    return segment;
+  }
+
+  ~StatsSegment() {
+    ::munmap(base_, size_);
+    ::shm_unlink(name_.c_str());
+  }
+
+  StatsSegment(const StatsSegment&) = delete;
+  StatsSegment& operator=(const StatsSegment&) = delete;
+
+  const std::string& name() const {
+    return name_;
+  }
+
+  size_t shardCount() const {
+    return reinterpret_cast<const StatsSegmentHeader*>(base_)->shardCount_;
+  }
+
+  /**
+   * Whether the interval passed since the last publish. Checks the clock only once
+   * every 1024 calls per thread, so it can sit on hot paths.
+   */
+  bool due() {
+    static thread_local uint32_t countdown = 0;
+    if (countdown-- != 0) {
+      return false;
+    }
+    countdown = 1023;
+    int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+    return now >= nextPublish_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Call fill(payload, records) to rewrite the segment under the seqlock.
+   * Returns false if another thread is publishing.
+   */
+  template <class Fill>
+  bool publish(Fill&& fill) {
+    if (publishing_.exchange(true, std::memory_order_acquire)) {
+      return false;
+    }
+    nextPublish_.store((std::chrono::steady_clock::now() + interval_).time_since_epoch().count(),
+                       std::memory_order_relaxed);
+
+    StatsSegmentHeader& h = header();
+    uint64_t sequence = h.sequence_.load(std::memory_order_relaxed);
+    h.sequence_.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    uint64_t publishes = h.payload_.publishes_;
+    std::memset(static_cast<void*>(&h.payload_), 0, sizeof(StatsPayload));
+    std::memset(static_cast<void*>(records()), 0, h.shardCount_ * sizeof(ShardStatsRecord));
+    fill(h.payload_, records());
+    h.payload_.publishes_ = publishes + 1;
+    h.payload_.publishedAt_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::system_clock::now().time_since_epoch())
+                                .count();
+
+    h.sequence_.store(sequence + 2, std::memory_order_release);
+    publishing_.store(false, std::memory_order_release);
+    return true;
+  }
+};
+
+/**
+ * Consistent copy of a StatsSegment.
+ */
+struct StatsImage {
+  int64_t pid_ = 0;
+  StatsPayload payload_{};
+  std::vector<ShardStatsRecord> shards_;
+
+  CacheStats total() const {
+    CacheStats total;
+    for (const auto& shard : shards_) {
+      total += shard.stats_;
+    }
+    return total;
+  }
+
+  LatencyHistogram latency(LatencyOp op) const {
+    LatencyHistogram histogram;
+    histogram.nanosPerTick_ = payload_.nanosPerTick_;
+    for (size_t i = 0; i < LatencyHistogram::BucketCount; i++) {
+      histogram.buckets_[i] = payload_.latency_[static_cast<size_t>(op)][i];
+      histogram.count_ += histogram.buckets_[i];
+    }
+    return histogram;
+  }
+};
+
+/**
+ * StatsSegmentReader maps a StatsSegment of another process read-only.
+ */
+class StatsSegmentReader final {
+ private:
+  const char* base_;
+  size_t size_;
+
+  StatsSegmentReader(const char* base, size_t size) : base_(base), size_(size) {}
+
+  const StatsSegmentHeader& header() const {
+    return *reinterpret_cast<const StatsSegmentHeader*>(base_);
+  }
+
+ public:
+  /**
+   * Returns nullptr if name doesn't exist or isn't a StatsSegment of this version.
+   */
+  static std::unique_ptr<StatsSegmentReader> open(const std::string& name) {
+    int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+      return nullptr;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(StatsSegmentHeader)) {
+      ::close(fd);
+      return nullptr;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void* addr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+      return nullptr;
+    }
+
+    std::unique_ptr<StatsSegmentReader> reader(new StatsSegmentReader(static_cast<const char*>(addr), size));
+    const StatsSegmentHeader& h = reader->header();
+    if (h.magic_ != StatsSegmentHeader::Magic || h.version_ != StatsSegmentHeader::Version ||
+        h.recordSize_ != sizeof(ShardStatsRecord) || h.bucketCount_ != LatencyHistogram::BucketCount ||
+        h.segmentSize_ != size || StatsSegment::segmentSize(h.shardCount_) != size) {
+      return nullptr;
+    }
+    return reader;
+  }
+
+  ~StatsSegmentReader() {
+    ::munmap(const_cast<char*>(base_), size_);
+  }
+
+  StatsSegmentReader(const StatsSegmentReader&) = delete;
+  StatsSegmentReader& operator=(const StatsSegmentReader&) = delete;
+
+  /**
+   * Copy the last complete publish into image, retrying while one is in progress.
+   * Returns false if nothing was published yet or no consistent copy was made.
+   */
+  bool read(StatsImage& image) const {
+    const StatsSegmentHeader& h = header();
+    image.pid_ = h.pid_;
+    image.shards_.resize(h.shardCount_);
+
+    for (int attempt = 0; attempt < 1000; attempt++) {
+      uint64_t before = h.sequence_.load(std::memory_order_acquire);
+      if (before == 0) {
+        return false;
+      }
+      if (before % 2 == 1) {
+        std::this_thread::yield();
+        continue;
+      }
+
+      std::memcpy(static_cast<void*>(&image.payload_), &h.payload_, sizeof(StatsPayload));
+      std::memcpy(static_cast<void*>(image.shards_.data()), base_ + sizeof(StatsSegmentHeader),
+                  image.shards_.size() * sizeof(ShardStatsRecord));
+      std::atomic_thread_fence(std::memory_order_acquire);
+
+      if (h.sequence_.load(std::memory_order_relaxed) == before) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+}  // namespace LRUC
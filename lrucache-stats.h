@@ -0,0 +1,160 @@
+/**
+ * @author shchang
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+
+namespace LRUC {
+
+/**
+ * Operations counted by LRUCache, see CacheStats.
+ */
+enum class CacheCounter : uint8_t {
+  Hit,
+  Miss,
+  Insert,
+  Update,
+  RejectedInsert,
+  RejectedAdmission,
+  Eviction,
+  LostPromotion,
+  Erase,
+  Count
+};
+
+/**
+ * Operation counts of a shard or a whole cache.
+ */
+struct CacheStats {
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+  // new keys inserted, existing keys overwritten by insertOrAssign()
+  uint64_t inserts_ = 0;
+  uint64_t updates_ = 0;
+  // insert() of an existing key, new keys refused by admission throttling
+  uint64_t rejectedInserts_ = 0;
+  uint64_t rejectedAdmissions_ = 0;
+  uint64_t evictions_ = 0;
+  // hits not promoted as the list lock was taken
+  uint64_t lostPromotions_ = 0;
+  uint64_t erases_ = 0;
+
+  CacheStats& operator+=(const CacheStats& other) {
+    hits_ += other.hits_;
+    misses_ += other.misses_;
+    inserts_ += other.inserts_;
+    updates_ += other.updates_;
+    rejectedInserts_ += other.rejectedInserts_;
+    rejectedAdmissions_ += other.rejectedAdmissions_;
+    evictions_ += other.evictions_;
+    lostPromotions_ += other.lostPromotions_;
+    erases_ += other.erases_;
+    return *this;
+  }
+
+  double hitRatio() const {
+    uint64_t lookups = hits_ + misses_;
+    return lookups > 0 ? static_cast<double>(hits_) / static_cast<double>(lookups) : 0;
+  }
+};
+
+/**
+ * Stripe of the calling thread, threads are numbered in order of first use.
+ */
+inline size_t threadStripe() {
+  static std::atomic<size_t> next{0};
+  thread_local size_t stripe = next.fetch_add(1, std::memory_order_relaxed);
+  return stripe;
+}
+
+#ifndef LRUC_DISABLE_STATS
+/**
+ * StripedCounters counts CacheCounter events with one cache line per stripe. A thread
+ * always writes the stripe of its index, so with no more threads than stripes no line
+ * is written by two threads. Reads sum all stripes.
+ *
+ * Define LRUC_DISABLE_STATS to compile counting out, reads return 0 then.
+ */
+class StripedCounters final {
+ public:
+  static constexpr bool Enabled = true;
+
+ private:
+  struct alignas(64) Stripe {
+    std::atomic<uint64_t> counts_[static_cast<size_t>(CacheCounter::Count)];
+  };
+
+  std::unique_ptr<Stripe[]> stripes_;
+  size_t mask_;
+
+ public:
+  /**
+   * One stripe per hardware thread, rounded up to a power of 2, at most 64.
+   */
+  StripedCounters() {
+    size_t stripes = 1;
+    while (stripes < std::min<size_t>(64, std::thread::hardware_concurrency())) {
+      stripes <<= 1;
+    }
+    stripes_.reset(new Stripe[stripes]);
+    mask_ = stripes - 1;
+    for (size_t i = 0; i < stripes; i++) {
+      for (auto& count : stripes_[i].counts_) {
+        count.store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  StripedCounters(const StripedCounters&) = delete;
+  StripedCounters& operator=(const StripedCounters&) = delete;
+
+  void add(CacheCounter counter, uint64_t n = 1) {
+    stripes_[threadStripe() & mask_].counts_[static_cast<size_t>(counter)].fetch_add(n, std::memory_order_relaxed);
+  }
+
+  uint64_t read(CacheCounter counter) const {
+    uint64_t sum = 0;
+    for (size_t i = 0; i <= mask_; i++) {
+      sum += stripes_[i].counts_[static_cast<size_t>(counter)].load(std::memory_order_relaxed);
+    }
+    return sum;
+  }
+
+  CacheStats snapshot() const {
+    CacheStats stats;
+    stats.hits_ = read(CacheCounter::Hit);
+    stats.misses_ = read(CacheCounter::Miss);
+    stats.inserts_ = read(CacheCounter::Insert);
+    stats.updates_ = read(CacheCounter::Update);
+    stats.rejectedInserts_ = read(CacheCounter::RejectedInsert);
+    stats.rejectedAdmissions_ = read(CacheCounter::RejectedAdmission);
+    stats.evictions_ = read(CacheCounter::Eviction);
+    stats.lostPromotions_ = read(CacheCounter::LostPromotion);
+    stats.erases_ = read(CacheCounter::Erase);
+    return stats;
+  }
+};
+#else
+class StripedCounters final {
+ public:
+  static constexpr bool Enabled = false;
+
+  void add(CacheCounter, uint64_t = 1) {}
+
+  uint64_t read(CacheCounter) const {
+    return 0;
+  }
+
+  CacheStats snapshot() const {
+    return CacheStats();
+  }
+};
+#endif
+}  // namespace LRUC
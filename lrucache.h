@@ -4,15 +4,37 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <new>
+#include <type_traits>
 #include <thread>
 #include <vector>
 #include <tbb/concurrent_hash_map.h>
 
+#include "lrucache-cdc.h"
+#include "lrucache-contention.h"
+#include "lrucache-flight-recorder.h"
+#include "lrucache-probes.h"
+#include "lrucache-stats.h"
+
 namespace LRUC {
 
+/**
+ * Outcome of LRUCache::tryInsert() and tryInsertOrAssign().
+ *  Inserted: key was new.
+ *  Assigned: an existing value was overwritten, by tryInsert() only a stale one.
+ *  Exists: tryInsert() of a key holding a live value, nothing changed.
+ *  NotAdmitted: new key dropped by admission throttling, nothing changed.
+ */
+enum class InsertResult { Inserted, Assigned, Exists, NotAdmitted };
+
 /**
  * LRUCache is a hash-table data structure provides thread-safe access with
  * defined size limit.
@@ -55,23 +77,75 @@ namespace LRUC {
  * Reference:
  * https://spec.oneapi.com/versions/latest/elements/oneTBB/source/containers/concurrent_hash_map_cls.html
  *
+ * Invalidation:
+ *  Every value is stamped with the generation it was stored under, along with an
+ *  optional Tag. invalidateAll() and invalidateTag() raise the generation floor for
+ *  all values or for one tag, values stamped below the floor read as misses.
+ *
+ * Iteration:
+ *  Cursor walks the double-linked list from the least-recently used end in small
+ *  batches. It is parked inside the list as a marker node, so it never blocks other
+ *  operations for longer than one batch.
+ *
+ * Change feed:
+ *  With a ChangeRing attached, every insert, update, erase, eviction and invalidation
+ *  is published to it while the key is still locked. Requires trivially copyable TKey
+ *  and TValue, attaching is a no-op otherwise.
+ *
+ * Statistics:
+ *  Hits, misses, inserts, evictions, lost promotions etc. are counted in
+ *  StripedCounters, read them with stats(). LRUC_DISABLE_STATS compiles counting out.
+ *
+ * Admission throttling:
+ *  Once enabled, every Window inserts the evictions are weighed against the hits.
+ *  When evictions dominate, e.g. during a scan of keys never read again, the cache
+ *  is in an eviction storm and new keys are only admitted on their second insert,
+ *  remembered by a doorkeeper bitmap. Existing keys are always updated. Admission
+ *  recovers once evictions drop again. The detector reads the statistics, and keeps
+ *  counts of its own while LRUC_DISABLE_STATS compiles them out.
+ *  While throttling, insert() and insertOrAssign() also return false for a dropped
+ *  key, tryInsert() and tryInsertOrAssign() tell the cases apart.
+ *
+ * Lock profiling:
+ *  Define LRUC_PROFILE_LOCKS to make the list mutex a ProfiledMutex and to time hash
+ *  table accessor acquisitions, read them with listLockStats() and tableLockStats().
+ *
+ * Tracing:
+ *  Hits, misses, inserts, evictions, erases and waits for the list mutex fire USDT
+ *  probes for bpftrace/perf, see lrucache-probes.h.
+ *
+ * Ordered key index:
+ *  With KeyIndex set, keys are additionally kept in an ordered index guarded by the
+ *  list mutex, which enables eraseRange(). TKey must then be LessThanComparable.
+ *  The index costs one tree insert/erase per insertion/eviction.
+ *
  * LRUCache is C++17 compatible
  */
 
-template <typename TKey, typename TValue, typename THash = tbb::tbb_hash_compare<TKey>>
+template <typename TKey, typename TValue, typename THash = tbb::tbb_hash_compare<TKey>, bool KeyIndex = false>
 class LRUCache final {
+ public:
+  /**
+   * Tag attached to a value for bulk invalidation, e.g. the feed a value came from.
+   */
+  using Tag = uint8_t;
+  static constexpr size_t TagCount = std::numeric_limits<Tag>::max() + 1;
+  using ChangeFeed = ChangeRing<TKey, TValue>;
+
  private:
   struct Value;
+  struct NoKeyIndex {};
   using HashMap = tbb::concurrent_hash_map<TKey, Value, THash>;
   using HashMapConstAccessor = typename HashMap::const_accessor;
   using HashMapAccessor = typename HashMap::accessor;
   using HashMapValuePair = typename HashMap::value_type;
-  using ListMutex = std::mutex;
+  using ListMutex = std::conditional_t<LockProfiling, ProfiledMutex, std::mutex>;
 
  private:
   struct ListNode;
   // used for judging a node exist inside the double-linked list.
   static ListNode* const NullNodePtr;
+  using OrderedKeys = std::conditional_t<KeyIndex, std::map<TKey, ListNode*>, NoKeyIndex>;
 
  private:
   /**
@@ -82,12 +156,18 @@ class LRUCache final {
     TKey key_;
     ListNode* prev_;
     ListNode* next_;
+    // true for a Cursor's marker node, which has no hash-table entry.
+    bool cursor_;
+    // set by popFront() while it holds the node unlinked, see popFront().
+    // Written under listMutex_.
+    bool evicting_;
 
-    constexpr ListNode() : prev_(NullNodePtr), next_(nullptr) {}
+    constexpr ListNode() : prev_(NullNodePtr), next_(nullptr), cursor_(false), evicting_(false) {}
 
     // Avoid unintended conversions.
     // https://isocpp.github.io/CppCoreGuidelines/CppCoreGuidelines#Rc-explicit
-    explicit constexpr ListNode(const TKey& key) : key_(key), prev_(NullNodePtr), next_(nullptr) {}
+    explicit constexpr ListNode(const TKey& key)
+      : key_(key), prev_(NullNodePtr), next_(nullptr), cursor_(false), evicting_(false) {}
 
     // return false if node is not in cache's double-linked list.
     constexpr bool inList() const {
@@ -104,9 +184,13 @@ class LRUCache final {
     // could use std::ref/std::cref for uncopyable type
     TValue value_;
     ListNode* listNode_;
+    // generation_ of the LRUCache when the value was stored.
+    uint64_t generation_;
+    Tag tag_;
 
     constexpr Value() = default;
-    constexpr Value(const TValue& value, ListNode* node) : value_(value), listNode_(node) {}
+    constexpr Value(const TValue& value, ListNode* node, uint64_t generation, Tag tag)
+      : value_(value), listNode_(node), generation_(generation), tag_(tag) {}
   };
 
  private:
@@ -120,6 +204,15 @@ class LRUCache final {
    */
   std::atomic<size_t> current_size_;
 
+  /**
+   * Current generation, new values are stamped with it.
+   * Values stamped below invalidGeneration_, or below tagInvalidGenerations_ of
+   * their tag, are stale, read as misses and are reclaimed lazily.
+   */
+  std::atomic<uint64_t> generation_;
+  std::atomic<uint64_t> invalidGeneration_;
+  std::array<std::atomic<uint64_t>, TagCount> tagInvalidGenerations_;
+
   /**
    * head_ is the least-recently used node.
    * tail_ is the most-recently used node.
@@ -128,11 +221,57 @@ class LRUCache final {
   ListNode head_;
   ListNode tail_;
   ListMutex listMutex_;
+  // accessor acquisition times, no-op unless LRUC_PROFILE_LOCKS
+  TableLockProfile tableLocks_;
 
   /**
-   * LRUCache size.
+   * Ordered index over keys in the double-linked list and their nodes, present iff
+   * KeyIndex. listMutex should be held during index modification.
    */
-  size_t cache_size_;
+  OrderedKeys orderedKeys_;
+
+  /**
+   * LRUCache size, lowered and raised at runtime by setCapacity().
+   */
+  std::atomic<size_t> cache_size_;
+
+  /**
+   * Change feed, null if not attached.
+   */
+  std::atomic<ChangeFeed*> changes_;
+
+  /**
+   * Operation counters, see stats().
+   */
+  StripedCounters stats_;
+
+  /**
+   * Eviction storm detection and the doorkeeper, see enableAdmissionThrottle().
+   */
+  struct Admission {
+    static constexpr uint64_t Window = 1024;
+    // inserts of the shard between checks for a storm
+    static constexpr uint64_t CheckInterval = 256;
+    // storm: evictions exceed StormRatio times the hits of a window
+    static constexpr uint64_t StormRatio = 4;
+
+    std::atomic<bool> enabled_{false};
+    std::atomic<bool> throttled_{false};
+    std::once_flag enableOnce_;
+    std::unique_ptr<std::atomic<uint64_t>[]> doorkeeper_;
+    size_t doorkeeperMask_ = 0;
+    std::atomic<uint64_t> doorkeeperBits_{0};
+
+    // held by the thread evaluating a window, which owns the totals below.
+    std::atomic<bool> evaluating_{false};
+    CacheStats last_;
+
+    // inserts since enabled, off the lines of the fields above.
+    alignas(64) std::atomic<uint64_t> inserts_{0};
+    // the detector's own counts while LRUC_DISABLE_STATS, see count().
+    std::atomic<uint64_t> counts_[static_cast<size_t>(CacheCounter::Count)] = {};
+  };
+  Admission admission_;
 
  private:
   /**
@@ -141,17 +280,163 @@ class LRUCache final {
    */
   void append(ListNode* node);
 
+  /**
+   * Link node right after pos.
+   * Not thread-safe. Caller is responsible for a lock.
+   */
+  void linkAfter(ListNode* pos, ListNode* node);
+
   /**
    * Unlink a node from the list.
    * Not thread-safe. Caller is responsible for a lock.
    */
   void unlink(ListNode* node);
 
+  /**
+   * Collect up to batchSize keys following cursor and move cursor past them.
+   * Return false once cursor has reached the end or was dropped by clear().
+   * Thread-safe.
+   */
+  bool advanceCursor(ListNode* cursor, std::vector<TKey>& keys, size_t batchSize);
+
+  /**
+   * Add/remove node to/from the ordered index, no-op without KeyIndex. A key re-inserted
+   * before its old node is unlinked maps to the new node, which unindexing the old one
+   * leaves alone.
+   * Not thread-safe. Caller is responsible for a lock.
+   */
+  void indexKey(ListNode* node);
+  void unindexKey(ListNode* node);
+
+  /**
+   * Outcome of popFront().
+   * Lost: a concurrent erase() took the least-recently used value first, nothing was
+   * evicted and erase() accounted for the removal.
+   */
+  enum class PopResult { Evicted, Lost, Empty };
+
   /**
    * Remove the least-recently used value from the LRUCache.
    * Thread-safe.
    */
-  void popFront();
+  PopResult popFront();
+
+  /**
+   * Insert key/value. An existing stale value is always overwritten, a live one only
+   * with assign set.
+   * Thread-safe.
+   */
+  InsertResult insertImpl(const TKey& key, const TValue& value, Tag tag, bool assign);
+
+  /**
+   * Remove key from the LRUCache iff check(value) returns true, checked while key is
+   * locked.
+   * Thread-safe.
+   */
+  template <class Check>
+  size_t eraseKey(const TKey& key, Check&& check);
+
+  /**
+   * Count an insert of key and decide whether it is admitted.
+   * Thread-safe.
+   */
+  bool admit(const TKey& key);
+
+  /**
+   * Weigh evictions against hits of the last window and switch throttling.
+   */
+  void evaluateStorm();
+
+  /**
+   * Count an operation in stats_, and for the storm detector if stats_ is compiled out.
+   */
+  void count(CacheCounter counter) {
+    stats_.add(counter);
+    if constexpr (!StripedCounters::Enabled) {
+      if (admission_.enabled_.load(std::memory_order_relaxed)) {
+        admission_.counts_[static_cast<size_t>(counter)].fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /**
+   * Counts the storm detector works on: stats_, or its own counts.
+   */
+  CacheStats admissionStats() const {
+    if constexpr (StripedCounters::Enabled) {
+      return stats_.snapshot();
+    } else {
+      auto read = [this](CacheCounter counter) {
+        return admission_.counts_[static_cast<size_t>(counter)].load(std::memory_order_relaxed);
+      };
+      CacheStats stats;
+      stats.hits_ = read(CacheCounter::Hit);
+      stats.inserts_ = read(CacheCounter::Insert);
+      stats.updates_ = read(CacheCounter::Update);
+      stats.rejectedInserts_ = read(CacheCounter::RejectedInsert);
+      stats.rejectedAdmissions_ = read(CacheCounter::RejectedAdmission);
+      stats.evictions_ = read(CacheCounter::Eviction);
+      return stats;
+    }
+  }
+
+  /**
+   * Lock listMutex_. With probes built, a lock that has to wait fires list_lock_wait
+   * before and list_lock_acquired after waiting.
+   */
+  std::unique_lock<ListMutex> lockList() {
+    if constexpr (ProbesEnabled) {
+      std::unique_lock<ListMutex> lock(listMutex_, std::try_to_lock);
+      if (!lock) {
+        LRUC_PROBE1(list_lock_wait, this);
+        lock.lock();
+        LRUC_PROBE1(list_lock_acquired, this);
+      }
+      return lock;
+    } else {
+      return std::unique_lock<ListMutex>(listMutex_);
+    }
+  }
+
+  /**
+   * Publish a mutation to the attached ChangeRing, key is nullptr for invalidations.
+   */
+  void recordChange(ChangeKind kind, Tag tag, const TKey* key, const TValue* value) {
+    if constexpr (std::is_trivially_copyable<TKey>::value && std::is_trivially_copyable<TValue>::value) {
+      ChangeFeed* changes = changes_.load(std::memory_order_acquire);
+      if (changes != nullptr) {
+        changes->publish(kind, tag, key, value);
+      }
+    }
+  }
+
+  /**
+   * Return true if value was stored before the latest invalidateAll(), or before
+   * the latest invalidateTag() of its tag.
+   */
+  bool isStale(const Value& value) const {
+    uint64_t floor = std::max(invalidGeneration_.load(std::memory_order_acquire),
+                              tagInvalidGenerations_[value.tag_].load(std::memory_order_acquire));
+    return value.generation_ < floor;
+  }
+
+  /**
+   * Start a new generation and return it, values stamped before are below it.
+   */
+  uint64_t nextGeneration() {
+    return generation_.fetch_add(1, std::memory_order_acq_rel) + 1;
+  }
+
+  /**
+   * Raise floor to generation, never lower it: of concurrent invalidations, the one
+   * drawing the older generation may store last.
+   */
+  static void raiseFloor(std::atomic<uint64_t>& floor, uint64_t generation) {
+    uint64_t current = floor.load(std::memory_order_relaxed);
+    while (current < generation &&
+           !floor.compare_exchange_weak(current, generation, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+  }
 
  public:
   /**
@@ -196,6 +481,46 @@ class LRUCache final {
     TValue value_;
   };
 
+  /**
+   * Cursor iterates the LRUCache from the least-recently used to the most-recently
+   * used element, concurrently with other operations.
+   *
+   * Iteration is weakly consistent: every element present for the whole iteration
+   * is visited at least once. An element promoted after it was visited may be
+   * visited again. Stale elements are skipped.
+   *
+   * The list mutex is held while collecting one batch of keys, and each value is
+   * copied under a single hash-table bucket lock.
+   * A Cursor must not outlive its LRUCache, clear() ends the iteration.
+   */
+  class Cursor final {
+   public:
+    explicit Cursor(LRUCache& cache, size_t batchSize = 64);
+    ~Cursor();
+
+    Cursor(const Cursor&) = delete;
+    Cursor& operator=(const Cursor&) = delete;
+
+    /**
+     * Copy the next element into key/value, and its tag into tag.
+     * Return false at the end of iteration.
+     */
+    bool next(TKey& key, TValue& value, Tag& tag);
+
+    bool next(TKey& key, TValue& value) {
+      Tag tag;
+      return next(key, value, tag);
+    }
+
+   private:
+    LRUCache& cache_;
+    // marker node parked inside the double-linked list.
+    ListNode node_;
+    std::vector<TKey> keys_;
+    size_t pos_;
+    size_t batchSize_;
+  };
+
   /**
    * size as the initial size for LRUCache.
    * The size should be tunable at run-time (Phase II)
@@ -218,6 +543,24 @@ class LRUCache final {
    */
   size_t erase(const TKey& key);
 
+  /**
+   * Erase key iff pred(key, value) returns true for its live value. pred is called
+   * while key is locked, so a concurrent update can't slip in between.
+   * returns number of elements removed (0 or 1).
+   */
+  template <class Pred>
+  size_t eraseIf(const TKey& key, Pred&& pred) {
+    return eraseKey(key, [&](const Value& value) { return !isStale(value) && pred(key, value.value_); });
+  }
+
+  /**
+   * Erase all keys within [lo, hi] along with their values.
+   * Cost is proportional to the number of erased keys.
+   * Returns number of elements removed.
+   * Requires KeyIndex.
+   */
+  size_t eraseRange(const TKey& lo, const TKey& hi);
+
   /**
    * Find data inside hash-table through provided key.
    * ConstAccessor stores the found result.
@@ -231,11 +574,35 @@ class LRUCache final {
   /**
    * Insert key/value into LRUCache. Both key and value is copied into the cache.
    * Insert updates key access frequency.
+   * tag is kept along with the value for invalidateTag().
    *
    * If key already exists in the LRUCache, the value will not be updated and return
    * false. Otherwise return true.
+   * With admission throttling enabled, false may also mean the key was not admitted,
+   * see tryInsert().
    */
-  bool insert(const TKey& key, const TValue& value);
+  bool insert(const TKey& key, const TValue& value, Tag tag = 0);
+
+  /**
+   * Insert key/value into LRUCache, or overwrite the value and tag if key already
+   * exists. Updates key access frequency.
+   *
+   * Return true if key was inserted, false if an existing value was overwritten.
+   * With admission throttling enabled, false may also mean the key was not admitted,
+   * see tryInsertOrAssign().
+   */
+  bool insertOrAssign(const TKey& key, const TValue& value, Tag tag = 0);
+
+  /**
+   * Same as insert() and insertOrAssign(), returning the outcome.
+   */
+  InsertResult tryInsert(const TKey& key, const TValue& value, Tag tag = 0) {
+    return insertImpl(key, value, tag, false);
+  }
+
+  InsertResult tryInsertOrAssign(const TKey& key, const TValue& value, Tag tag = 0) {
+    return insertImpl(key, value, tag, true);
+  }
 
   /**
    * Erases all elements from the container.
@@ -245,7 +612,47 @@ class LRUCache final {
   void clear();
 
   /**
-   * Returns the number of elements in the container.
+   * Invalidate all elements by bumping the generation. Elements stored before this
+   * call read as misses, and a later insert() of the same key succeeds.
+   * Memory is reclaimed lazily by eviction or purgeStale().
+   * Thread-safe, O(1).
+   */
+  void invalidateAll() {
+    raiseFloor(invalidGeneration_, nextGeneration());
+    recordChange(ChangeKind::InvalidateAll, 0, nullptr, nullptr);
+  }
+
+  /**
+   * Invalidate all elements inserted with tag, e.g. after rolling back a bad feed.
+   * Same semantics as invalidateAll() otherwise.
+   * Thread-safe, O(1).
+   */
+  void invalidateTag(Tag tag) {
+    raiseFloor(tagInvalidGenerations_[tag], nextGeneration());
+    recordChange(ChangeKind::InvalidateTag, tag, nullptr, nullptr);
+  }
+
+  /**
+   * Publish subsequent mutations to changes, nullptr detaches.
+   * changes must outlive the attachment.
+   */
+  void attachChangeRing(ChangeFeed* changes) {
+    changes_.store(changes, std::memory_order_release);
+  }
+
+  /**
+   * Scan up to maxScan elements from the least-recently used end and erase the
+   * stale ones. Meant to be called from background maintenance.
+   * Elements invalidated by tag may sit anywhere in the list, those outside the
+   * scanned range are reclaimed by eviction.
+   * Returns number of elements erased.
+   * Thread-safe.
+   */
+  size_t purgeStale(size_t maxScan);
+
+  /**
+   * Returns the number of elements in the container, including stale elements
+   * not yet reclaimed.
    */
   size_t size() const {
     return current_size_.load();
@@ -254,17 +661,78 @@ class LRUCache final {
   /**
    * Returns LRUCache capacity
    */
-  constexpr size_t capacity() const {
-    return cache_size_;
+  size_t capacity() const {
+    return cache_size_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Change the capacity at runtime, e.g. to yield memory under pressure.
+   * Lowering it doesn't evict by itself: every insert evicts at most one element, so
+   * call evictExcess() to shrink at once.
+   * Thread-safe.
+   */
+  void setCapacity(size_t size) {
+    cache_size_.store(size, std::memory_order_relaxed);
+  }
+
+  /**
+   * Evict up to maxEvictions least-recently used elements while size() exceeds
+   * capacity(). Returns number of elements evicted.
+   * Thread-safe.
+   */
+  size_t evictExcess(size_t maxEvictions);
+
+  /**
+   * Throttle admission of new keys during eviction storms, see Admission throttling.
+   * Thread-safe, idempotent.
+   */
+  void enableAdmissionThrottle();
+
+  /**
+   * Return true while new keys are only admitted on their second insert.
+   */
+  bool admissionThrottled() const {
+    return admission_.throttled_.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Returns number of inserts rejected by admission throttling.
+   */
+  uint64_t rejectedAdmissions() const {
+    return admissionStats().rejectedAdmissions_;
+  }
+
+  /**
+   * Returns operation counts since construction, summed over threads.
+   * All zero with LRUC_DISABLE_STATS.
+   */
+  CacheStats stats() const {
+    return stats_.snapshot();
+  }
+
+  /**
+   * Returns contention of the list mutex, empty without LRUC_PROFILE_LOCKS.
+   */
+  LockStats listLockStats() const {
+    return lockStats(listMutex_);
+  }
+
+  /**
+   * Returns hash table accessor acquisitions, empty without LRUC_PROFILE_LOCKS.
+   * See TableLockProfile.
+   */
+  LockStats tableLockStats() const {
+    return tableLocks_.stats();
   }
 };
 
-template <class TKey, class TValue, class THash>
-typename LRUCache<TKey, TValue, THash>::ListNode* const LRUCache<TKey, TValue, THash>::NullNodePtr = (ListNode*) - 1;
+template <class TKey, class TValue, class THash, bool KeyIndex>
+typename LRUCache<TKey, TValue, THash, KeyIndex>::ListNode* const LRUCache<TKey, TValue, THash, KeyIndex>::NullNodePtr =
+  (ListNode*) - 1;
 
 // ---- private member functions ----
-template <class TKey, class TValue, class THash>
-inline void LRUCache<TKey, TValue, THash>::unlink(ListNode* node) {
+template <class TKey, class TValue, class THash, bool KeyIndex>
+inline void LRUCache<TKey, TValue, THash, KeyIndex>::unlink(ListNode* node) {
   ListNode* prev = node->prev_;
   ListNode* next = node->next_;
   prev->next_ = next;
@@ -273,8 +741,8 @@ inline void LRUCache<TKey, TValue, THash>::unlink(ListNode* node) {
   node->prev_ = NullNodePtr;
 }
 
-template <class TKey, class TValue, class THash>
-inline void LRUCache<TKey, TValue, THash>::append(ListNode* node) {
+template <class TKey, class TValue, class THash, bool KeyIndex>
+inline void LRUCache<TKey, TValue, THash, KeyIndex>::append(ListNode* node) {
   ListNode* prevLatestNode = tail_.prev_;
 
   node->next_ = &tail_;
@@ -284,136 +752,399 @@ inline void LRUCache<TKey, TValue, THash>::append(ListNode* node) {
   prevLatestNode->next_ = node;
 }
 
-template <class TKey, class TValue, class THash>
-void LRUCache<TKey, TValue, THash>::popFront() {
+template <class TKey, class TValue, class THash, bool KeyIndex>
+inline void LRUCache<TKey, TValue, THash, KeyIndex>::linkAfter(ListNode* pos, ListNode* node) {
+  ListNode* next = pos->next_;
+
+  node->prev_ = pos;
+  node->next_ = next;
+
+  pos->next_ = node;
+  next->prev_ = node;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+bool LRUCache<TKey, TValue, THash, KeyIndex>::advanceCursor(ListNode* cursor, std::vector<TKey>& keys,
+                                                            size_t batchSize) {
+  std::unique_lock<ListMutex> lock = lockList();
+  if (!cursor->inList()) {
+    return false;
+  }
+
+  ListNode* last = cursor;
+  for (ListNode* node = cursor->next_; node != &tail_ && keys.size() < batchSize; node = node->next_) {
+    if (!node->cursor_) {
+      keys.push_back(node->key_);
+    }
+    last = node;
+  }
+
+  if (keys.empty()) {
+    unlink(cursor);
+    return false;
+  }
+
+  unlink(cursor);
+  linkAfter(last, cursor);
+
+  return true;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+inline void LRUCache<TKey, TValue, THash, KeyIndex>::indexKey(ListNode* node) {
+  if constexpr (KeyIndex) {
+    orderedKeys_[node->key_] = node;
+  }
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+inline void LRUCache<TKey, TValue, THash, KeyIndex>::unindexKey(ListNode* node) {
+  if constexpr (KeyIndex) {
+    auto it = orderedKeys_.find(node->key_);
+    if (it != orderedKeys_.end() && it->second == node) {
+      orderedKeys_.erase(it);
+    }
+  }
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+typename LRUCache<TKey, TValue, THash, KeyIndex>::PopResult LRUCache<TKey, TValue, THash, KeyIndex>::popFront() {
   ListNode* candidate = nullptr;
   TKey tmpKey;
 
   {
-    std::unique_lock<ListMutex> lock(listMutex_);
+    std::unique_lock<ListMutex> lock = lockList();
 
     candidate = head_.next_;
+    // skip parked cursors
+    while (candidate != &tail_ && candidate->cursor_) {
+      candidate = candidate->next_;
+    }
     // empty double-linked list check
     if (candidate == &tail_) {
-      return;
+      return PopResult::Empty;
     }
 
     unlink(candidate);
+    unindexKey(candidate);
+    // claim the node: erase() won't delete it while we still compare it below.
+    candidate->evicting_ = true;
 
     tmpKey = candidate->key_;
+  }
 
-    delete candidate;
+  // The node is owned by whoever erases its hash-table entry. As the claimed node
+  // stays allocated, an entry still pointing to it is the one we unlinked.
+  HashMapAccessor hashAccessor;
+  uint64_t lockStart = tableLocks_.begin();
+  bool found = hash_map_.find(hashAccessor, tmpKey);
+  tableLocks_.acquired(lockStart);
+  if (!found || hashAccessor->second.listNode_ != candidate) {
+    hashAccessor.release();
+
+    // erase() took the entry. Of erase() and us, the second to see the claim
+    // dropped deletes the node.
+    bool last;
+    {
+      std::unique_lock<ListMutex> lock = lockList();
+      last = !candidate->evicting_;
+      candidate->evicting_ = false;
+    }
+    if (last) {
+      delete candidate;
+    }
+    return PopResult::Lost;
   }
 
-  HashMapConstAccessor constHashAccessor;
-  if (!hash_map_.find(constHashAccessor, tmpKey)) {
-    return;
+  recordChange(ChangeKind::Evict, hashAccessor->second.tag_, &tmpKey, nullptr);
+  hash_map_.erase(hashAccessor);
+  hashAccessor.release();
+
+  delete candidate;
+  count(CacheCounter::Eviction);
+  threadEvictions++;
+  LRUC_PROBE2(evict, this, probeKey(tmpKey));
+  return PopResult::Evicted;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+bool LRUCache<TKey, TValue, THash, KeyIndex>::admit(const TKey& key) {
+  if ((admission_.inserts_.fetch_add(1, std::memory_order_relaxed) + 1) % Admission::CheckInterval == 0) {
+    evaluateStorm();
+  }
+
+  if (!admission_.throttled_.load(std::memory_order_relaxed) || current_size_.load() < capacity() ||
+      hash_map_.count(key) > 0) {
+    return true;
   }
 
-  hash_map_.erase(constHashAccessor);
+  // second insert within the doorkeeper period: both probe bits already set.
+  THash hashObj{};
+  uint64_t hash = static_cast<uint64_t>(hashObj.hash(key)) * 0x9E3779B97F4A7C15ULL;
+  size_t bits[2] = {static_cast<size_t>(hash) & admission_.doorkeeperMask_,
+                    static_cast<size_t>(hash >> 32) & admission_.doorkeeperMask_};
+  bool seen = true;
+  for (size_t bit : bits) {
+    uint64_t mask = uint64_t(1) << (bit % 64);
+    if ((admission_.doorkeeper_[bit / 64].fetch_or(mask, std::memory_order_relaxed) & mask) == 0) {
+      seen = false;
+      admission_.doorkeeperBits_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
 
+  if (!seen) {
+    count(CacheCounter::RejectedAdmission);
+  }
+  return seen;
 }
 
-// ---- private member functions end ----
+template <class TKey, class TValue, class THash, bool KeyIndex>
+void LRUCache<TKey, TValue, THash, KeyIndex>::evaluateStorm() {
+  if (admission_.evaluating_.exchange(true, std::memory_order_acquire)) {
+    return;
+  }
 
-template <class TKey, class TValue, class THash>
-LRUCache<TKey, TValue, THash>::LRUCache(size_t size, size_t bucketCount)
-  : hash_map_(bucketCount), current_size_(0), cache_size_(size) {
-  head_.prev_ = nullptr;
-  head_.next_ = &tail_;
-  tail_.prev_ = &head_;
+  CacheStats now = admissionStats();
+  CacheStats& last = admission_.last_;
+  uint64_t inserts = now.inserts_ + now.updates_ + now.rejectedInserts_ + now.rejectedAdmissions_ -
+                     (last.inserts_ + last.updates_ + last.rejectedInserts_ + last.rejectedAdmissions_);
+  if (inserts < Admission::Window) {
+    admission_.evaluating_.store(false, std::memory_order_release);
+    return;
+  }
+
+  // a rejected key would have evicted another one if admitted.
+  uint64_t pressure = now.evictions_ - last.evictions_ + now.rejectedAdmissions_ - last.rejectedAdmissions_;
+  uint64_t windowHits = now.hits_ - last.hits_;
+  last = now;
+
+  bool storm = pressure >= inserts / 2 && pressure > windowHits * Admission::StormRatio;
+  bool calm = pressure < inserts / 4 || pressure * 2 <= windowHits * Admission::StormRatio;
+
+  size_t doorkeeperSize = admission_.doorkeeperMask_ + 1;
+  if (storm) {
+    admission_.throttled_.store(true, std::memory_order_relaxed);
+  } else if (calm) {
+    admission_.throttled_.store(false, std::memory_order_relaxed);
+  }
+
+  // start a new doorkeeper period once calm or half full.
+  if (calm || admission_.doorkeeperBits_.load(std::memory_order_relaxed) > doorkeeperSize / 2) {
+    for (size_t i = 0; i < doorkeeperSize / 64; i++) {
+      admission_.doorkeeper_[i].store(0, std::memory_order_relaxed);
+    }
+    admission_.doorkeeperBits_.store(0, std::memory_order_relaxed);
+  }
+
+  admission_.evaluating_.store(false, std::memory_order_release);
 }
 
-template <class TKey, class TValue, class THash>
-size_t LRUCache<TKey, TValue, THash>::erase(const TKey& key) {
+template <class TKey, class TValue, class THash, bool KeyIndex>
+template <class Check>
+size_t LRUCache<TKey, TValue, THash, KeyIndex>::eraseKey(const TKey& key, Check&& check) {
   ListNode* found_node;
 
-  // immutable read accessor
-  HashMapConstAccessor hashAccessor{};
-  if (!hash_map_.find(hashAccessor, key)) {
-    hashAccessor.release();  // release early
-    return 0;
-  } else {
+  {
+    // release HashMapAccessor early
+    HashMapAccessor hashAccessor;
+    uint64_t lockStart = tableLocks_.begin();
+    bool found = hash_map_.find(hashAccessor, key);
+    tableLocks_.acquired(lockStart);
+    if (!found) {
+      return 0;
+    }
+
+    if (!check(hashAccessor->second)) {
+      return 0;
+    }
+
     found_node = hashAccessor->second.listNode_;
-    hashAccessor.release();  // release early
+    recordChange(ChangeKind::Erase, hashAccessor->second.tag_, &key, nullptr);
+    hash_map_.erase(hashAccessor);
   }
 
-  // tbb::concurrent_hash_map.erase(key) by contract won't throw exception if key does not exist.
-  hash_map_.erase(key);
-
+  bool last = true;
   {
     // Update double-linked list before update current_size_
-    std::unique_lock<ListMutex> lock(listMutex_);
+    // popFront() may have unlinked and claimed the node already, see popFront().
+    std::unique_lock<ListMutex> lock = lockList();
     if (found_node->inList()) {
       unlink(found_node);
-      delete found_node;
+      unindexKey(found_node);
+    } else if (found_node->evicting_) {
+      found_node->evicting_ = false;
+      last = false;
     }
   }
 
+  if (last) {
+    delete found_node;
+  }
 
   current_size_--;
+  count(CacheCounter::Erase);
+  LRUC_PROBE2(erase, this, probeKey(key));
 
   return 1;
 }
 
-template <class TKey, class TValue, class THash>
-bool LRUCache<TKey, TValue, THash>::find(ConstAccessor& caccessor, const TKey& key) {
+// ---- private member functions end ----
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+LRUCache<TKey, TValue, THash, KeyIndex>::LRUCache(size_t size, size_t bucketCount)
+  : hash_map_(bucketCount),
+    current_size_(0),
+    generation_(0),
+    invalidGeneration_(0),
+    cache_size_(size),
+    changes_(nullptr) {
+  for (auto& tagInvalidGeneration : tagInvalidGenerations_) {
+    tagInvalidGeneration.store(0, std::memory_order_relaxed);
+  }
+
+  head_.prev_ = nullptr;
+  head_.next_ = &tail_;
+  tail_.prev_ = &head_;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+size_t LRUCache<TKey, TValue, THash, KeyIndex>::erase(const TKey& key) {
+  return eraseKey(key, [](const Value&) { return true; });
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+size_t LRUCache<TKey, TValue, THash, KeyIndex>::eraseRange(const TKey& lo, const TKey& hi) {
+  static_assert(KeyIndex, "eraseRange() requires LRUCache with KeyIndex");
+
+  std::vector<TKey> keys;
+
+  {
+    std::unique_lock<ListMutex> lock = lockList();
+    for (auto it = orderedKeys_.lower_bound(lo); it != orderedKeys_.end() && !(hi < it->first); ++it) {
+      keys.push_back(it->first);
+    }
+  }
+
+  size_t erased = 0;
+  for (const TKey& key : keys) {
+    erased += erase(key);
+  }
+
+  return erased;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+bool LRUCache<TKey, TValue, THash, KeyIndex>::find(ConstAccessor& caccessor, const TKey& key) {
   ListNode* found_node;
 
   // immutable read accessor
   HashMapConstAccessor& hashAccessor = caccessor.hashAccessor_;
-  if (!hash_map_.find(hashAccessor, key)) {
+  uint64_t lockStart = tableLocks_.begin();
+  bool found = hash_map_.find(hashAccessor, key);
+  tableLocks_.acquired(lockStart);
+  if (!found || isStale(hashAccessor->second)) {
     hashAccessor.release();  // release early
+    count(CacheCounter::Miss);
+    LRUC_PROBE2(find_miss, this, probeKey(key));
     return false;
-  } else {
-    caccessor.setValue();
-    found_node = hashAccessor->second.listNode_;
-    hashAccessor.release();  // release early
   }
 
+  caccessor.setValue();
+  found_node = hashAccessor->second.listNode_;
+  count(CacheCounter::Hit);
+  LRUC_PROBE2(find_hit, this, probeKey(key));
+
   {
     // Key found, update double-linked list with try lock.
+    // hashAccessor is held meanwhile so the node can't be erased under us.
     std::unique_lock<ListMutex> lock{listMutex_, std::try_to_lock};
     if (lock) {
       if (found_node->inList()) {
         unlink(found_node);
         append(found_node);
       }
+    } else {
+      count(CacheCounter::LostPromotion);
+      LRUC_PROBE2(promotion_lost, this, probeKey(key));
     }
   }
 
+  hashAccessor.release();
+
   return true;
 }
 
-template <class TKey, class TValue, class THash>
-bool LRUCache<TKey, TValue, THash>::insert(const TKey& key, const TValue& value) {
+template <class TKey, class TValue, class THash, bool KeyIndex>
+bool LRUCache<TKey, TValue, THash, KeyIndex>::insert(const TKey& key, const TValue& value, Tag tag) {
+  InsertResult result = insertImpl(key, value, tag, false);
+  return result == InsertResult::Inserted || result == InsertResult::Assigned;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+bool LRUCache<TKey, TValue, THash, KeyIndex>::insertOrAssign(const TKey& key, const TValue& value, Tag tag) {
+  return insertImpl(key, value, tag, true) == InsertResult::Inserted;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+InsertResult LRUCache<TKey, TValue, THash, KeyIndex>::insertImpl(const TKey& key, const TValue& value, Tag tag,
+                                                                  bool assign) {
+  if (admission_.enabled_.load(std::memory_order_acquire) && !admit(key)) {
+    LRUC_PROBE3(insert, this, probeKey(key), static_cast<int>(InsertResult::NotAdmitted));
+    return InsertResult::NotAdmitted;
+  }
+
   // create node with key through default new allocator.
   ListNode* node = new ListNode(key);
 
   {
     // release HashMapAccessor early
     HashMapAccessor hashAccessor;
-    HashMapValuePair hashMapValue(key, Value(value, node));
+    HashMapValuePair hashMapValue(key, Value(value, node, generation_.load(std::memory_order_acquire), tag));
     // hashMapValue is copied and memory allocated in concurrent_hash_map
-    if (!hash_map_.insert(hashAccessor, hashMapValue)) {
+    uint64_t lockStart = tableLocks_.begin();
+    bool inserted = hash_map_.insert(hashAccessor, hashMapValue);
+    tableLocks_.acquired(lockStart);
+    if (!inserted) {
       delete node;
-      return false;
+
+      Value& existing = hashAccessor->second;
+      if (!assign && !isStale(existing)) {
+        count(CacheCounter::RejectedInsert);
+        LRUC_PROBE3(insert, this, probeKey(key), static_cast<int>(InsertResult::Exists));
+        return InsertResult::Exists;
+      }
+
+      // Key was invalidated or is assigned, refresh it in place as the most-recently used.
+      existing.value_ = value;
+      existing.generation_ = hashMapValue.second.generation_;
+      existing.tag_ = tag;
+      recordChange(ChangeKind::Update, tag, &key, &value);
+
+      std::unique_lock<ListMutex> lock = lockList();
+      if (existing.listNode_->inList()) {
+        unlink(existing.listNode_);
+        append(existing.listNode_);
+      }
+
+      count(CacheCounter::Update);
+      LRUC_PROBE3(insert, this, probeKey(key), static_cast<int>(InsertResult::Assigned));
+      return InsertResult::Assigned;
     }
+
+    recordChange(ChangeKind::Insert, tag, &key, &value);
+
+    // Update double-linked list before the entry becomes visible to erase().
+    std::unique_lock<ListMutex> lock = lockList();
+    append(node);
+    indexKey(node);
   }
+  count(CacheCounter::Insert);
 
   // While hits LRUCache capacity, evict one item from double-linked list.
-  // Happens before insertion.
   size_t size = current_size_.load();
   bool popped = false;
-  if (size >= cache_size_) {
-    popFront();
-    popped = true;
-  }
-
-  {
-    // Update double-linked list before update current_size_
-    std::unique_lock<ListMutex> lock(listMutex_);
-    append(node);
+  if (size >= capacity()) {
+    popped = popFront() == PopResult::Evicted;
   }
 
   // only update atomic if there's no eviction.
@@ -425,20 +1156,87 @@ bool LRUCache<TKey, TValue, THash>::insert(const TKey& key, const TValue& value)
   // updating the cache and had the cache exceed the defined cache size.
   // Evict one node per insertion, avoid while loop with compare_exchange_weak
   // which consumes power and increases latency for insertion.
-  if (size > cache_size_) {
+  if (size > capacity()) {
     // Use compare_exchange_strong with default sequential consistency memory model.
     // Update double-linked list iff there's no value change in between
     // previous load expression to (size - 1).
-    if (current_size_.compare_exchange_strong(size, size - 1)) {
-      popFront();
+    if (current_size_.compare_exchange_strong(size, size - 1) && popFront() != PopResult::Evicted) {
+      // nothing evicted, give the claimed decrement back.
+      current_size_++;
     }
   }
 
-  return true;
+  LRUC_PROBE3(insert, this, probeKey(key), static_cast<int>(InsertResult::Inserted));
+  return InsertResult::Inserted;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+size_t LRUCache<TKey, TValue, THash, KeyIndex>::purgeStale(size_t maxScan) {
+  std::vector<TKey> keys;
+  keys.reserve(maxScan);
+
+  {
+    // Elements are never promoted once stale, thus gather at the least-recently used end.
+    std::unique_lock<ListMutex> lock = lockList();
+    for (ListNode* node = head_.next_; node != &tail_ && keys.size() < maxScan; node = node->next_) {
+      if (!node->cursor_) {
+        keys.push_back(node->key_);
+      }
+    }
+  }
+
+  size_t purged = 0;
+  for (const TKey& key : keys) {
+    purged += eraseKey(key, [this](const Value& value) { return isStale(value); });
+  }
+
+  return purged;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+size_t LRUCache<TKey, TValue, THash, KeyIndex>::evictExcess(size_t maxEvictions) {
+  size_t evicted = 0;
+  while (evicted < maxEvictions) {
+    size_t size = current_size_.load();
+    if (size <= capacity()) {
+      break;
+    }
+    // same accounting as insertImpl(): claim the decrement, then evict.
+    if (!current_size_.compare_exchange_strong(size, size - 1)) {
+      continue;
+    }
+    PopResult popped = popFront();
+    if (popped != PopResult::Evicted) {
+      current_size_++;
+      if (popped == PopResult::Empty) {
+        break;
+      }
+      continue;
+    }
+    evicted++;
+  }
+  return evicted;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+void LRUCache<TKey, TValue, THash, KeyIndex>::enableAdmissionThrottle() {
+  std::call_once(admission_.enableOnce_, [this] {
+    // about 8 bits per element, at least 4096
+    size_t bits = 4096;
+    while (bits < capacity() * 8) {
+      bits <<= 1;
+    }
+    admission_.doorkeeper_.reset(new std::atomic<uint64_t>[bits / 64]);
+    for (size_t i = 0; i < bits / 64; i++) {
+      admission_.doorkeeper_[i].store(0, std::memory_order_relaxed);
+    }
+    admission_.doorkeeperMask_ = bits - 1;
+    admission_.enabled_.store(true, std::memory_order_release);
+  });
 }
 
-template <class TKey, class TValue, class THash>
-void LRUCache<TKey, TValue, THash>::clear() {
+template <class TKey, class TValue, class THash, bool KeyIndex>
+void LRUCache<TKey, TValue, THash, KeyIndex>::clear() {
   hash_map_.clear();
 
   ListNode* node = head_.next_;
@@ -446,12 +1244,63 @@ void LRUCache<TKey, TValue, THash>::clear() {
   ListNode* next;
   while (node != &tail_) {
     next = node->next_;
-    delete node;
+    if (node->cursor_) {
+      // owned by its Cursor, which then sees the end of iteration.
+      node->prev_ = NullNodePtr;
+    } else {
+      delete node;
+    }
     node = next;
   }
 
   head_.next_ = &tail_;
   tail_.prev_ = &head_;
+  if constexpr (KeyIndex) {
+    orderedKeys_.clear();
+  }
   current_size_ = 0;
+  recordChange(ChangeKind::Clear, 0, nullptr, nullptr);
+}
+// ---- Cursor ----
+template <class TKey, class TValue, class THash, bool KeyIndex>
+LRUCache<TKey, TValue, THash, KeyIndex>::Cursor::Cursor(LRUCache& cache, size_t batchSize)
+  : cache_(cache), pos_(0), batchSize_(batchSize > 0 ? batchSize : 1) {
+  node_.cursor_ = true;
+  keys_.reserve(batchSize_);
+
+  std::unique_lock<ListMutex> lock(cache_.listMutex_);
+  cache_.linkAfter(&cache_.head_, &node_);
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+LRUCache<TKey, TValue, THash, KeyIndex>::Cursor::~Cursor() {
+  std::unique_lock<ListMutex> lock(cache_.listMutex_);
+  if (node_.inList()) {
+    cache_.unlink(&node_);
+  }
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+bool LRUCache<TKey, TValue, THash, KeyIndex>::Cursor::next(TKey& key, TValue& value, Tag& tag) {
+  while (true) {
+    if (pos_ == keys_.size()) {
+      keys_.clear();
+      pos_ = 0;
+      if (!cache_.advanceCursor(&node_, keys_, batchSize_)) {
+        return false;
+      }
+    }
+
+    const TKey& candidate = keys_[pos_++];
+
+    // key could be erased after it was collected, skip it then.
+    HashMapConstAccessor hashAccessor;
+    if (cache_.hash_map_.find(hashAccessor, candidate) && !cache_.isStale(hashAccessor->second)) {
+      key = candidate;
+      value = hashAccessor->second.value_;
+      tag = hashAccessor->second.tag_;
+      return true;
+    }
+  }
 }
 }  // namespace LRUC
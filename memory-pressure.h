@@ -0,0 +1,257 @@
+/**
+ * @author shchang
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+namespace LRUC {
+
+/**
+ * Memory pressure of the process' cgroup as seen by MemoryPressureMonitor.
+ */
+struct MemoryReading {
+  // share of time some task stalled on memory over the last 10s, in %, -1 if unknown
+  double someAvg10_ = -1;
+  // cgroup memory.current and memory.max in bytes, limit_ is max() if unlimited or unknown
+  uint64_t current_ = 0;
+  uint64_t limit_ = std::numeric_limits<uint64_t>::max();
+};
+
+/**
+ * Read "some avg10=" of a PSI file such as /proc/pressure/memory.
+ */
+inline bool readPsiSomeAvg10(const std::string& path, double& someAvg10) {
+  FILE* file = std::fopen(path.c_str(), "re");
+  if (file == nullptr) {
+    return false;
+  }
+
+  char line[256];
+  bool found = false;
+  while (!found && std::fgets(line, sizeof(line), file) != nullptr) {
+    found = std::sscanf(line, "some avg10=%lf", &someAvg10) == 1;
+  }
+  std::fclose(file);
+  return found;
+}
+
+/**
+ * Read a cgroup v2 memory file holding a byte count or "max".
+ */
+inline bool readCgroupBytes(const std::string& path, uint64_t& bytes) {
+  FILE* file = std::fopen(path.c_str(), "re");
+  if (file == nullptr) {
+    return false;
+  }
+
+  char line[64];
+  bool ok = std::fgets(line, sizeof(line), file) != nullptr;
+  std::fclose(file);
+  if (!ok) {
+    return false;
+  }
+  if (std::strncmp(line, "max", 3) == 0) {
+    bytes = std::numeric_limits<uint64_t>::max();
+    return true;
+  }
+
+  char* end;
+  bytes = std::strtoull(line, &end, 10);
+  return end != line;
+}
+
+/**
+ * cgroup v2 directory of this process, from the "0::" line of /proc/self/cgroup.
+ * Empty if not found.
+ */
+inline std::string cgroupDirectory() {
+  FILE* file = std::fopen("/proc/self/cgroup", "re");
+  if (file == nullptr) {
+    return std::string();
+  }
+
+  char line[4096];
+  std::string dir;
+  while (std::fgets(line, sizeof(line), file) != nullptr) {
+    if (std::strncmp(line, "0::", 3) == 0) {
+      dir = "/sys/fs/cgroup";
+      dir += line + 3;
+      while (!dir.empty() && (dir.back() == '\n' || dir.back() == '/')) {
+        dir.pop_back();
+      }
+      break;
+    }
+  }
+  std::fclose(file);
+  return dir;
+}
+
+/**
+ * MemoryPressureMonitor lets a cache yield memory before the container is OOM-killed.
+ *
+ * A background thread samples memory PSI and the cgroup's memory.current against
+ * memory.max every interval. Under pressure, it lowers the cache capacity by one step,
+ * evicts the excess in batches and returns freed heap to the OS with malloc_trim(),
+ * which releases free pages with MADV_DONTNEED. Once pressure eases, the capacity grows
+ * back step-wise up to where it started.
+ *
+ * Type concepts:
+ *  TCache provides capacity(), setCapacity(size_t) and evictExcess(size_t), e.g.
+ *  ScalableLRUCache.
+ */
+template <class TCache>
+class MemoryPressureMonitor final {
+ public:
+  struct Options {
+    std::string psiPath = "/proc/pressure/memory";
+    // cgroup v2 directory holding memory.current/memory.max, empty: this process' cgroup
+    std::string cgroupDir;
+    std::chrono::milliseconds interval = std::chrono::milliseconds(1000);
+    // pressure: some avg10 above psiThreshold, or usage above highUsage of the limit
+    double psiThreshold = 10.0;
+    double highUsage = 0.90;
+    // eased: some avg10 below half of psiThreshold and usage below lowUsage
+    double lowUsage = 0.75;
+    // shrink/grow step and lower bound, as a share of the initial capacity
+    double step = 0.10;
+    double minCapacity = 0.25;
+    // elements evicted per shard between yields
+    size_t evictBatch = 4096;
+  };
+
+ private:
+  TCache& cache_;
+  Options options_;
+  size_t initialCapacity_;
+  uint64_t shrinks_;
+  uint64_t grows_;
+
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  bool stopping_;
+  std::thread thread_;
+
+ private:
+  size_t stepSize() const {
+    return std::max<size_t>(1, static_cast<size_t>(initialCapacity_ * options_.step));
+  }
+
+  void monitorLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+      wakeup_.wait_for(lock, options_.interval);
+      if (!stopping_) {
+        lock.unlock();
+        poll();
+        lock.lock();
+      }
+    }
+  }
+
+  bool stopping() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stopping_;
+  }
+
+ public:
+  /**
+   * The capacity of cache at construction is the one grown back to.
+   * start: run the monitor thread, otherwise poll() drives it.
+   */
+  explicit MemoryPressureMonitor(TCache& cache, const Options& options = Options(), bool start = true)
+    : cache_(cache),
+      options_(options),
+      initialCapacity_(cache.capacity()),
+      shrinks_(0),
+      grows_(0),
+      stopping_(false) {
+    if (options_.cgroupDir.empty()) {
+      options_.cgroupDir = cgroupDirectory();
+    }
+    if (start) {
+      thread_ = std::thread([this] { monitorLoop(); });
+    }
+  }
+
+  ~MemoryPressureMonitor() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wakeup_.notify_one();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  MemoryPressureMonitor(const MemoryPressureMonitor&) = delete;
+  MemoryPressureMonitor& operator=(const MemoryPressureMonitor&) = delete;
+
+  MemoryReading read() const {
+    MemoryReading reading;
+    readPsiSomeAvg10(options_.psiPath, reading.someAvg10_);
+    if (!options_.cgroupDir.empty() && readCgroupBytes(options_.cgroupDir + "/memory.current", reading.current_)) {
+      readCgroupBytes(options_.cgroupDir + "/memory.max", reading.limit_);
+    }
+    return reading;
+  }
+
+  /**
+   * Sample pressure once and shrink or grow the cache by one step.
+   * Returns the capacity afterwards.
+   */
+  size_t poll() {
+    MemoryReading reading = read();
+    bool limited = reading.limit_ != std::numeric_limits<uint64_t>::max() && reading.limit_ > 0;
+    double usage = limited ? static_cast<double>(reading.current_) / static_cast<double>(reading.limit_) : 0;
+
+    bool pressure = reading.someAvg10_ > options_.psiThreshold || usage > options_.highUsage;
+    bool eased = reading.someAvg10_ < options_.psiThreshold / 2 && usage < options_.lowUsage;
+
+    size_t capacity = cache_.capacity();
+    size_t floor = static_cast<size_t>(initialCapacity_ * options_.minCapacity);
+
+    if (pressure && capacity > floor) {
+      capacity = capacity > floor + stepSize() ? capacity - stepSize() : floor;
+      cache_.setCapacity(capacity);
+      shrinks_++;
+      while (cache_.evictExcess(options_.evictBatch) > 0 && !stopping()) {
+        std::this_thread::yield();
+      }
+#if defined(__GLIBC__)
+      ::malloc_trim(0);
+#endif
+    } else if (eased && capacity < initialCapacity_) {
+      capacity = std::min(initialCapacity_, capacity + stepSize());
+      cache_.setCapacity(capacity);
+      grows_++;
+    }
+
+    return capacity;
+  }
+
+  uint64_t shrinks() const {
+    return shrinks_;
+  }
+
+  uint64_t grows() const {
+    return grows_;
+  }
+};
+}  // namespace LRUC
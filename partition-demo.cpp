@@ -0,0 +1,181 @@
+// Multi-process smoke test of PartitionedCache (partitioned-cache.h): starts two
+// cache-server peers, and partitions keys over this process, the two servers
+// and a peer that never comes up.
+//
+// usage: partition-demo <cache-server binary> [keys]
+//
+// Checks that every key lands on its owner only, that findMany() returns the
+// values of all reachable peers, with more keys per peer than one MultiGet
+// carries, and that an unreachable peer, or one killed mid-way, reads as misses
+// and rejects writes without failing lookups on the other peers. Prints one line
+// per check, exits 1 if any failed.
+
+#include "lrucache-stats-segment.h"
+#include "partitioned-cache.h"
+#include "singleton.hpp"
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+using Key = int;
+using Value = sentinel::CacheValue<>;
+using Partitioned = LRUC::PartitionedCache<Key, Value, tbb::tbb_hash_compare<Key>, true>;
+using Client = LRUC::CacheClient<Key, Value>;
+
+// peer indices
+constexpr size_t Self = 0;
+constexpr size_t ServerA = 1;
+constexpr size_t ServerB = 2;
+constexpr size_t Dead = 3;
+
+int failures = 0;
+
+void check(bool ok, const char *what) {
+  std::printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  if (!ok)
+    failures++;
+}
+
+pid_t startServer(const char *binary, const std::string &path) {
+  pid_t pid = ::fork();
+  if (pid == 0) {
+    // 2 worker threads, no ring threads.
+    ::execl(binary, binary, path.c_str(), "65536", "4", "2", "0", nullptr);
+    std::perror("exec");
+    std::_Exit(127);
+  }
+  return pid;
+}
+
+bool waitForServer(const std::string &path) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  Client client;
+  while (!client.connect(path)) {
+    if (std::chrono::steady_clock::now() > deadline)
+      return false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return client.ping();
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::fprintf(stderr, "usage: %s <cache-server binary> [keys]\n", argv[0]);
+    return 1;
+  }
+  const char *binary = argv[1];
+  Key keys = argc > 2 ? std::atoi(argv[2]) : 40000;
+
+  char dir[] = "/tmp/partition-demo.XXXXXX";
+  if (::mkdtemp(dir) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  std::vector<std::string> paths = {
+      std::string(dir) + "/self.sock", std::string(dir) + "/a.sock",
+      std::string(dir) + "/b.sock", std::string(dir) + "/dead.sock"};
+
+  pid_t servers[] = {startServer(binary, paths[ServerA]),
+                     startServer(binary, paths[ServerB])};
+  bool up = waitForServer(paths[ServerA]) && waitForServer(paths[ServerB]);
+  check(up, "both cache-server peers are up");
+
+  sentinel::SoftIpCache local(65536, 4);
+  // no near-cache, every remote lookup goes to its owner.
+  Partitioned cache(local, paths, Self, 0);
+
+  // routing: writes reach the owner, and only the owner.
+  std::vector<size_t> owned(paths.size());
+  size_t rejected = 0;
+  for (Key key = 0; key < keys; key++) {
+    size_t owner = cache.owner(key);
+    owned[owner]++;
+    bool inserted = cache.insert(key, Value(key));
+    if (owner == Dead)
+      rejected += !inserted;
+    else if (!inserted)
+      std::printf("     insert of %d failed on peer %zu\n", key, owner);
+  }
+  check(owned[Self] > 0 && owned[ServerA] > 0 && owned[ServerB] > 0 && owned[Dead] > 0,
+        "keys spread over all four peers");
+  check(rejected == owned[Dead], "writes to the unreachable peer rejected");
+
+  Client a, b;
+  a.connect(paths[ServerA]);
+  b.connect(paths[ServerB]);
+  size_t misplaced = 0;
+  for (Key key = 0; key < keys; key++) {
+    size_t owner = cache.owner(key);
+    Value value;
+    Partitioned::LocalCache::ConstAccessor accessor;
+    misplaced += local.find(accessor, key) != (owner == Self);
+    misplaced += a.find(key, value) != (owner == ServerA);
+    misplaced += b.find(key, value) != (owner == ServerB);
+  }
+  check(misplaced == 0, "every key stored on its owner only");
+
+  // batching: one findMany() over all peers, more keys per peer than MaxMultiGet.
+  std::vector<Key> all(keys);
+  for (Key key = 0; key < keys; key++)
+    all[key] = key;
+  std::vector<Value> values(keys);
+  std::unique_ptr<bool[]> found(new bool[keys]);
+  size_t hits = cache.findMany(all.data(), all.size(), values.data(), found.get());
+  size_t wrong = 0;
+  for (Key key = 0; key < keys; key++) {
+    bool expected = cache.owner(key) != Dead;
+    wrong += found[key] != expected ||
+             (found[key] && values[key].expiryTs != key);
+  }
+  check(owned[ServerA] > LRUC::MaxMultiGet && owned[ServerB] > LRUC::MaxMultiGet,
+        "remote peers need several MultiGets each");
+  check(hits == keys - owned[Dead] && wrong == 0,
+        "findMany() returned every reachable key with its value");
+
+  // a peer going away: its keys read as misses, the others still answer.
+  ::kill(servers[0], SIGKILL);
+  ::waitpid(servers[0], nullptr, 0);
+  // left behind by the kill.
+  ::shm_unlink(LRUC::statsSegmentName(servers[0]).c_str());
+  hits = cache.findMany(all.data(), all.size(), values.data(), found.get());
+  wrong = 0;
+  for (Key key = 0; key < keys; key++) {
+    size_t owner = cache.owner(key);
+    wrong += found[key] != (owner == Self || owner == ServerB);
+  }
+  check(hits == owned[Self] + owned[ServerB] && wrong == 0,
+        "killed peer reads as misses, the others still hit");
+
+  Key remoteA = 0;
+  while (cache.owner(remoteA) != ServerA)
+    remoteA++;
+  Value value;
+  check(!cache.find(remoteA, value) && !cache.insert(remoteA, Value(1)) &&
+            cache.erase(remoteA) == 0,
+        "killed peer rejects single-key operations");
+
+  ::kill(servers[1], SIGTERM);
+  ::waitpid(servers[1], nullptr, 0);
+  for (const auto &path : paths) {
+    ::unlink(path.c_str());
+    ::unlink((path + ".ring").c_str());
+  }
+  ::rmdir(dir);
+
+  std::printf("%s\n", failures == 0 ? "all checks passed" : "checks failed");
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,335 @@
+/**
+ * @author shchang
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "cache-client.h"
+#include "scale-lrucache.h"
+
+namespace LRUC {
+
+/**
+ * Jump consistent hash (Lamping, Veach): map key to one of buckets buckets. Growing
+ * buckets from n to n+1 moves only 1/(n+1) of the keys.
+ */
+inline int32_t jumpConsistentHash(uint64_t key, int32_t buckets) {
+  int64_t b = -1;
+  int64_t j = 0;
+  while (j < buckets) {
+    b = j;
+    key = key * 2862933555777941757ULL + 1;
+    j = static_cast<int64_t>((b + 1) * (static_cast<double>(1LL << 31) / static_cast<double>((key >> 33) + 1)));
+  }
+  return static_cast<int32_t>(b);
+}
+
+/**
+ * PartitionedCache spreads keys over peer processes, so the aggregate capacity grows
+ * with the number of peers instead of every process caching the same hot set.
+ *
+ * Every peer runs a ScalableLRUCache served by cache-server (see cache-protocol.h), and
+ * all peers are configured with the same peer list. A key is owned by the peer chosen
+ * by jump consistent hashing. Keys owned by this process are served by local directly,
+ * others through the owner's socket. Remote lookups of findMany() are grouped per peer
+ * and pipelined as MultiGet requests, at most MultiGetWindow in flight per peer.
+ *
+ * Remote hits are kept in a small near-cache for nearTtl. Writes through this object
+ * drop the near-cache copy, writes by other peers are seen once the copy expires, is
+ * evicted or invalidated, e.g. by subscribing nearCache() to the invalidation bus.
+ *
+ * An unreachable peer reads as a miss and rejects writes.
+ * Thread-safe, connections are pooled per peer.
+ */
+template <class TKey, class TValue, class THash = tbb::tbb_hash_compare<TKey>, bool KeyIndex = false>
+class PartitionedCache final {
+ public:
+  using LocalCache = ScalableLRUCache<TKey, TValue, THash, KeyIndex>;
+
+  /**
+   * Near-cache copy of a remote value, served until expires_.
+   */
+  struct NearEntry {
+    TValue value_;
+    std::chrono::steady_clock::time_point expires_;
+  };
+  using NearCache = ScalableLRUCache<TKey, NearEntry, THash>;
+
+  /**
+   * MultiGet requests in flight per peer. Bounds the replies a peer has to buffer,
+   * cache-server stops reading from a client whose output backs up.
+   */
+  static constexpr size_t MultiGetWindow = 8;
+
+ private:
+  using Client = CacheClient<TKey, TValue>;
+
+  struct Peer {
+    std::string path_;
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Client>> idle_;
+  };
+
+ private:
+  LocalCache& local_;
+  std::vector<std::unique_ptr<Peer>> peers_;
+  size_t self_;
+  std::unique_ptr<NearCache> near_;
+  std::chrono::steady_clock::duration nearTtl_;
+
+ private:
+  /**
+   * Take a connected client of peer, nullptr if the peer is unreachable.
+   */
+  std::unique_ptr<Client> borrow(Peer& peer) {
+    {
+      std::lock_guard<std::mutex> lock(peer.mutex_);
+      if (!peer.idle_.empty()) {
+        std::unique_ptr<Client> client = std::move(peer.idle_.back());
+        peer.idle_.pop_back();
+        return client;
+      }
+    }
+
+    std::unique_ptr<Client> client(new Client());
+    return client->connect(peer.path_) ? std::move(client) : nullptr;
+  }
+
+  void giveBack(Peer& peer, std::unique_ptr<Client> client) {
+    if (client != nullptr && client->connected()) {
+      std::lock_guard<std::mutex> lock(peer.mutex_);
+      peer.idle_.push_back(std::move(client));
+    }
+  }
+
+  void forgetNear(const TKey& key) {
+    if (near_ != nullptr) {
+      near_->erase(key);
+    }
+  }
+
+  /**
+   * Queue MultiGet number chunk of the keys pending for a peer.
+   */
+  static void queueChunk(Client& client, const TKey* keys, const std::vector<size_t>& pending, size_t chunk) {
+    size_t begin = chunk * MaxMultiGet;
+    size_t end = std::min(pending.size(), begin + MaxMultiGet);
+    std::vector<TKey> batch;
+    batch.reserve(end - begin);
+    for (size_t k = begin; k < end; k++) {
+      batch.push_back(keys[pending[k]]);
+    }
+    client.queueFindMany(batch.data(), batch.size());
+  }
+
+  /**
+   * Send a write to the owner of key, return the reply count, 0 on error.
+   */
+  template <class Request>
+  size_t remote(const TKey& key, Request&& request) {
+    Peer& peer = *peers_[owner(key)];
+    std::unique_ptr<Client> client = borrow(peer);
+    if (client == nullptr) {
+      return 0;
+    }
+    size_t count = request(*client);
+    giveBack(peer, std::move(client));
+    return count;
+  }
+
+ public:
+  /**
+   * local: partition of this process, served to peers by cache-server.
+   * peers: socket path of every peer's cache-server, in the same order on every peer.
+   * self: index of this process in peers.
+   * nearCapacity: near-cache size for remote hits, 0 disables it.
+   * nearTtl: how long a remote hit is served from the near-cache.
+   */
+  PartitionedCache(LocalCache& local, const std::vector<std::string>& peers, size_t self, size_t nearCapacity = 4096,
+                   std::chrono::milliseconds nearTtl = std::chrono::seconds(1))
+    : local_(local), self_(self), nearTtl_(nearTtl) {
+    for (const auto& path : peers) {
+      peers_.emplace_back(new Peer());
+      peers_.back()->path_ = path;
+    }
+    if (nearCapacity > 0) {
+      near_.reset(new NearCache(nearCapacity, std::min<size_t>(nearCapacity, 16)));
+    }
+  }
+
+  PartitionedCache(const PartitionedCache&) = delete;
+  PartitionedCache& operator=(const PartitionedCache&) = delete;
+
+  /**
+   * Index of the peer owning key.
+   */
+  size_t owner(const TKey& key) const {
+    THash hashObj{};
+    // spread identity hashes before jumping.
+    uint64_t hash = static_cast<uint64_t>(hashObj.hash(key)) * 0x9E3779B97F4A7C15ULL;
+    return static_cast<size_t>(jumpConsistentHash(hash, static_cast<int32_t>(peers_.size())));
+  }
+
+  bool isLocal(const TKey& key) const {
+    return owner(key) == self_;
+  }
+
+  /**
+   * Copy the value of key into value. Return true if key exists.
+   */
+  bool find(const TKey& key, TValue& value) {
+    bool found = false;
+    findMany(&key, 1, &value, &found);
+    return found;
+  }
+
+  /**
+   * Look up count keys, found[i] tells whether values[i] was filled.
+   * Returns number of keys found.
+   */
+  size_t findMany(const TKey* keys, size_t count, TValue* values, bool* found) {
+    size_t hits = 0;
+    // remote misses of the near-cache, per peer
+    std::vector<std::vector<size_t>> pending(peers_.size());
+    auto now = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < count; i++) {
+      found[i] = false;
+      size_t peer = owner(keys[i]);
+
+      if (peer == self_) {
+        typename LocalCache::ConstAccessor caccessor;
+        found[i] = local_.find(caccessor, keys[i]);
+        if (found[i]) {
+          values[i] = *caccessor;
+        }
+      } else if (near_ != nullptr) {
+        typename NearCache::ConstAccessor caccessor;
+        found[i] = near_->find(caccessor, keys[i]) && caccessor->expires_ > now;
+        if (found[i]) {
+          values[i] = caccessor->value_;
+        }
+      }
+
+      if (found[i]) {
+        hits++;
+      } else if (peer != self_) {
+        pending[peer].push_back(i);
+      }
+    }
+
+    // open a window on every peer first so peers work in parallel, then send the
+    // next MultiGet of a peer whenever one of its replies came back.
+    std::vector<std::unique_ptr<Client>> clients(peers_.size());
+    std::vector<size_t> chunks(peers_.size());
+    std::vector<size_t> sent(peers_.size());
+    std::vector<size_t> received(peers_.size());
+    for (size_t p = 0; p < peers_.size(); p++) {
+      if (pending[p].empty() || (clients[p] = borrow(*peers_[p])) == nullptr) {
+        continue;
+      }
+
+      chunks[p] = (pending[p].size() + MaxMultiGet - 1) / MaxMultiGet;
+      for (; sent[p] < std::min(chunks[p], MultiGetWindow); sent[p]++) {
+        queueChunk(*clients[p], keys, pending[p], sent[p]);
+      }
+      if (!clients[p]->flush()) {
+        clients[p].reset();
+      }
+    }
+
+    auto expires = now + nearTtl_;
+    bool busy = true;
+    while (busy) {
+      busy = false;
+      for (size_t p = 0; p < peers_.size(); p++) {
+        if (clients[p] == nullptr) {
+          continue;
+        }
+
+        typename Client::Reply reply;
+        size_t begin = received[p] * MaxMultiGet;
+        size_t n = std::min(pending[p].size() - begin, MaxMultiGet);
+        if (!clients[p]->receive(reply) || reply.length_ != n * (1 + sizeof(TValue))) {
+          clients[p].reset();
+          continue;
+        }
+
+        for (size_t k = 0; k < n; k++) {
+          if (reply.body_[k] == 0) {
+            continue;
+          }
+          size_t i = pending[p][begin + k];
+          std::memcpy(&values[i], reply.body_ + n + k * sizeof(TValue), sizeof(TValue));
+          found[i] = true;
+          hits++;
+          if (near_ != nullptr) {
+            near_->insertOrAssign(keys[i], NearEntry{values[i], expires});
+          }
+        }
+
+        if (++received[p] == chunks[p]) {
+          giveBack(*peers_[p], std::move(clients[p]));
+          continue;
+        }
+        if (sent[p] < chunks[p]) {
+          queueChunk(*clients[p], keys, pending[p], sent[p]++);
+          if (!clients[p]->flush()) {
+            clients[p].reset();
+            continue;
+          }
+        }
+        busy = true;
+      }
+    }
+
+    return hits;
+  }
+
+  /**
+   * Insert key/value into its owner. Return true if key was inserted.
+   */
+  bool insert(const TKey& key, const TValue& value, typename LocalCache::Tag tag = 0) {
+    if (isLocal(key)) {
+      return local_.insert(key, value, tag);
+    }
+    return remote(key, [&](Client& client) { return client.insert(key, value, tag) ? 1 : 0; }) == 1;
+  }
+
+  bool insertOrAssign(const TKey& key, const TValue& value, typename LocalCache::Tag tag = 0) {
+    if (isLocal(key)) {
+      return local_.insertOrAssign(key, value, tag);
+    }
+    forgetNear(key);
+    return remote(key, [&](Client& client) { return client.insertOrAssign(key, value, tag) ? 1 : 0; }) == 1;
+  }
+
+  size_t erase(const TKey& key) {
+    if (isLocal(key)) {
+      return local_.erase(key);
+    }
+    forgetNear(key);
+    return remote(key, [&](Client& client) { return client.erase(key); });
+  }
+
+  size_t peerCount() const {
+    return peers_.size();
+  }
+
+  /**
+   * Near-cache of remote hits, nullptr if disabled.
+   */
+  NearCache* nearCache() {
+    return near_.get();
+  }
+};
+}  // namespace LRUC
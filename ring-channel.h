@@ -0,0 +1,680 @@
+/**
+ * @author shchang
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "cache-handover.h"
+
+namespace LRUC {
+
+/**
+ * Futex helpers on words living in shared memory, hence without FUTEX_PRIVATE_FLAG.
+ */
+struct Futex final {
+  static void wait(std::atomic<uint32_t>& word, uint32_t expected, int timeoutMs) {
+    timespec timeout{timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, &timeout, nullptr, 0);
+  }
+
+  static void wake(std::atomic<uint32_t>& word) {
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+  }
+
+  /**
+   * Spin iterations worth trying before sleeping, none on a single CPU where the
+   * peer can't make progress while we spin.
+   */
+  static int spinBudget(int spins) {
+    static const bool multiCore = std::thread::hardware_concurrency() > 1;
+    return multiCore ? spins : 0;
+  }
+
+  static void pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    std::this_thread::yield();
+#endif
+  }
+};
+
+/**
+ * Shared memory lookup channel between one client process and a RingService thread.
+ *
+ * Every service thread owns an arena segment holding ChannelCount channels. A channel
+ * is a pair of single-producer/single-consumer rings: the client produces Request
+ * slots of up to Batch keys, the service thread answers each with a Response slot.
+ *
+ * Waiting: both sides spin briefly, then sleep on a futex. A sleeping service thread
+ * is woken through the arena doorbell, a sleeping client through the tail of its
+ * response ring. The waiter raises a flag before re-checking and sleeping, the
+ * producer publishes before checking the flag, so no wake-up is lost.
+ *
+ * Clients map the whole arena of their service thread, the channel is meant for
+ * trusted processes of the same host.
+ */
+template <class TKey, class TValue>
+struct RingArena final {
+  static_assert(std::is_trivially_copyable<TKey>::value && std::is_trivially_copyable<TValue>::value,
+                "RingArena requires trivially copyable key and value");
+
+  static constexpr uint64_t Magic = 0x31474e524355524cULL;  // "LRUCRNG1" little-endian
+  static constexpr uint32_t Batch = 32;
+  // slots per ring, a power of 2
+  static constexpr uint32_t Depth = 32;
+
+  struct Request {
+    uint32_t id_;
+    uint32_t count_;
+    TKey keys_[Batch];
+  };
+
+  struct Response {
+    uint32_t id_;
+    uint32_t count_;
+    bool found_[Batch];
+    TValue values_[Batch];
+  };
+
+  template <class Slot>
+  struct Ring {
+    // next slot to consume, written by the consumer only
+    alignas(64) std::atomic<uint32_t> head_;
+    // next slot to produce, written by the producer only. Futex word of a sleeping consumer.
+    alignas(64) std::atomic<uint32_t> tail_;
+    std::atomic<uint32_t> waiting_;
+    alignas(64) Slot slots_[Depth];
+
+    void reset() {
+      head_.store(0, std::memory_order_relaxed);
+      tail_.store(0, std::memory_order_relaxed);
+      waiting_.store(0, std::memory_order_relaxed);
+    }
+
+    /**
+     * Producer: slot to fill, nullptr if the ring is full.
+     */
+    Slot* reserve() {
+      uint32_t tail = tail_.load(std::memory_order_relaxed);
+      if (tail - head_.load(std::memory_order_acquire) == Depth) {
+        return nullptr;
+      }
+      return &slots_[tail & (Depth - 1)];
+    }
+
+    void publish() {
+      tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+    }
+
+    /**
+     * Consumer: oldest unconsumed slot, nullptr if the ring is empty.
+     */
+    Slot* peek() {
+      uint32_t head = head_.load(std::memory_order_relaxed);
+      if (head == tail_.load(std::memory_order_acquire)) {
+        return nullptr;
+      }
+      return &slots_[head & (Depth - 1)];
+    }
+
+    void pop() {
+      head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+  };
+
+  enum ChannelState : uint32_t { Free = 0, Active, Closing };
+
+  struct alignas(64) Channel {
+    std::atomic<uint32_t> state_;
+    Ring<Request> requests_;
+    Ring<Response> responses_;
+  };
+
+  struct Header {
+    uint64_t magic_;
+    uint32_t keySize_;
+    uint32_t valueSize_;
+    uint32_t channelCount_;
+    uint32_t batch_;
+    uint32_t depth_;
+    // bumped by clients to wake the sleeping service thread
+    alignas(64) std::atomic<uint32_t> doorbell_;
+    std::atomic<uint32_t> sleeping_;
+  };
+
+  static size_t channelOffset() {
+    return (sizeof(Header) + alignof(Channel) - 1) & ~(alignof(Channel) - 1);
+  }
+
+  static size_t segmentSize(uint32_t channelCount) {
+    return channelOffset() + channelCount * sizeof(Channel);
+  }
+
+  static Header* header(void* base) {
+    return static_cast<Header*>(base);
+  }
+
+  static Channel* channels(void* base) {
+    return reinterpret_cast<Channel*>(static_cast<char*>(base) + channelOffset());
+  }
+
+  static bool valid(void* base, size_t size) {
+    Header* h = header(base);
+    return size >= sizeof(Header) && h->magic_ == Magic && h->keySize_ == sizeof(TKey) &&
+           h->valueSize_ == sizeof(TValue) && h->batch_ == Batch && h->depth_ == Depth &&
+           size == segmentSize(h->channelCount_);
+  }
+};
+
+/**
+ * RingClient looks keys up through a channel of a RingService.
+ * Not thread-safe, use one client per thread.
+ */
+template <class TKey, class TValue>
+class RingClient final {
+  using Arena = RingArena<TKey, TValue>;
+  using Request = typename Arena::Request;
+  using Response = typename Arena::Response;
+
+  // spins on an empty response ring before sleeping
+  static constexpr int SpinCount = 4000;
+  static constexpr int WaitMs = 10;
+
+ private:
+  int sock_;
+  void* base_;
+  size_t size_;
+  typename Arena::Channel* channel_;
+  uint32_t nextId_;
+
+ private:
+  void ring() {
+    typename Arena::Header* header = Arena::header(base_);
+    // publish() was seq_cst, the service thread raised sleeping_ before its last check.
+    if (header->sleeping_.load(std::memory_order_seq_cst) != 0) {
+      header->doorbell_.fetch_add(1, std::memory_order_seq_cst);
+      Futex::wake(header->doorbell_);
+    }
+  }
+
+  /**
+   * Wait for the next response. Return nullptr if the service went away.
+   */
+  Response* awaitResponse() {
+    auto& responses = channel_->responses_;
+    for (int i = 0, spins = Futex::spinBudget(SpinCount); i < spins; i++) {
+      if (Response* response = responses.peek()) {
+        return response;
+      }
+      Futex::pause();
+    }
+
+    while (true) {
+      uint32_t tail = responses.tail_.load(std::memory_order_seq_cst);
+      responses.waiting_.store(1, std::memory_order_seq_cst);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (Response* response = responses.peek()) {
+        responses.waiting_.store(0, std::memory_order_relaxed);
+        return response;
+      }
+      Futex::wait(responses.tail_, tail, WaitMs);
+      responses.waiting_.store(0, std::memory_order_relaxed);
+
+      if (Response* response = responses.peek()) {
+        return response;
+      }
+      // still nothing, check whether the service closed our registration.
+      pollfd pfd{sock_, POLLIN, 0};
+      if (::poll(&pfd, 1, 0) != 0) {
+        return nullptr;
+      }
+    }
+  }
+
+ public:
+  RingClient() : sock_(-1), base_(nullptr), size_(0), channel_(nullptr), nextId_(0) {}
+
+  ~RingClient() {
+    close();
+  }
+
+  RingClient(const RingClient&) = delete;
+  RingClient& operator=(const RingClient&) = delete;
+
+  /**
+   * Register with the RingService listening on path and map the assigned channel.
+   */
+  bool connect(const std::string& path, int timeoutMs = 1000) {
+    close();
+
+    sock_ = Handover::connect(path, timeoutMs);
+    if (sock_ < 0) {
+      return false;
+    }
+
+    int fd = Handover::receiveFd(sock_, timeoutMs);
+    uint32_t index = 0;
+    bool ok = fd >= 0 && Handover::waitFor(sock_, POLLIN, timeoutMs) &&
+              ::recv(sock_, &index, sizeof(index), MSG_WAITALL) == sizeof(index);
+
+    struct stat st;
+    if (ok && ::fstat(fd, &st) == 0) {
+      size_ = static_cast<size_t>(st.st_size);
+      void* addr = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      base_ = addr != MAP_FAILED ? addr : nullptr;
+    }
+    if (fd >= 0) {
+      ::close(fd);
+    }
+
+    if (base_ == nullptr || !Arena::valid(base_, size_) || index >= Arena::header(base_)->channelCount_) {
+      close();
+      return false;
+    }
+    channel_ = &Arena::channels(base_)[index];
+    return true;
+  }
+
+  void close() {
+    if (base_ != nullptr) {
+      ::munmap(base_, size_);
+      base_ = nullptr;
+    }
+    if (sock_ >= 0) {
+      ::close(sock_);
+      sock_ = -1;
+    }
+    channel_ = nullptr;
+  }
+
+  bool connected() const {
+    return channel_ != nullptr;
+  }
+
+  /**
+   * Look up count keys, found[i] tells whether values[i] was filled. Keys are sent in
+   * batches of Arena::Batch, up to Arena::Depth batches in flight.
+   * Return number of keys found, 0 on error.
+   */
+  size_t findMany(const TKey* keys, size_t count, TValue* values, bool* found) {
+    if (channel_ == nullptr) {
+      return 0;
+    }
+
+    auto& requests = channel_->requests_;
+    auto& responses = channel_->responses_;
+    size_t sent = 0;
+    size_t received = 0;
+    size_t hits = 0;
+
+    while (received < count) {
+      bool published = false;
+      while (sent < count) {
+        Request* request = requests.reserve();
+        if (request == nullptr) {
+          break;
+        }
+        uint32_t n = static_cast<uint32_t>(std::min<size_t>(Arena::Batch, count - sent));
+        request->id_ = nextId_++;
+        request->count_ = n;
+        std::memcpy(request->keys_, keys + sent, n * sizeof(TKey));
+        requests.publish();
+        sent += n;
+        published = true;
+      }
+      if (published) {
+        ring();
+      }
+
+      Response* response = awaitResponse();
+      if (response == nullptr) {
+        close();
+        return 0;
+      }
+      for (uint32_t i = 0; i < response->count_; i++) {
+        found[received + i] = response->found_[i];
+        if (response->found_[i]) {
+          std::memcpy(&values[received + i], &response->values_[i], sizeof(TValue));
+          hits++;
+        }
+      }
+      received += response->count_;
+      responses.pop();
+    }
+    return hits;
+  }
+
+  /**
+   * Copy the value of key into value. Return true if key exists.
+   */
+  bool find(const TKey& key, TValue& value) {
+    bool found = false;
+    return findMany(&key, 1, &value, &found) == 1;
+  }
+};
+
+/**
+ * RingService serves lookups of cache through shared memory rings, see RingArena.
+ * Clients register on a Unix socket at path. The registration socket stays open for
+ * the client's lifetime, its channel is recycled once it is closed.
+ *
+ * Type concepts:
+ *  TCache provides findMany(keys, count, values, found), e.g. ScalableLRUCache.
+ */
+template <class TKey, class TValue, class TCache>
+class RingService final {
+  using Arena = RingArena<TKey, TValue>;
+  using Channel = typename Arena::Channel;
+
+  static constexpr int SpinRounds = 2000;
+  static constexpr int WaitMs = 100;
+
+  struct Worker {
+    int fd_ = -1;
+    void* base_ = nullptr;
+    size_t size_ = 0;
+    std::thread thread_;
+  };
+
+  struct Registration {
+    size_t worker_;
+    uint32_t channel_;
+  };
+
+ private:
+  TCache& cache_;
+  size_t threadCount_;
+  uint32_t channelsPerThread_;
+  std::string path_;
+  int listener_;
+  std::atomic<bool> running_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::thread acceptor_;
+
+ private:
+  /**
+   * Answer pending requests of channel. Return true if any was answered.
+   */
+  bool serve(Channel& channel) {
+    auto& requests = channel.requests_;
+    auto& responses = channel.responses_;
+    bool served = false;
+
+    while (typename Arena::Request* request = requests.peek()) {
+      typename Arena::Response* response = responses.reserve();
+      if (response == nullptr) {
+        // client isn't consuming, retry later.
+        break;
+      }
+      uint32_t count = std::min(request->count_, Arena::Batch);
+      response->id_ = request->id_;
+      response->count_ = count;
+      cache_.findMany(request->keys_, count, response->values_, response->found_);
+      responses.publish();
+      requests.pop();
+      served = true;
+    }
+
+    if (served && responses.waiting_.load(std::memory_order_seq_cst) != 0) {
+      Futex::wake(responses.tail_);
+    }
+    return served;
+  }
+
+  bool pending(Channel* channels, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+      if (channels[i].state_.load(std::memory_order_acquire) == Arena::Closing ||
+          (channels[i].state_.load(std::memory_order_acquire) == Arena::Active && channels[i].requests_.peek())) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void work(Worker& worker) {
+    typename Arena::Header* header = Arena::header(worker.base_);
+    Channel* channels = Arena::channels(worker.base_);
+    int idle = 0;
+    int spins = Futex::spinBudget(SpinRounds);
+
+    while (running_.load(std::memory_order_relaxed)) {
+      bool served = false;
+      for (uint32_t i = 0; i < channelsPerThread_; i++) {
+        uint32_t state = channels[i].state_.load(std::memory_order_acquire);
+        if (state == Arena::Closing) {
+          // hand the channel back to the acceptor.
+          channels[i].state_.store(Arena::Free, std::memory_order_release);
+        } else if (state == Arena::Active) {
+          served = serve(channels[i]) || served;
+        }
+      }
+
+      if (served) {
+        idle = 0;
+      } else if (++idle < spins) {
+        Futex::pause();
+      } else {
+        uint32_t doorbell = header->doorbell_.load(std::memory_order_seq_cst);
+        header->sleeping_.store(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!pending(channels, channelsPerThread_)) {
+          Futex::wait(header->doorbell_, doorbell, WaitMs);
+        }
+        header->sleeping_.store(0, std::memory_order_relaxed);
+        idle = 0;
+      }
+    }
+  }
+
+  /**
+   * Mark the channel of a departed client closing and wake its worker to free it.
+   */
+  void release(const Registration& registration) {
+    Worker& worker = *workers_[registration.worker_];
+    Arena::channels(worker.base_)[registration.channel_].state_.store(Arena::Closing, std::memory_order_release);
+
+    typename Arena::Header* header = Arena::header(worker.base_);
+    header->doorbell_.fetch_add(1, std::memory_order_seq_cst);
+    Futex::wake(header->doorbell_);
+  }
+
+  /**
+   * Find a free channel, spreading clients over workers. Channels of departed clients
+   * are waited for briefly. Return false if all are taken.
+   */
+  bool reserve(size_t hint, Registration& registration) {
+    for (int attempt = 0; attempt < 100; attempt++) {
+      bool closing = false;
+      for (size_t k = 0; k < workers_.size(); k++) {
+        size_t w = (hint + k) % workers_.size();
+        Channel* channels = Arena::channels(workers_[w]->base_);
+        for (uint32_t i = 0; i < channelsPerThread_; i++) {
+          uint32_t state = channels[i].state_.load(std::memory_order_acquire);
+          if (state == Arena::Free) {
+            registration = Registration{w, i};
+            return true;
+          }
+          closing = closing || state == Arena::Closing;
+        }
+      }
+      if (!closing) {
+        return false;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+  }
+
+  /**
+   * Assign a free channel to a new client and send it over sock.
+   */
+  bool assign(int sock, Registration& registration) {
+    if (!reserve(static_cast<size_t>(sock), registration)) {
+      return false;
+    }
+
+    Channel& channel = Arena::channels(workers_[registration.worker_]->base_)[registration.channel_];
+    channel.requests_.reset();
+    channel.responses_.reset();
+    channel.state_.store(Arena::Active, std::memory_order_release);
+
+    uint32_t index = registration.channel_;
+    if (!Handover::sendFd(sock, workers_[registration.worker_]->fd_) ||
+        ::send(sock, &index, sizeof(index), MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(index))) {
+      release(registration);
+      return false;
+    }
+    return true;
+  }
+
+  void accept() {
+    std::unordered_map<int, Registration> registrations;
+    std::vector<pollfd> fds;
+
+    while (running_.load(std::memory_order_relaxed)) {
+      fds.clear();
+      fds.push_back(pollfd{listener_, POLLIN, 0});
+      for (auto& entry : registrations) {
+        fds.push_back(pollfd{entry.first, POLLIN, 0});
+      }
+
+      if (::poll(fds.data(), fds.size(), WaitMs) <= 0) {
+        continue;
+      }
+
+      for (size_t i = 1; i < fds.size(); i++) {
+        if (fds[i].revents == 0) {
+          continue;
+        }
+        // clients never write, readable means closed.
+        release(registrations[fds[i].fd]);
+        registrations.erase(fds[i].fd);
+        ::close(fds[i].fd);
+      }
+
+      if (fds[0].revents & POLLIN) {
+        int sock = Handover::accept(listener_, 0);
+        Registration registration;
+        if (sock >= 0 && assign(sock, registration)) {
+          registrations.emplace(sock, registration);
+        } else if (sock >= 0) {
+          ::close(sock);
+        }
+      }
+    }
+
+    for (auto& entry : registrations) {
+      ::close(entry.first);
+    }
+  }
+
+ public:
+  /**
+   * threadCount: service threads, each with its own arena.
+   * channelsPerThread: clients one service thread can serve.
+   */
+  RingService(TCache& cache, size_t threadCount = 1, uint32_t channelsPerThread = 64)
+    : cache_(cache),
+      threadCount_(threadCount > 0 ? threadCount : 1),
+      channelsPerThread_(channelsPerThread > 0 ? channelsPerThread : 1),
+      listener_(-1),
+      running_(false) {}
+
+  ~RingService() {
+    stop();
+  }
+
+  RingService(const RingService&) = delete;
+  RingService& operator=(const RingService&) = delete;
+
+  /**
+   * Create the arenas and start accepting clients on path.
+   */
+  bool start(const std::string& path) {
+    if (running_.load()) {
+      return false;
+    }
+
+    size_t size = Arena::segmentSize(channelsPerThread_);
+    for (size_t i = 0; i < threadCount_; i++) {
+      auto worker = std::make_unique<Worker>();
+      worker->fd_ = ::memfd_create("lruc-ring", MFD_CLOEXEC);
+      if (worker->fd_ < 0 || ::ftruncate(worker->fd_, static_cast<off_t>(size)) != 0) {
+        return false;
+      }
+      void* addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, worker->fd_, 0);
+      if (addr == MAP_FAILED) {
+        return false;
+      }
+      worker->base_ = addr;
+      worker->size_ = size;
+
+      typename Arena::Header* header = Arena::header(addr);
+      header->magic_ = Arena::Magic;
+      header->keySize_ = sizeof(TKey);
+      header->valueSize_ = sizeof(TValue);
+      header->channelCount_ = channelsPerThread_;
+      header->batch_ = Arena::Batch;
+      header->depth_ = Arena::Depth;
+      workers_.push_back(std::move(worker));
+    }
+
+    listener_ = Handover::listen(path);
+    if (listener_ < 0) {
+      return false;
+    }
+    path_ = path;
+
+    running_.store(true);
+    for (auto& worker : workers_) {
+      Worker* w = worker.get();
+      w->thread_ = std::thread([this, w] { work(*w); });
+    }
+    acceptor_ = std::thread([this] { accept(); });
+    return true;
+  }
+
+  void stop() {
+    if (running_.exchange(false)) {
+      acceptor_.join();
+      for (auto& worker : workers_) {
+        worker->thread_.join();
+      }
+      ::close(listener_);
+      ::unlink(path_.c_str());
+      listener_ = -1;
+    }
+
+    for (auto& worker : workers_) {
+      if (worker->base_ != nullptr) {
+        ::munmap(worker->base_, worker->size_);
+      }
+      if (worker->fd_ >= 0) {
+        ::close(worker->fd_);
+      }
+    }
+    workers_.clear();
+  }
+};
+}  // namespace LRUC
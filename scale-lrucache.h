@@ -3,42 +3,233 @@
  */
 
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <limits>
 #include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
 
 #include "lrucache.h"
+#include "lrucache-flight-recorder.h"
+#include "lrucache-journal.h"
+#include "lrucache-latency.h"
+#include "lrucache-snapshot.h"
+#include "lrucache-stats-segment.h"
 
 namespace LRUC {
 
-template <class TKey, class TValue, class THash = tbb::tbb_hash_compare<TKey>>
+/**
+ * ScalableLRUCache shards keys over multiple LRUCache instances.
+ *
+ * With KeyIndex set, each shard keeps an ordered key index, which enables
+ * eraseRange() and, for integral keys, erasePrefix().
+ *
+ * Cursor, forEach() and eraseIf() scan concurrently with other operations, with
+ * the same weak consistency as LRUCache::Cursor.
+ *
+ * With a Journal attached, every successful mutation is logged to it, so that
+ * recover() can rebuild the cache from the latest snapshot plus the log.
+ *
+ * With the change feed enabled, every shard publishes its mutations to a ChangeRing,
+ * which followers such as CacheFollower tail with bounded lag.
+ *
+ * With latency histograms enabled, find(), insert(), insertOrAssign() and erase()
+ * time a sample of calls, see LatencyRecorder.
+ *
+ * With stats exported, statistics are republished to a StatsSegment once per interval,
+ * by the owner or inline by the same calls, which cachectl reads from outside the process.
+ *
+ * With the flight recorder enabled, the same calls are recorded to the calling
+ * thread's FlightRecorder ring.
+ */
+template <class TKey, class TValue, class THash = tbb::tbb_hash_compare<TKey>, bool KeyIndex = false>
 class ScalableLRUCache {
  private:
-  using Shard = LRUCache<TKey, TValue, THash>;
-  using ShardPtr = std::unique_ptr<Shard>;
+  using Shard = LRUCache<TKey, TValue, THash, KeyIndex>;
 
-  std::vector<ShardPtr> shards_;
-  // ScalableLRUCache size.
-  size_t cache_size_;
+  // built on first touch, nullptr until then, see shardAt().
+  std::unique_ptr<std::atomic<Shard*>[]> shards_;
+  // ScalableLRUCache size, see setCapacity().
+  std::atomic<size_t> cache_size_;
   // shard count
   size_t shard_count_;
 
+ public:
+  using Key = TKey;
+  using Value = TValue;
+  using ConstAccessor = typename Shard::ConstAccessor;
+  using Tag = typename Shard::Tag;
+  using CacheJournal = Journal<TKey, TValue>;
+  using ChangeFeed = ChangeRing<TKey, TValue>;
+
  private:
+  // mutation log, null if not attached.
+  std::atomic<CacheJournal*> journal_;
+  // change ring per shard, empty if the change feed is disabled.
+  std::vector<std::unique_ptr<ChangeFeed>> changeRings_;
+  // skip freeing elements on destruction, see enableFastTeardown().
+  std::atomic<bool> fastTeardown_;
+  // applied to shards built later as well, see enableAdmissionThrottle().
+  std::atomic<bool> admissionThrottle_;
+  // sampled operation latencies, null if not enabled.
+  std::atomic<LatencyRecorder*> latency_;
+  std::unique_ptr<LatencyRecorder> latencyOwner_;
+  // shared memory statistics, null if not exported.
+  std::atomic<StatsSegment*> statsSegment_;
+  std::unique_ptr<StatsSegment> statsSegmentOwner_;
+  // statsSegment_ with StatsPublishing::Inline, null otherwise.
+  std::atomic<StatsSegment*> inlineStats_;
+  // record operations to FlightRecorder, see enableFlightRecorder().
+  std::atomic<bool> flightRecorder_;
+
+  /**
+   * Start of an operation recorded by the flight recorder, ticks_ 0 if not recorded.
+   */
+  struct FlightMark {
+    uint64_t ticks_;
+    uint32_t evictions_;
+  };
+
+ private:
+  /**
+   * shardIndex returns index of the Shard (LRUCache instance) owning key.
+   */
+  size_t shardIndex(const TKey& key) const;
+
   /**
    * shard returns a Shard (LRUCache instance) based on key.
    */
-  Shard& shard(const TKey& key);
+  Shard& shard(const TKey& key) {
+    return shardAt(shardIndex(key));
+  }
+
+  /**
+   * shardAt returns shard shard_idx, constructing it on first touch.
+   */
+  Shard& shardAt(size_t shard_idx) {
+    Shard* shard = shards_[shard_idx].load(std::memory_order_acquire);
+    return shard != nullptr ? *shard : constructShard(shard_idx);
+  }
+
+  /**
+   * builtShard returns shard shard_idx, nullptr if not constructed yet.
+   * A shard not constructed yet is empty, loops over shards skip it.
+   */
+  Shard* builtShard(size_t shard_idx) const {
+    return shards_[shard_idx].load(std::memory_order_acquire);
+  }
+
+  /**
+   * Build shard shard_idx and publish it with one CAS. A racing thread losing the
+   * CAS deletes its copy and takes the published one.
+   */
+  Shard& constructShard(size_t shard_idx);
+
+  /**
+   * Capacity of shard shard_idx, shard 0 takes the remainder.
+   */
+  size_t shardCapacity(size_t shard_idx, std::memory_order order = std::memory_order_relaxed) const {
+    size_t size = cache_size_.load(order);
+    return size / shard_count_ + (shard_idx == 0 ? size % shard_count_ : 0);
+  }
+
+  /**
+   * Start timing an operation, see LatencyRecorder::begin().
+   */
+  uint64_t latencyBegin() const {
+    LatencyRecorder* latency = latency_.load(std::memory_order_acquire);
+    return latency != nullptr ? latency->begin() : 0;
+  }
+
+  void latencyEnd(LatencyOp op, uint64_t start) {
+    if (start != 0) {
+      latency_.load(std::memory_order_relaxed)->end(op, start);
+    }
+  }
+
+  FlightMark flightBegin() const {
+    if (!flightRecorder_.load(std::memory_order_relaxed)) {
+      return FlightMark{0, 0};
+    }
+    return FlightMark{latencyTicks(), threadEvictions};
+  }
+
+  void flightEnd(FlightOp op, size_t shard_idx, const TKey& key, bool outcome, const FlightMark& mark) {
+    if (mark.ticks_ != 0) {
+      THash hashObj{};
+      FlightRecorder::instance().record(op, shard_idx, static_cast<uint64_t>(hashObj.hash(key)), outcome,
+                                        threadEvictions - mark.evictions_, mark.ticks_);
+    }
+  }
+
+  /**
+   * Counting sort of a batch by shard: shardOf[i] is the shard of keys[i], order lists
+   * the indices of keys shard after shard, in batch order within a shard.
+   */
+  void groupByShard(const TKey* keys, size_t count, std::vector<size_t>& shardOf, std::vector<size_t>& order) const;
+
+  /**
+   * Publish statistics if published inline and the interval passed, see StatsSegment::due().
+   */
+  void statsTick() {
+    StatsSegment* segment = inlineStats_.load(std::memory_order_acquire);
+    if (segment != nullptr && segment->due()) {
+      publishStats();
+    }
+  }
+
+  /**
+   * Log a mutation of shard shard_idx if a Journal is attached.
+   */
+  void journal(size_t shard_idx, JournalOp op, Tag tag, const TKey& key, const void* payload = nullptr,
+               size_t payloadSize = 0) {
+    CacheJournal* journal = journal_.load(std::memory_order_acquire);
+    if (journal != nullptr) {
+      journal->append(shard_idx, op, tag, key, payload, payloadSize);
+    }
+  }
 
  public:
-  using ConstAccessor = typename Shard::ConstAccessor;
+  /**
+   * Cursor iterates all shards one after another.
+   * See LRUCache::Cursor for consistency guarantees.
+   */
+  class Cursor final {
+   public:
+    explicit Cursor(ScalableLRUCache& cache) : cache_(cache), shard_idx_(0) {}
+
+    /**
+     * Copy the next element into key/value.
+     * Return false at the end of iteration.
+     */
+    bool next(TKey& key, TValue& value);
+
+   private:
+    ScalableLRUCache& cache_;
+    size_t shard_idx_;
+    std::unique_ptr<typename Shard::Cursor> shard_cursor_;
+  };
 
   /**
    * size: ScalableLRUCache capacity. And each internal LRUCache's capacity can be changed at runtime (Phase II)
    * shard_count: shard count.
+   * Shards are built on first touch, constructing the cache allocates one pointer per shard.
    */
   explicit ScalableLRUCache(size_t size, size_t shard_count = 0);
 
   ~ScalableLRUCache() {
-    clear();
+    if (fastTeardown_.load(std::memory_order_acquire)) {
+      // left to process exit, which releases the memory at once.
+      return;
+    }
+    for (size_t i = 0; i < shard_count_; i++) {
+      delete shards_[i].load(std::memory_order_relaxed);
+    }
   }
 
   ScalableLRUCache(const ScalableLRUCache&) = delete;
@@ -46,109 +237,1100 @@ class ScalableLRUCache {
 
   size_t erase(const TKey& key);
 
+  /**
+   * Erase count keys, e.g. a batch of invalidations, grouped by shard so that every
+   * shard is visited once.
+   * Returns number of elements removed.
+   */
+  size_t eraseMany(const TKey* keys, size_t count);
+
+  /**
+   * Erase all keys within [lo, hi] from every shard.
+   * Returns number of elements removed. Requires KeyIndex.
+   */
+  size_t eraseRange(const TKey& lo, const TKey& hi);
+
+  /**
+   * Erase all keys sharing the leading prefixLen bits with prefix, e.g. every
+   * IPv4 address of a /16 network. Bits are counted from the most significant bit
+   * of the key's unsigned representation.
+   * Returns number of elements removed. Requires KeyIndex and an integral TKey.
+   */
+  size_t erasePrefix(const TKey& prefix, unsigned prefixLen);
+
   bool find(ConstAccessor& caccessor, const TKey& key);
 
-  bool insert(const TKey& key, const TValue& value);
+  /**
+   * Look up count keys at once, grouped by shard, copying found values into values.
+   * found[i] tells whether values[i] was filled, every lock is released before
+   * the next key is looked up.
+   * Returns number of keys found.
+   */
+  size_t findMany(const TKey* keys, size_t count, TValue* values, bool* found);
+
+  bool insert(const TKey& key, const TValue& value, Tag tag = 0);
+
+  /**
+   * Insert count keys/values, grouped by shard so that every shard is visited once,
+   * e.g. when loading a feed. With assign, existing values are overwritten.
+   * Returns number of keys inserted.
+   */
+  size_t insertMany(const TKey* keys, const TValue* values, size_t count, Tag tag = 0, bool assign = false);
+
+  /**
+   * Insert key/value, or overwrite the value of an existing key.
+   * See LRUCache::insertOrAssign().
+   */
+  bool insertOrAssign(const TKey& key, const TValue& value, Tag tag = 0);
+
+  /**
+   * Same as insert() and insertOrAssign(), returning the outcome.
+   * See LRUCache::tryInsert().
+   */
+  InsertResult tryInsert(const TKey& key, const TValue& value, Tag tag = 0);
+  InsertResult tryInsertOrAssign(const TKey& key, const TValue& value, Tag tag = 0);
 
   void clear();
 
+  /**
+   * Call fn(key, value) for every element, scanning shards in parallel with one
+   * cursor per shard. fn must be thread-safe.
+   */
+  template <class Fn>
+  void forEach(Fn&& fn);
+
+  /**
+   * Erase every element for which pred(key, value) returns true, scanning shards in
+   * parallel. pred is checked again under the element's lock before erasing, so it
+   * must be thread-safe and may be called twice per element.
+   * Returns number of elements erased.
+   */
+  template <class Pred>
+  size_t eraseIf(Pred&& pred);
+
+  /**
+   * Write a binary image of all elements, in LRU order, to path.
+   * Shards are written in parallel, each with its own cursor, while the cache keeps
+   * serving. The image replaces path atomically once complete.
+   * Requires trivially copyable TKey and TValue.
+   * Returns false on I/O error.
+   */
+  bool snapshot(const std::string& path);
+
+  /**
+   * Map an image written by snapshot() and insert its elements, restoring LRU order.
+   * Shards of the image are loaded in parallel. The image may come from a cache with a
+   * different shard count or capacity. Records are applied last-wins: a key the
+   * snapshot cursor met twice, having been promoted or assigned meanwhile, ends up
+   * with its later value, and existing keys take the image's value.
+   * Chunks failing their checksum are skipped.
+   * Returns false if the image can't be read, doesn't match the layout of this cache, or
+   * had corrupt chunks.
+   */
+  bool load(const std::string& path);
+
+  /**
+   * Log subsequent mutations to journal, nullptr detaches.
+   * journal must be created with shardCount() shards and outlive the attachment.
+   */
+  void attachJournal(CacheJournal* journal);
+
+  /**
+   * Compact the attached journal: rotate it, write a snapshot to snapshotPath, then
+   * drop the log preceding the rotation. Without a journal, only takes the snapshot.
+   * Returns false on I/O error, the log is kept then.
+   */
+  bool checkpoint(const std::string& snapshotPath);
+
+  /**
+   * Apply a journal log written by a cache with the same shard count, shards in
+   * parallel. Mutations are applied to the shards directly and not logged again.
+   * Returns false if path can't be read or doesn't match this cache.
+   */
+  bool replayJournal(const std::string& path);
+
+  /**
+   * Rebuild the cache after a restart or crash: load snapshotPath, replay journalPath
+   * and a pending rotation in journalPath.next, then write a fresh snapshot so that a
+   * new Journal can start from an empty log.
+   * Missing files are treated as empty. Returns false if a file can't be read or
+   * doesn't match this cache, or on I/O error. The files are left untouched then, and
+   * the cache may hold part of their elements.
+   */
+  bool recover(const std::string& snapshotPath, const std::string& journalPath);
+
+  /**
+   * Publish subsequent mutations of every shard to a ChangeRing of ringCapacity events.
+   * A follower lagging more than ringCapacity events behind on a shard has to resync.
+   * Not thread-safe, call once before followers start. No-op if already enabled.
+   */
+  void enableChangeFeed(size_t ringCapacity);
+
+  /**
+   * Make the destructor leave all elements to the OS instead of freeing them one by
+   * one, so that exit or dlclose() doesn't take time proportional to the cache size.
+   * Only for caches destroyed at process exit, memory leaks otherwise.
+   * Returns false, and has no effect, unless TKey and TValue are trivially destructible.
+   */
+  bool enableFastTeardown();
+
+  /**
+   * Build every shard now, in parallel, e.g. during init, instead of on first touch.
+   * Thread-safe.
+   */
+  void preconstruct();
+
+  /**
+   * Change ring of every shard, empty if the change feed is disabled.
+   */
+  std::vector<ChangeFeed*> changeRings() const;
+
+  /**
+   * Invalidate every shard. Thread-safe, costs one atomic increment per shard.
+   * See LRUCache::invalidateAll().
+   */
+  void invalidateAll();
+
+  /**
+   * Invalidate elements inserted with tag in every shard, without a scan.
+   * See LRUCache::invalidateTag().
+   */
+  void invalidateTag(Tag tag);
+
+  /**
+   * Scan up to maxScan elements per shard and erase the stale ones.
+   * Returns number of elements erased.
+   */
+  size_t purgeStale(size_t maxScan);
+
   size_t size() const;
   size_t size(size_t shard_idx) const;
 
   size_t capacity() const;
   size_t capacity(size_t shard_idx) const;
 
+  /**
+   * Change the capacity at runtime, split over shards as in the constructor.
+   * See LRUCache::setCapacity(), evictExcess() shrinks to a lowered capacity.
+   * Thread-safe.
+   */
+  void setCapacity(size_t size);
+
+  /**
+   * Evict up to maxEvictions elements per shard beyond the shard's capacity.
+   * Returns number of elements evicted.
+   * Thread-safe.
+   */
+  size_t evictExcess(size_t maxEvictions);
+
+  /**
+   * Throttle admission of new keys in every shard during eviction storms.
+   * See LRUCache::enableAdmissionThrottle(). Thread-safe.
+   */
+  void enableAdmissionThrottle();
+
+  /**
+   * Returns number of shards currently throttling admission.
+   */
+  size_t throttledShards() const;
+
+  /**
+   * Returns number of inserts rejected by admission throttling.
+   */
+  uint64_t rejectedAdmissions() const;
+
+  /**
+   * Returns operation counts summed over shards, see LRUCache::stats().
+   */
+  CacheStats stats() const;
+
+  /**
+   * Returns operation counts of shard shard_idx, all zero while not built.
+   */
+  CacheStats stats(size_t shard_idx) const;
+
+  /**
+   * Time one in sampleEvery calls of find(), insert()/insertOrAssign() and erase()
+   * per thread into log-bucketed histograms, read with latency().
+   * Not thread-safe, call once before serving. No-op if already enabled.
+   */
+  void enableLatencyHistograms(uint32_t sampleEvery = 64);
+
+  /**
+   * Returns the sampled latencies of op, merged over threads. Empty if not enabled.
+   */
+  LatencyHistogram latency(LatencyOp op) const;
+
+  /**
+   * Returns lock contention of shard shard_idx, see LRUCache::listLockStats().
+   * Empty without LRUC_PROFILE_LOCKS or while the shard is not built.
+   */
+  ShardContention contention(size_t shard_idx) const;
+
+  /**
+   * Returns up to n shards with the most contended lock acquisitions, list and table
+   * combined, most contended first. Empty without LRUC_PROFILE_LOCKS.
+   */
+  std::vector<ShardContention> topContendedShards(size_t n) const;
+
+  /**
+   * Export statistics to the shared memory segment name, e.g. statsSegmentName(getpid()).
+   * A publish walks every shard and latency histogram, some 15us at 16 shards and 25us
+   * at 256. With StatsPublishing::Explicit the owner calls publishStats() every
+   * interval. With Inline, find(), insert(), insertOrAssign() and erase() republish
+   * once per interval, and the request noticing it takes that time in its latency.
+   * Not thread-safe, call once before serving. Returns false if the segment can't be
+   * created, true if already exported.
+   */
+  bool exportStats(const std::string& name, std::chrono::milliseconds interval = std::chrono::milliseconds(1000),
+                   StatsPublishing publishing = StatsPublishing::Explicit);
+
+  /**
+   * Publish statistics to the exported segment now, e.g. from a timer or idle loop.
+   * Returns false if not exported or another thread is publishing. Thread-safe.
+   */
+  bool publishStats();
+
+  /**
+   * Record every find(), insert(), insertOrAssign() and erase() call to the flight
+   * recorder: op, shard, key hash, duration, outcome and evictions, a few ns each.
+   * Dump with FlightRecorder::instance().dump() or installFlightRecorderSignal().
+   * Thread-safe.
+   */
+  void enableFlightRecorder();
+
   size_t shardCount() const;
 };
 
 // ---- private member functions ----
-template <class TKey, class TValue, class THash>
-typename ScalableLRUCache<TKey, TValue, THash>::Shard& ScalableLRUCache<TKey, TValue, THash>::shard(const TKey& key) {
+template <class TKey, class TValue, class THash, bool KeyIndex>
+size_t ScalableLRUCache<TKey, TValue, THash, KeyIndex>::shardIndex(const TKey& key) const {
   THash hashObj{};
-  // lower 16 bits counted as hash key
+  // upper 16 bits counted as hash key
   constexpr int shift = std::numeric_limits<size_t>::digits - 16;
+  // Fibonacci hashing spreads the hash code into the upper bits, identity hashes of
+  // small integral keys would otherwise all land in shard 0.
+  constexpr size_t multiplier = static_cast<size_t>(0x9E3779B97F4A7C15ULL);
 
   // According to intel TBB doc:
   // Good performance depends on having good pseudo-randomness in the low-order bits of the hash code.
-  size_t h = (hashObj.hash(key) >> shift) % shard_count_;
-
-  return *shards_[h];
+  // The upper bits are used here, so shard choice does not correlate with TBB buckets.
+  return ((hashObj.hash(key) * multiplier) >> shift) % shard_count_;
+}
+template <class TKey, class TValue, class THash, bool KeyIndex>
+typename ScalableLRUCache<TKey, TValue, THash, KeyIndex>::Shard&
+ScalableLRUCache<TKey, TValue, THash, KeyIndex>::constructShard(size_t shard_idx) {
+  Shard* expected = nullptr;
+  size_t capacity = shardCapacity(shard_idx);
+  Shard* shard = new Shard(capacity);
+  if (!shards_[shard_idx].compare_exchange_strong(expected, shard, std::memory_order_seq_cst)) {
+    delete shard;
+    return *expected;
+  }
+  // setCapacity() and enableAdmissionThrottle() skip shards not yet published, so
+  // check again once published. seq_cst on both sides: either they see this shard,
+  // or this sees their store.
+  if (shardCapacity(shard_idx, std::memory_order_seq_cst) != capacity) {
+    shard->setCapacity(shardCapacity(shard_idx));
+  }
+  if (admissionThrottle_.load(std::memory_order_seq_cst)) {
+    shard->enableAdmissionThrottle();
+  }
+  return *shard;
 }
+
 // ---- private member functions end ----
 
-template <class TKey, class TValue, class THash>
-ScalableLRUCache<TKey, TValue, THash>::ScalableLRUCache(size_t size, size_t shard_count)
-  : cache_size_(size), shard_count_(shard_count > 0 ? shard_count : std::thread::hardware_concurrency()) {
-  // capacity per LRUCache
-  size_t cap = cache_size_ / shard_count_;
-  size_t modular = cache_size_ % shard_count_;
+template <class TKey, class TValue, class THash, bool KeyIndex>
+ScalableLRUCache<TKey, TValue, THash, KeyIndex>::ScalableLRUCache(size_t size, size_t shard_count)
+  : cache_size_(size),
+    shard_count_(shard_count > 0 ? shard_count : std::thread::hardware_concurrency()),
+    journal_(nullptr),
+    fastTeardown_(false),
+    admissionThrottle_(false),
+    latency_(nullptr),
+    statsSegment_(nullptr),
+    inlineStats_(nullptr),
+    flightRecorder_(false) {
+  // shards are built on first touch, see preconstruct().
+  shards_.reset(new std::atomic<Shard*>[shard_count_]);
+  for (size_t i = 0; i < shard_count_; i++) {
+    shards_[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+bool ScalableLRUCache<TKey, TValue, THash, KeyIndex>::enableFastTeardown() {
+  if constexpr (std::is_trivially_destructible<TKey>::value && std::is_trivially_destructible<TValue>::value) {
+    fastTeardown_.store(true, std::memory_order_release);
+    return true;
+  }
+  return false;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+void ScalableLRUCache<TKey, TValue, THash, KeyIndex>::preconstruct() {
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, shard_count_, 1), [&](const tbb::blocked_range<size_t>& range) {
+    for (size_t i = range.begin(); i != range.end(); i++) {
+      shardAt(i);
+    }
+  });
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+void ScalableLRUCache<TKey, TValue, THash, KeyIndex>::groupByShard(const TKey* keys, size_t count,
+                                                                   std::vector<size_t>& shardOf,
+                                                                   std::vector<size_t>& order) const {
+  shardOf.resize(count);
+  std::vector<size_t> offsets(shard_count_ + 1, 0);
+  for (size_t i = 0; i < count; i++) {
+    shardOf[i] = shardIndex(keys[i]);
+    offsets[shardOf[i] + 1]++;
+  }
+  for (size_t i = 0; i < shard_count_; i++) {
+    offsets[i + 1] += offsets[i];
+  }
+  order.resize(count);
+  for (size_t i = 0; i < count; i++) {
+    order[offsets[shardOf[i]]++] = i;
+  }
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+size_t ScalableLRUCache<TKey, TValue, THash, KeyIndex>::erase(const TKey& key) {
+  uint64_t start = latencyBegin();
+  FlightMark mark = flightBegin();
+  size_t shard_idx = shardIndex(key);
+  Shard* shard = builtShard(shard_idx);
+  size_t erased = shard != nullptr ? shard->erase(key) : 0;
+  if (erased > 0) {
+    journal(shard_idx, JournalOp::Erase, 0, key);
+  }
+  latencyEnd(LatencyOp::Erase, start);
+  flightEnd(FlightOp::Erase, shard_idx, key, erased > 0, mark);
+  statsTick();
+  return erased;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+size_t ScalableLRUCache<TKey, TValue, THash, KeyIndex>::eraseMany(const TKey* keys, size_t count) {
+  std::vector<size_t> shardOf;
+  std::vector<size_t> order;
+  groupByShard(keys, count, shardOf, order);
+
+  size_t erased = 0;
+  size_t shard_idx = shard_count_;
+  Shard* shard = nullptr;
+  for (size_t i : order) {
+    if (shardOf[i] != shard_idx) {
+      shard_idx = shardOf[i];
+      shard = builtShard(shard_idx);
+    }
+    uint64_t start = latencyBegin();
+    FlightMark mark = flightBegin();
+    size_t n = shard != nullptr ? shard->erase(keys[i]) : 0;
+    if (n > 0) {
+      journal(shard_idx, JournalOp::Erase, 0, keys[i]);
+    }
+    latencyEnd(LatencyOp::Erase, start);
+    flightEnd(FlightOp::Erase, shard_idx, keys[i], n > 0, mark);
+    erased += n;
+  }
+  statsTick();
+  return erased;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+size_t ScalableLRUCache<TKey, TValue, THash, KeyIndex>::eraseRange(const TKey& lo, const TKey& hi) {
+  size_t erased = 0;
+  for (size_t i = 0; i < shard_count_; i++) {
+    if (Shard* shard = builtShard(i)) {
+      erased += shard->eraseRange(lo, hi);
+    }
+    journal(i, JournalOp::EraseRange, 0, lo, &hi, sizeof(TKey));
+  }
+  return erased;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+size_t ScalableLRUCache<TKey, TValue, THash, KeyIndex>::erasePrefix(const TKey& prefix, unsigned prefixLen) {
+  static_assert(std::is_integral<TKey>::value, "erasePrefix() requires an integral key");
+  using UKey = std::make_unsigned_t<TKey>;
+  constexpr unsigned bits = std::numeric_limits<UKey>::digits;
+
+  if (prefixLen == 0) {
+    // whole key space, signed keys wrap around thus can't be a single range.
+    return eraseRange(std::numeric_limits<TKey>::min(), std::numeric_limits<TKey>::max());
+  }
+
+  UKey mask = prefixLen >= bits ? UKey(~UKey(0)) : UKey(~(UKey(~UKey(0)) >> prefixLen));
+  UKey lo = static_cast<UKey>(prefix) & mask;
+  UKey hi = lo | UKey(~mask);
+
+  // The leading bit is fixed, so [lo, hi] stays contiguous for signed keys as well.
+  return eraseRange(static_cast<TKey>(lo), static_cast<TKey>(hi));
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+bool ScalableLRUCache<TKey, TValue, THash, KeyIndex>::find(ConstAccessor& caccessor, const TKey& key) {
+  uint64_t start = latencyBegin();
+  FlightMark mark = flightBegin();
+  size_t shard_idx = shardIndex(key);
+  // an unbuilt shard is empty, a lookup doesn't build it.
+  Shard* shard = builtShard(shard_idx);
+  bool found = shard != nullptr && shard->find(caccessor, key);
+  latencyEnd(LatencyOp::Find, start);
+  flightEnd(FlightOp::Find, shard_idx, key, found, mark);
+  statsTick();
+  return found;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+size_t ScalableLRUCache<TKey, TValue, THash, KeyIndex>::findMany(const TKey* keys, size_t count, TValue* values,
+                                                                 bool* found) {
+  std::vector<size_t> shardOf;
+  std::vector<size_t> order;
+  groupByShard(keys, count, shardOf, order);
+
+  size_t hits = 0;
+  size_t shard_idx = shard_count_;
+  Shard* shard = nullptr;
+  for (size_t i : order) {
+    if (shardOf[i] != shard_idx) {
+      shard_idx = shardOf[i];
+      shard = builtShard(shard_idx);
+    }
+    uint64_t start = latencyBegin();
+    FlightMark mark = flightBegin();
+    ConstAccessor caccessor;
+    found[i] = shard != nullptr && shard->find(caccessor, keys[i]);
+    if (found[i]) {
+      values[i] = *caccessor;
+      hits++;
+    }
+    latencyEnd(LatencyOp::Find, start);
+    flightEnd(FlightOp::Find, shard_idx, keys[i], found[i], mark);
+  }
+  statsTick();
+  return hits;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+bool ScalableLRUCache<TKey, TValue, THash, KeyIndex>::insert(const TKey& key, const TValue& value, Tag tag) {
+  InsertResult result = tryInsert(key, value, tag);
+  return result == InsertResult::Inserted || result == InsertResult::Assigned;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+InsertResult ScalableLRUCache<TKey, TValue, THash, KeyIndex>::tryInsert(const TKey& key, const TValue& value,
+                                                                        Tag tag) {
+  uint64_t start = latencyBegin();
+  FlightMark mark = flightBegin();
+  size_t shard_idx = shardIndex(key);
+  InsertResult result = shardAt(shard_idx).tryInsert(key, value, tag);
+  bool inserted = result == InsertResult::Inserted || result == InsertResult::Assigned;
+  if (inserted) {
+    journal(shard_idx, JournalOp::Insert, tag, key, &value, sizeof(TValue));
+  }
+  latencyEnd(LatencyOp::Insert, start);
+  flightEnd(FlightOp::Insert, shard_idx, key, inserted, mark);
+  statsTick();
+  return result;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+size_t ScalableLRUCache<TKey, TValue, THash, KeyIndex>::insertMany(const TKey* keys, const TValue* values,
+                                                                   size_t count, Tag tag, bool assign) {
+  std::vector<size_t> shardOf;
+  std::vector<size_t> order;
+  groupByShard(keys, count, shardOf, order);
+
+  size_t inserted = 0;
+  for (size_t i : order) {
+    Shard& shard = shardAt(shardOf[i]);
+    InsertResult result = assign ? shard.tryInsertOrAssign(keys[i], values[i], tag)
+                                 : shard.tryInsert(keys[i], values[i], tag);
+    if (result != InsertResult::Inserted && result != InsertResult::Assigned) {
+      continue;
+    }
+    inserted += assign && result == InsertResult::Assigned ? 0 : 1;
+    journal(shardOf[i], assign ? JournalOp::InsertOrAssign : JournalOp::Insert, tag, keys[i], &values[i],
+            sizeof(TValue));
+  }
+  return inserted;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+bool ScalableLRUCache<TKey, TValue, THash, KeyIndex>::insertOrAssign(const TKey& key, const TValue& value, Tag tag) {
+  return tryInsertOrAssign(key, value, tag) == InsertResult::Inserted;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+InsertResult ScalableLRUCache<TKey, TValue, THash, KeyIndex>::tryInsertOrAssign(const TKey& key, const TValue& value,
+                                                                                Tag tag) {
+  uint64_t start = latencyBegin();
+  FlightMark mark = flightBegin();
+  size_t shard_idx = shardIndex(key);
+  InsertResult result = shardAt(shard_idx).tryInsertOrAssign(key, value, tag);
+  // a key not admitted is not logged, replay would add it.
+  if (result == InsertResult::Inserted || result == InsertResult::Assigned) {
+    journal(shard_idx, JournalOp::InsertOrAssign, tag, key, &value, sizeof(TValue));
+  }
+  latencyEnd(LatencyOp::Insert, start);
+  flightEnd(FlightOp::InsertOrAssign, shard_idx, key, result == InsertResult::Inserted, mark);
+  statsTick();
+  return result;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+void ScalableLRUCache<TKey, TValue, THash, KeyIndex>::clear() {
+  for (size_t i = 0; i < shard_count_; i++) {
+    if (Shard* shard = builtShard(i)) {
+      shard->clear();
+    }
+  }
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+template <class Fn>
+void ScalableLRUCache<TKey, TValue, THash, KeyIndex>::forEach(Fn&& fn) {
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, shard_count_, 1), [&](const tbb::blocked_range<size_t>& range) {
+    TKey key;
+    TValue value;
+    for (size_t i = range.begin(); i != range.end(); ++i) {
+      Shard* shard = builtShard(i);
+      if (shard == nullptr) {
+        continue;
+      }
+      typename Shard::Cursor cursor(*shard);
+      while (cursor.next(key, value)) {
+        fn(key, value);
+      }
+    }
+  });
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+template <class Pred>
+size_t ScalableLRUCache<TKey, TValue, THash, KeyIndex>::eraseIf(Pred&& pred) {
+  std::atomic<size_t> erased{0};
+
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, shard_count_, 1), [&](const tbb::blocked_range<size_t>& range) {
+    TKey key;
+    TValue value;
+    for (size_t i = range.begin(); i != range.end(); ++i) {
+      Shard* shard = builtShard(i);
+      if (shard == nullptr) {
+        continue;
+      }
+      size_t shard_erased = 0;
+      typename Shard::Cursor cursor(*shard);
+      while (cursor.next(key, value)) {
+        // value is a copy, the element may have been updated since.
+        if (pred(key, value) && shard->eraseIf(key, pred) > 0) {
+          journal(i, JournalOp::Erase, 0, key);
+          shard_erased++;
+        }
+      }
+      erased += shard_erased;
+    }
+  });
+
+  return erased.load();
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+bool ScalableLRUCache<TKey, TValue, THash, KeyIndex>::snapshot(const std::string& path) {
+  static_assert(std::is_trivially_copyable<TKey>::value && std::is_trivially_copyable<TValue>::value,
+                "snapshot() requires trivially copyable key and value");
+  // records are flushed per chunk to bound memory.
+  constexpr size_t chunkRecords = 16384;
+  constexpr size_t recordSize = sizeof(TKey) + sizeof(TValue) + sizeof(Tag);
+
+  SnapshotWriter writer(path, shard_count_, sizeof(TKey), sizeof(TValue), recordSize);
+  if (!writer.isOpen()) {
+    return false;
+  }
+
+  std::atomic<bool> ok{true};
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, shard_count_, 1), [&](const tbb::blocked_range<size_t>& range) {
+    std::vector<char> records;
+    records.reserve(chunkRecords * recordSize);
+
+    TKey key;
+    TValue value;
+    Tag tag;
+    for (size_t i = range.begin(); i != range.end() && ok.load(std::memory_order_relaxed); ++i) {
+      Shard* shard = builtShard(i);
+      if (shard == nullptr) {
+        continue;
+      }
+      uint32_t count = 0;
+      typename Shard::Cursor cursor(*shard);
+      while (cursor.next(key, value, tag)) {
+        size_t offset = records.size();
+        records.resize(offset + recordSize);
+        std::memcpy(records.data() + offset, &key, sizeof(TKey));
+        std::memcpy(records.data() + offset + sizeof(TKey), &value, sizeof(TValue));
+        std::memcpy(records.data() + offset + sizeof(TKey) + sizeof(TValue), &tag, sizeof(Tag));
+
+        if (++count == chunkRecords) {
+          if (!writer.writeChunk(static_cast<uint32_t>(i), count, records)) {
+            ok = false;
+            break;
+          }
+          records.clear();
+          count = 0;
+        }
+      }
+
+      if (count > 0 && !writer.writeChunk(static_cast<uint32_t>(i), count, records)) {
+        ok = false;
+      }
+      records.clear();
+    }
+  });
+
+  return ok.load() && writer.commit();
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+bool ScalableLRUCache<TKey, TValue, THash, KeyIndex>::load(const std::string& path) {
+  static_assert(std::is_trivially_copyable<TKey>::value && std::is_trivially_copyable<TValue>::value,
+                "load() requires trivially copyable key and value");
+  constexpr size_t recordSize = sizeof(TKey) + sizeof(TValue) + sizeof(Tag);
+
+  SnapshotReader reader;
+  if (!reader.open(path, sizeof(TKey), sizeof(TValue), recordSize)) {
+    return false;
+  }
+
+  // Group chunks by the shard that wrote them, chunk order within a shard is LRU order.
+  std::vector<std::vector<const SnapshotReader::Chunk*>> shardChunks(reader.shardCount());
+  for (const auto& chunk : reader.chunks()) {
+    if (chunk.shard_ >= shardChunks.size()) {
+      return false;
+    }
+    shardChunks[chunk.shard_].push_back(&chunk);
+  }
+
+  std::atomic<bool> ok{true};
+  tbb::parallel_for(tbb::blocked_range<size_t>(0, shardChunks.size(), 1), [&](const tbb::blocked_range<size_t>& range) {
+    TKey key;
+    TValue value;
+    Tag tag;
+    for (size_t i = range.begin(); i != range.end(); ++i) {
+      for (const SnapshotReader::Chunk* chunk : shardChunks[i]) {
+        if (!reader.verify(*chunk)) {
+          ok = false;
+          continue;
+        }
+
+        const char* record = chunk->records_;
+        for (uint32_t n = 0; n < chunk->count_; n++, record += recordSize) {
+          std::memcpy(&key, record, sizeof(TKey));
+          std::memcpy(&value, record + sizeof(TKey), sizeof(TValue));
+          std::memcpy(&tag, record + sizeof(TKey) + sizeof(TValue), sizeof(Tag));
+          // a later record of the same key is newer.
+          insertOrAssign(key, value, tag);
+        }
+      }
+    }
+  });
+
+  return ok.load();
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+void ScalableLRUCache<TKey, TValue, THash, KeyIndex>::attachJournal(CacheJournal* journal) {
+  journal_.store(journal, std::memory_order_release);
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+bool ScalableLRUCache<TKey, TValue, THash, KeyIndex>::checkpoint(const std::string& snapshotPath) {
+  CacheJournal* journal = journal_.load(std::memory_order_acquire);
+  if (journal != nullptr && !journal->rotate()) {
+    return false;
+  }
 
+  if (!snapshot(snapshotPath)) {
+    return false;
+  }
+
+  return journal == nullptr || journal->commitRotation();
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+bool ScalableLRUCache<TKey, TValue, THash, KeyIndex>::replayJournal(const std::string& path) {
+  return CacheJournal::replay(path, shard_count_, [this](size_t shard_idx, JournalOp op, Tag tag, const TKey& key,
+                                                         const char* payload) {
+    Shard& shard = shardAt(shard_idx);
+    TValue value;
+    // keyed records go to the key's shard under the current shardIndex(), which
+    // need not match the writer's.
+    switch (op) {
+      case JournalOp::Insert:
+        std::memcpy(&value, payload, sizeof(TValue));
+        shardAt(shardIndex(key)).insert(key, value, tag);
+        break;
+      case JournalOp::InsertOrAssign:
+        std::memcpy(&value, payload, sizeof(TValue));
+        shardAt(shardIndex(key)).insertOrAssign(key, value, tag);
+        break;
+      case JournalOp::Erase:
+        shardAt(shardIndex(key)).erase(key);
+        break;
+      case JournalOp::EraseRange:
+        if constexpr (KeyIndex) {
+          TKey hi;
+          std::memcpy(&hi, payload, sizeof(TKey));
+          shard.eraseRange(key, hi);
+        }
+        break;
+      case JournalOp::InvalidateAll:
+        shard.invalidateAll();
+        break;
+      case JournalOp::InvalidateTag:
+        shard.invalidateTag(tag);
+        break;
+    }
+  });
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+bool ScalableLRUCache<TKey, TValue, THash, KeyIndex>::recover(const std::string& snapshotPath,
+                                                               const std::string& journalPath) {
+  const std::string nextJournalPath = journalPath + ".next";
+
+  // Any failure keeps the files, they may be the only copy of the data.
+  if (::access(snapshotPath.c_str(), F_OK) == 0 && !load(snapshotPath)) {
+    return false;
+  }
+  if (::access(journalPath.c_str(), F_OK) == 0 && !replayJournal(journalPath)) {
+    return false;
+  }
+  if (::access(nextJournalPath.c_str(), F_OK) == 0 && !replayJournal(nextJournalPath)) {
+    return false;
+  }
+
+  // Logs are covered by the snapshot from now on.
+  if (!snapshot(snapshotPath)) {
+    return false;
+  }
+  ::unlink(nextJournalPath.c_str());
+  ::unlink(journalPath.c_str());
+
+  return true;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+void ScalableLRUCache<TKey, TValue, THash, KeyIndex>::enableChangeFeed(size_t ringCapacity) {
+  if (!changeRings_.empty()) {
+    return;
+  }
+
+  // rings are attached to built shards only, so build them all first.
+  preconstruct();
   for (size_t i = 0; i < shard_count_; i++) {
-    shards_.emplace_back(std::make_unique<Shard>(i != 0 ? cap : (cap + modular)));
+    changeRings_.emplace_back(std::make_unique<ChangeFeed>(ringCapacity));
+    shardAt(i).attachChangeRing(changeRings_.back().get());
   }
 }
 
-template <class TKey, class TValue, class THash>
-size_t ScalableLRUCache<TKey, TValue, THash>::erase(const TKey& key) {
-  return shard(key).erase(key);
+template <class TKey, class TValue, class THash, bool KeyIndex>
+std::vector<typename ScalableLRUCache<TKey, TValue, THash, KeyIndex>::ChangeFeed*>
+ScalableLRUCache<TKey, TValue, THash, KeyIndex>::changeRings() const {
+  std::vector<ChangeFeed*> rings;
+  for (const auto& ring : changeRings_) {
+    rings.push_back(ring.get());
+  }
+  return rings;
 }
 
-template <class TKey, class TValue, class THash>
-bool ScalableLRUCache<TKey, TValue, THash>::find(ConstAccessor& caccessor, const TKey& key) {
-  return shard(key).find(caccessor, key);
+template <class TKey, class TValue, class THash, bool KeyIndex>
+void ScalableLRUCache<TKey, TValue, THash, KeyIndex>::invalidateAll() {
+  for (size_t i = 0; i < shard_count_; i++) {
+    if (Shard* shard = builtShard(i)) {
+      shard->invalidateAll();
+    }
+    journal(i, JournalOp::InvalidateAll, 0, TKey{});
+  }
 }
 
-template <class TKey, class TValue, class THash>
-bool ScalableLRUCache<TKey, TValue, THash>::insert(const TKey& key, const TValue& value) {
-  return shard(key).insert(key, value);
+template <class TKey, class TValue, class THash, bool KeyIndex>
+void ScalableLRUCache<TKey, TValue, THash, KeyIndex>::invalidateTag(Tag tag) {
+  for (size_t i = 0; i < shard_count_; i++) {
+    if (Shard* shard = builtShard(i)) {
+      shard->invalidateTag(tag);
+    }
+    journal(i, JournalOp::InvalidateTag, tag, TKey{});
+  }
 }
 
-template <class TKey, class TValue, class THash>
-void ScalableLRUCache<TKey, TValue, THash>::clear() {
+template <class TKey, class TValue, class THash, bool KeyIndex>
+size_t ScalableLRUCache<TKey, TValue, THash, KeyIndex>::purgeStale(size_t maxScan) {
+  size_t purged = 0;
   for (size_t i = 0; i < shard_count_; i++) {
-    shards_[i]->clear();
+    if (Shard* shard = builtShard(i)) {
+      purged += shard->purgeStale(maxScan);
+    }
   }
+  return purged;
 }
 
-template <class TKey, class TValue, class THash>
-size_t ScalableLRUCache<TKey, TValue, THash>::size() const {
+template <class TKey, class TValue, class THash, bool KeyIndex>
+size_t ScalableLRUCache<TKey, TValue, THash, KeyIndex>::size() const {
   size_t size = 0;
   for (size_t i = 0; i < shard_count_; i++) {
-    size += shards_[i]->size();
+    if (Shard* shard = builtShard(i)) {
+      size += shard->size();
+    }
   }
   return size;
 }
 
-template <class TKey, class TValue, class THash>
-size_t ScalableLRUCache<TKey, TValue, THash>::size(size_t shard_idx) const {
+template <class TKey, class TValue, class THash, bool KeyIndex>
+size_t ScalableLRUCache<TKey, TValue, THash, KeyIndex>::size(size_t shard_idx) const {
   if (shard_idx < shard_count_) {
-    return shards_[shard_idx]->size();
+    Shard* shard = builtShard(shard_idx);
+    return shard != nullptr ? shard->size() : 0;
   }
 
   return 0;
 }
 
-template <class TKey, class TValue, class THash>
-size_t ScalableLRUCache<TKey, TValue, THash>::capacity() const {
+template <class TKey, class TValue, class THash, bool KeyIndex>
+size_t ScalableLRUCache<TKey, TValue, THash, KeyIndex>::capacity() const {
   size_t size = 0;
   for (size_t i = 0; i < shard_count_; i++) {
-    size += shards_[i]->capacity();
+    size += shardCapacity(i);
   }
 
   return size;
 }
 
-template <class TKey, class TValue, class THash>
-size_t ScalableLRUCache<TKey, TValue, THash>::capacity(size_t shard_idx) const {
+template <class TKey, class TValue, class THash, bool KeyIndex>
+size_t ScalableLRUCache<TKey, TValue, THash, KeyIndex>::capacity(size_t shard_idx) const {
   if (shard_idx < shard_count_) {
-    return shards_[shard_idx]->capacity();
+    return shardCapacity(shard_idx);
   }
 
   return 0;
 }
 
-template <class TKey, class TValue, class THash>
-size_t ScalableLRUCache<TKey, TValue, THash>::shardCount() const {
+template <class TKey, class TValue, class THash, bool KeyIndex>
+void ScalableLRUCache<TKey, TValue, THash, KeyIndex>::setCapacity(size_t size) {
+  // seq_cst, pairs with constructShard().
+  cache_size_.store(size, std::memory_order_seq_cst);
+  for (size_t i = 0; i < shard_count_; i++) {
+    if (Shard* shard = shards_[i].load(std::memory_order_seq_cst)) {
+      shard->setCapacity(shardCapacity(i));
+    }
+  }
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+size_t ScalableLRUCache<TKey, TValue, THash, KeyIndex>::evictExcess(size_t maxEvictions) {
+  size_t evicted = 0;
+  for (size_t i = 0; i < shard_count_; i++) {
+    if (Shard* shard = builtShard(i)) {
+      evicted += shard->evictExcess(maxEvictions);
+    }
+  }
+  return evicted;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+void ScalableLRUCache<TKey, TValue, THash, KeyIndex>::enableAdmissionThrottle() {
+  // seq_cst, pairs with constructShard().
+  admissionThrottle_.store(true, std::memory_order_seq_cst);
+  for (size_t i = 0; i < shard_count_; i++) {
+    if (Shard* shard = shards_[i].load(std::memory_order_seq_cst)) {
+      shard->enableAdmissionThrottle();
+    }
+  }
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+size_t ScalableLRUCache<TKey, TValue, THash, KeyIndex>::throttledShards() const {
+  size_t throttled = 0;
+  for (size_t i = 0; i < shard_count_; i++) {
+    Shard* shard = builtShard(i);
+    throttled += shard != nullptr && shard->admissionThrottled() ? 1 : 0;
+  }
+  return throttled;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+uint64_t ScalableLRUCache<TKey, TValue, THash, KeyIndex>::rejectedAdmissions() const {
+  uint64_t rejected = 0;
+  for (size_t i = 0; i < shard_count_; i++) {
+    if (Shard* shard = builtShard(i)) {
+      rejected += shard->rejectedAdmissions();
+    }
+  }
+  return rejected;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+CacheStats ScalableLRUCache<TKey, TValue, THash, KeyIndex>::stats() const {
+  CacheStats total;
+  for (size_t i = 0; i < shard_count_; i++) {
+    if (Shard* shard = builtShard(i)) {
+      total += shard->stats();
+    }
+  }
+  return total;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+CacheStats ScalableLRUCache<TKey, TValue, THash, KeyIndex>::stats(size_t shard_idx) const {
+  Shard* shard = shard_idx < shard_count_ ? builtShard(shard_idx) : nullptr;
+  return shard != nullptr ? shard->stats() : CacheStats();
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+void ScalableLRUCache<TKey, TValue, THash, KeyIndex>::enableLatencyHistograms(uint32_t sampleEvery) {
+  if (latencyOwner_ != nullptr) {
+    return;
+  }
+  latencyOwner_.reset(new LatencyRecorder(sampleEvery));
+  latency_.store(latencyOwner_.get(), std::memory_order_release);
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+LatencyHistogram ScalableLRUCache<TKey, TValue, THash, KeyIndex>::latency(LatencyOp op) const {
+  LatencyRecorder* latency = latency_.load(std::memory_order_acquire);
+  return latency != nullptr ? latency->snapshot(op) : LatencyHistogram();
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+ShardContention ScalableLRUCache<TKey, TValue, THash, KeyIndex>::contention(size_t shard_idx) const {
+  ShardContention contention;
+  contention.shard_ = shard_idx;
+  Shard* shard = shard_idx < shard_count_ ? builtShard(shard_idx) : nullptr;
+  if (shard != nullptr) {
+    contention.list_ = shard->listLockStats();
+    contention.table_ = shard->tableLockStats();
+  }
+  return contention;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+std::vector<ShardContention> ScalableLRUCache<TKey, TValue, THash, KeyIndex>::topContendedShards(size_t n) const {
+  std::vector<ShardContention> shards;
+  if (!LockProfiling) {
+    return shards;
+  }
+  for (size_t i = 0; i < shard_count_; i++) {
+    if (builtShard(i) != nullptr) {
+      shards.push_back(contention(i));
+    }
+  }
+
+  auto contended = [](const ShardContention& shard) { return shard.list_.contended_ + shard.table_.contended_; };
+  n = std::min(n, shards.size());
+  std::partial_sort(shards.begin(), shards.begin() + n, shards.end(),
+                    [&](const ShardContention& a, const ShardContention& b) { return contended(a) > contended(b); });
+  shards.resize(n);
+  return shards;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+bool ScalableLRUCache<TKey, TValue, THash, KeyIndex>::exportStats(const std::string& name,
+                                                                  std::chrono::milliseconds interval,
+                                                                  StatsPublishing publishing) {
+  if (statsSegmentOwner_ != nullptr) {
+    return true;
+  }
+  statsSegmentOwner_ = StatsSegment::create(name, shard_count_, interval);
+  if (statsSegmentOwner_ == nullptr) {
+    return false;
+  }
+  statsSegment_.store(statsSegmentOwner_.get(), std::memory_order_release);
+  publishStats();
+  if (publishing == StatsPublishing::Inline) {
+    inlineStats_.store(statsSegmentOwner_.get(), std::memory_order_release);
+  }
+  return true;
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+bool ScalableLRUCache<TKey, TValue, THash, KeyIndex>::publishStats() {
+  StatsSegment* segment = statsSegment_.load(std::memory_order_acquire);
+  if (segment == nullptr) {
+    return false;
+  }
+
+  return segment->publish([this](StatsPayload& payload, ShardStatsRecord* records) {
+    for (size_t i = 0; i < shard_count_; i++) {
+      ShardStatsRecord& record = records[i];
+      record.capacity_ = shardCapacity(i);
+      Shard* shard = builtShard(i);
+      if (shard == nullptr) {
+        continue;
+      }
+      record.stats_ = shard->stats();
+      record.size_ = shard->size();
+      record.built_ = 1;
+      record.throttled_ = shard->admissionThrottled() ? 1 : 0;
+      if (LockProfiling) {
+        LockStats list = shard->listLockStats();
+        LockStats table = shard->tableLockStats();
+        record.listAcquisitions_ = list.acquisitions_;
+        record.listContended_ = list.contended_;
+        record.listFailedTries_ = list.failedTries_;
+        record.tableAcquisitions_ = table.acquisitions_;
+        record.tableContended_ = table.contended_;
+      }
+      payload.size_ += record.size_;
+    }
+    payload.capacity_ = capacity();
+
+    LatencyRecorder* latency = latency_.load(std::memory_order_acquire);
+    if (latency != nullptr) {
+      payload.sampleEvery_ = latency->sampleEvery();
+      payload.nanosPerTick_ = nanosPerTick();
+      for (size_t op = 0; op < static_cast<size_t>(LatencyOp::Count); op++) {
+        LatencyHistogram histogram = latency->snapshot(static_cast<LatencyOp>(op));
+        std::copy(histogram.buckets_.begin(), histogram.buckets_.end(), payload.latency_[op]);
+      }
+    }
+  });
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+void ScalableLRUCache<TKey, TValue, THash, KeyIndex>::enableFlightRecorder() {
+  FlightRecorder::instance().calibrate();
+  flightRecorder_.store(true, std::memory_order_release);
+}
+
+template <class TKey, class TValue, class THash, bool KeyIndex>
+size_t ScalableLRUCache<TKey, TValue, THash, KeyIndex>::shardCount() const {
   return shard_count_;
 }
+
+// ---- Cursor ----
+template <class TKey, class TValue, class THash, bool KeyIndex>
+bool ScalableLRUCache<TKey, TValue, THash, KeyIndex>::Cursor::next(TKey& key, TValue& value) {
+  while (shard_idx_ < cache_.shard_count_) {
+    if (!shard_cursor_) {
+      Shard* shard = cache_.builtShard(shard_idx_);
+      if (shard == nullptr) {
+        shard_idx_++;
+        continue;
+      }
+      shard_cursor_ = std::make_unique<typename Shard::Cursor>(*shard);
+    }
+
+    if (shard_cursor_->next(key, value)) {
+      return true;
+    }
+
+    shard_cursor_.reset();
+    shard_idx_++;
+  }
+
+  return false;
+}
 }  // namespace LRUC
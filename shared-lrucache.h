@@ -0,0 +1,853 @@
+/**
+ * @author shchang
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <tbb/concurrent_hash_map.h>
+
+#include "cache-handover.h"
+
+namespace LRUC {
+
+/**
+ * SharedLRUCache is an LRU cache living in a shared memory segment, so that several
+ * processes on a host share one cache instead of each holding a duplicate.
+ *
+ * The segment is either a named POSIX shared memory object (/dev/shm), opened by
+ * every worker with the same name, or an anonymous memfd inherited across fork().
+ *
+ * Layout:
+ *  SegmentHeader
+ *  shard*: ShardHeader, bucket array, node array
+ *
+ * Everything inside the segment is addressed by offsets and node indices rather than
+ * pointers, since every process maps the segment at a different address. Capacity is
+ * fixed at creation, nodes are preallocated per shard.
+ *
+ * Layout::Clock is meant for pre-fork servers warming the cache before forking workers,
+ * see createPrivate(). Lookups never write to node or bucket pages: instead of relinking
+ * the LRU list, find() sets a reference byte in a separate per-shard array, and eviction
+ * runs the CLOCK algorithm over it. Shard headers, whose mutex is written on every
+ * operation, sit on their own page. Warmed pages thus stay shared copy-on-write with
+ * the parent, only reference and header pages get copied.
+ *
+ * A restarted binary takes the segment over from its predecessor with handOver() and
+ * adopt(), which pass the fd over a Unix socket, so it starts warm.
+ *
+ * Every shard is guarded by a process-shared robust mutex. If a process dies while
+ * holding it, the next locker gets EOWNERDEAD and resets that shard, as it may have
+ * been left half-modified. Only the content of one shard is lost.
+ *
+ * Type concepts:
+ *  TKey and TValue must be trivially copyable, since they are shared by raw bytes.
+ *  THash must model the TBB::HashCompare concept and be deterministic across processes.
+ */
+template <class TKey, class TValue, class THash = tbb::tbb_hash_compare<TKey>>
+class SharedLRUCache final {
+  static_assert(std::is_trivially_copyable<TKey>::value && std::is_trivially_copyable<TValue>::value,
+                "SharedLRUCache requires trivially copyable key and value");
+
+ private:
+  using Index = uint32_t;
+  // used for judging a node index is a valid one.
+  static constexpr Index NullIndex = std::numeric_limits<Index>::max();
+  static constexpr size_t PageSize = 4096;
+
+ public:
+  /**
+   * Lru: exact LRU order, find() relinks the node.
+   * Clock: approximate LRU, find() only sets a reference byte outside node pages.
+   */
+  enum class Layout : uint32_t { Lru = 0, Clock = 1 };
+
+ private:
+  struct SegmentHeader final {
+    static constexpr uint64_t Magic = 0x314d48534355524cULL;  // "LRUCSHM1" little-endian
+    static constexpr uint32_t Version = 2;
+
+    uint64_t magic_;
+    uint32_t version_;
+    uint32_t keySize_;
+    uint32_t valueSize_;
+    uint32_t shardCount_;
+    uint32_t shardCapacity_;
+    uint32_t bucketCount_;
+    Layout layout_;
+    // byte distance between two shards.
+    uint64_t shardStride_;
+    // byte offsets within a shard.
+    uint64_t bucketOffset_;
+    uint64_t nodeOffset_;
+    uint64_t refOffset_;
+    uint64_t segmentSize_;
+    // set by the creator once the segment is initialized.
+    std::atomic<uint32_t> ready_;
+  };
+
+  struct alignas(64) ShardHeader final {
+    pthread_mutex_t mutex_;
+    uint32_t size_;
+    // least-recently used / most-recently used node
+    Index head_;
+    Index tail_;
+    // chain of released nodes
+    Index freeHead_;
+    // nodes at and past nextUnused_ were never used
+    Index nextUnused_;
+    // next eviction candidate of Layout::Clock
+    Index hand_;
+  };
+
+  struct Node final {
+    TKey key_;
+    TValue value_;
+    Index hashNext_;
+    Index prev_;
+    Index next_;
+  };
+
+ private:
+  int fd_;
+  char* base_;
+  size_t segmentSize_;
+  SegmentHeader* header_;
+
+ private:
+  SharedLRUCache(int fd, char* base, size_t segmentSize)
+    : fd_(fd), base_(base), segmentSize_(segmentSize), header_(reinterpret_cast<SegmentHeader*>(base)) {}
+
+  static size_t alignUp(size_t bytes, size_t alignment) {
+    return (bytes + alignment - 1) & ~(alignment - 1);
+  }
+
+  /**
+   * Compute shard layout into header, return the shard stride.
+   */
+  static size_t layoutShard(SegmentHeader& header) {
+    // Clock keeps written data off the pages shared copy-on-write.
+    size_t alignment = header.layout_ == Layout::Clock ? PageSize : 64;
+
+    header.bucketOffset_ = alignUp(sizeof(ShardHeader), alignment);
+    header.nodeOffset_ = alignUp(header.bucketOffset_ + header.bucketCount_ * sizeof(Index), alignof(Node));
+    header.refOffset_ = alignUp(header.nodeOffset_ + header.shardCapacity_ * sizeof(Node), alignment);
+
+    size_t refBytes = header.layout_ == Layout::Clock ? header.shardCapacity_ : 0;
+    return alignUp(header.refOffset_ + refBytes, alignment);
+  }
+
+  static size_t hashOf(const TKey& key) {
+    THash hashObj{};
+    // Fibonacci hashing, upper bits choose the shard and lower bits the bucket.
+    return hashObj.hash(key) * static_cast<size_t>(0x9E3779B97F4A7C15ULL);
+  }
+
+  static size_t headerSize(Layout layout) {
+    return alignUp(sizeof(SegmentHeader), layout == Layout::Clock ? PageSize : 64);
+  }
+
+  ShardHeader& shardHeader(size_t shard_idx) const {
+    return *reinterpret_cast<ShardHeader*>(base_ + headerSize(header_->layout_) + shard_idx * header_->shardStride_);
+  }
+
+  Index* buckets(ShardHeader& shard) const {
+    return reinterpret_cast<Index*>(reinterpret_cast<char*>(&shard) + header_->bucketOffset_);
+  }
+
+  Node* nodes(ShardHeader& shard) const {
+    return reinterpret_cast<Node*>(reinterpret_cast<char*>(&shard) + header_->nodeOffset_);
+  }
+
+  uint8_t* refs(ShardHeader& shard) const {
+    return reinterpret_cast<uint8_t*>(reinterpret_cast<char*>(&shard) + header_->refOffset_);
+  }
+
+  bool clock() const {
+    return header_->layout_ == Layout::Clock;
+  }
+
+  size_t shardIndex(size_t hash) const {
+    constexpr int shift = std::numeric_limits<size_t>::digits - 16;
+    return (hash >> shift) % header_->shardCount_;
+  }
+
+  Index& bucket(ShardHeader& shard, size_t hash) const {
+    return buckets(shard)[hash % header_->bucketCount_];
+  }
+
+  /**
+   * Lock shard, resetting it if the previous owner died while holding the lock.
+   * Return false if the mutex is unusable.
+   */
+  bool lock(ShardHeader& shard);
+
+  void unlock(ShardHeader& shard) {
+    pthread_mutex_unlock(&shard.mutex_);
+  }
+
+  /**
+   * Initialize or reset shard content, keeping its mutex.
+   * Not thread-safe. Caller is responsible for a lock.
+   */
+  void resetShard(ShardHeader& shard);
+
+  /**
+   * Return node index of key in shard, NullIndex if absent.
+   * Not thread-safe. Caller is responsible for a lock.
+   */
+  Index lookup(ShardHeader& shard, size_t hash, const TKey& key) const;
+
+  /**
+   * LRU list and hash chain maintenance.
+   * Not thread-safe. Caller is responsible for a lock.
+   */
+  void append(ShardHeader& shard, Index idx);
+  void unlink(ShardHeader& shard, Index idx);
+  void unchain(ShardHeader& shard, size_t hash, Index idx);
+
+  /**
+   * Mark node idx as recently used, relinking it for Lru or setting its reference
+   * byte for Clock.
+   * Not thread-safe. Caller is responsible for a lock.
+   */
+  void touch(ShardHeader& shard, Index idx);
+
+  /**
+   * Unlink and release node idx.
+   * Not thread-safe. Caller is responsible for a lock.
+   */
+  void release(ShardHeader& shard, Index idx);
+
+  /**
+   * Return an unused node, evicting the least-recently used one if shard is full.
+   * Not thread-safe. Caller is responsible for a lock.
+   */
+  Index allocate(ShardHeader& shard);
+
+  /**
+   * Yield until ready() holds, up to a deadline in case the creator died mid-way.
+   */
+  template <class Ready>
+  static bool waitUntil(Ready&& ready) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!ready()) {
+      if (std::chrono::steady_clock::now() > deadline) {
+        return false;
+      }
+      std::this_thread::yield();
+    }
+    return true;
+  }
+
+  /**
+   * Map fd and validate or initialize the segment.
+   */
+  static std::unique_ptr<SharedLRUCache> map(int fd, bool create, size_t capacity, size_t shardCount, Layout layout);
+
+ public:
+  /**
+   * Open the named shared memory object name (e.g. "/soft-ip-cache"), creating and
+   * initializing it on first use. Processes opening an existing segment wait until
+   * its creator finished initializing and validate its layout. Initialization holds
+   * an flock() on the object, which the kernel drops if the creator dies, so the next
+   * opener finding the segment uninitialized initializes it again.
+   * capacity, shardCount and layout only apply to the initializing process.
+   * Returns nullptr on failure.
+   */
+  static std::unique_ptr<SharedLRUCache> open(const std::string& name, size_t capacity, size_t shardCount = 0,
+                                              Layout layout = Layout::Lru);
+
+  /**
+   * Create a cache in an anonymous memfd segment, shared with children forked
+   * afterwards. name is only used for debugging.
+   * Returns nullptr on failure.
+   */
+  static std::unique_ptr<SharedLRUCache> create(const std::string& name, size_t capacity, size_t shardCount = 0,
+                                                Layout layout = Layout::Lru);
+
+  /**
+   * Create a process-private cache for pre-fork servers: warm it in the parent, then
+   * fork. Every child continues with its own copy-on-write view of the warmed pages,
+   * and with Layout::Clock lookups leave them shared.
+   * Returns nullptr on failure.
+   */
+  static std::unique_ptr<SharedLRUCache> createPrivate(size_t capacity, size_t shardCount = 0,
+                                                       Layout layout = Layout::Clock);
+
+  /**
+   * Map a segment received from another process, e.g. a memfd, taking ownership of fd.
+   * The segment header is validated against this instantiation.
+   * Returns nullptr on failure.
+   */
+  static std::unique_ptr<SharedLRUCache> attach(int fd) {
+    return map(fd, false, 0, 0, Layout::Lru);
+  }
+
+  /**
+   * Called by the new process on a hot restart: connect to socketPath, receive the
+   * segment of the old process and attach it.
+   * Returns nullptr on failure or timeout.
+   */
+  static std::unique_ptr<SharedLRUCache> adopt(const std::string& socketPath, int timeoutMs = 5000);
+
+  /**
+   * Called by the old process on a hot restart: listen on socketPath and pass the
+   * segment to the first process calling adopt(). Blocks up to timeoutMs.
+   * Return true once the new process validated the segment. Both processes keep
+   * sharing the cache until the old one exits.
+   */
+  bool handOver(const std::string& socketPath, int timeoutMs = 5000) const;
+
+  /**
+   * Remove the named shared memory object, mapped segments stay valid.
+   */
+  static void unlinkSegment(const std::string& name) {
+    ::shm_unlink(name.c_str());
+  }
+
+  ~SharedLRUCache() {
+    ::munmap(base_, segmentSize_);
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  SharedLRUCache(const SharedLRUCache&) = delete;
+  SharedLRUCache& operator=(const SharedLRUCache&) = delete;
+
+  /**
+   * Copy the value of key into value and mark key as most-recently used.
+   * Return true if key exists.
+   */
+  bool find(TValue& value, const TKey& key);
+
+  /**
+   * Insert key/value, evicting the least-recently used key of the shard if full.
+   * If key already exists, the value will not be updated and return false.
+   */
+  bool insert(const TKey& key, const TValue& value);
+
+  /**
+   * Insert key/value or overwrite the value of an existing key.
+   * Return true if key was inserted.
+   */
+  bool insertOrAssign(const TKey& key, const TValue& value);
+
+  /**
+   * Erase key. Returns number of elements removed (0 or 1).
+   */
+  size_t erase(const TKey& key);
+
+  /**
+   * Erase all elements. Thread-safe, shards are cleared one at a time.
+   */
+  void clear();
+
+  size_t size() const;
+  size_t capacity() const {
+    return static_cast<size_t>(header_->shardCapacity_) * header_->shardCount_;
+  }
+  size_t shardCount() const {
+    return header_->shardCount_;
+  }
+
+  Layout layout() const {
+    return header_->layout_;
+  }
+
+  /**
+   * File descriptor of the segment, e.g. for passing it to another process.
+   * -1 for a private cache.
+   */
+  int fd() const {
+    return fd_;
+  }
+};
+
+// ---- private member functions ----
+template <class TKey, class TValue, class THash>
+bool SharedLRUCache<TKey, TValue, THash>::lock(ShardHeader& shard) {
+  int rc = pthread_mutex_lock(&shard.mutex_);
+  if (rc == EOWNERDEAD) {
+    // previous owner died mid-update, shard content can't be trusted.
+    resetShard(shard);
+    pthread_mutex_consistent(&shard.mutex_);
+    return true;
+  }
+  return rc == 0;
+}
+
+template <class TKey, class TValue, class THash>
+void SharedLRUCache<TKey, TValue, THash>::resetShard(ShardHeader& shard) {
+  shard.size_ = 0;
+  shard.head_ = NullIndex;
+  shard.tail_ = NullIndex;
+  shard.freeHead_ = NullIndex;
+  shard.nextUnused_ = 0;
+  shard.hand_ = 0;
+
+  Index* chains = buckets(shard);
+  for (size_t i = 0; i < header_->bucketCount_; i++) {
+    chains[i] = NullIndex;
+  }
+}
+
+template <class TKey, class TValue, class THash>
+typename SharedLRUCache<TKey, TValue, THash>::Index SharedLRUCache<TKey, TValue, THash>::lookup(
+  ShardHeader& shard, size_t hash, const TKey& key) const {
+  THash hashObj{};
+  Node* pool = nodes(shard);
+  for (Index idx = bucket(shard, hash); idx != NullIndex; idx = pool[idx].hashNext_) {
+    if (hashObj.equal(pool[idx].key_, key)) {
+      return idx;
+    }
+  }
+  return NullIndex;
+}
+
+template <class TKey, class TValue, class THash>
+void SharedLRUCache<TKey, TValue, THash>::append(ShardHeader& shard, Index idx) {
+  Node* pool = nodes(shard);
+  pool[idx].prev_ = shard.tail_;
+  pool[idx].next_ = NullIndex;
+  if (shard.tail_ != NullIndex) {
+    pool[shard.tail_].next_ = idx;
+  } else {
+    shard.head_ = idx;
+  }
+  shard.tail_ = idx;
+}
+
+template <class TKey, class TValue, class THash>
+void SharedLRUCache<TKey, TValue, THash>::unlink(ShardHeader& shard, Index idx) {
+  Node* pool = nodes(shard);
+  Index prev = pool[idx].prev_;
+  Index next = pool[idx].next_;
+  if (prev != NullIndex) {
+    pool[prev].next_ = next;
+  } else {
+    shard.head_ = next;
+  }
+  if (next != NullIndex) {
+    pool[next].prev_ = prev;
+  } else {
+    shard.tail_ = prev;
+  }
+}
+
+template <class TKey, class TValue, class THash>
+void SharedLRUCache<TKey, TValue, THash>::unchain(ShardHeader& shard, size_t hash, Index idx) {
+  Node* pool = nodes(shard);
+  Index* link = &bucket(shard, hash);
+  while (*link != idx) {
+    link = &pool[*link].hashNext_;
+  }
+  *link = pool[idx].hashNext_;
+}
+
+template <class TKey, class TValue, class THash>
+void SharedLRUCache<TKey, TValue, THash>::touch(ShardHeader& shard, Index idx) {
+  if (clock()) {
+    // skip the store if already set, so the page isn't dirtied again.
+    uint8_t& ref = refs(shard)[idx];
+    if (ref == 0) {
+      ref = 1;
+    }
+    return;
+  }
+
+  unlink(shard, idx);
+  append(shard, idx);
+}
+
+template <class TKey, class TValue, class THash>
+void SharedLRUCache<TKey, TValue, THash>::release(ShardHeader& shard, Index idx) {
+  Node* pool = nodes(shard);
+  unchain(shard, hashOf(pool[idx].key_), idx);
+  if (!clock()) {
+    unlink(shard, idx);
+  }
+
+  pool[idx].hashNext_ = shard.freeHead_;
+  shard.freeHead_ = idx;
+  shard.size_--;
+}
+
+template <class TKey, class TValue, class THash>
+typename SharedLRUCache<TKey, TValue, THash>::Index SharedLRUCache<TKey, TValue, THash>::allocate(ShardHeader& shard) {
+  Node* pool = nodes(shard);
+
+  if (shard.freeHead_ == NullIndex && shard.nextUnused_ == header_->shardCapacity_) {
+    if (clock()) {
+      // full, every node is in use. Evict the first one not referenced since the
+      // hand passed it last.
+      uint8_t* ref = refs(shard);
+      while (ref[shard.hand_] != 0) {
+        ref[shard.hand_] = 0;
+        shard.hand_ = (shard.hand_ + 1) % header_->shardCapacity_;
+      }
+      Index victim = shard.hand_;
+      shard.hand_ = (shard.hand_ + 1) % header_->shardCapacity_;
+      release(shard, victim);
+    } else {
+      // full, evict the least-recently used node.
+      release(shard, shard.head_);
+    }
+  }
+
+  Index idx;
+  if (shard.freeHead_ != NullIndex) {
+    idx = shard.freeHead_;
+    shard.freeHead_ = pool[idx].hashNext_;
+  } else {
+    idx = shard.nextUnused_++;
+  }
+
+  if (clock()) {
+    refs(shard)[idx] = 0;
+  }
+
+  shard.size_++;
+  return idx;
+}
+
+template <class TKey, class TValue, class THash>
+std::unique_ptr<SharedLRUCache<TKey, TValue, THash>> SharedLRUCache<TKey, TValue, THash>::map(int fd, bool create,
+                                                                                               size_t capacity,
+                                                                                               size_t shardCount,
+                                                                                               Layout layout) {
+  SegmentHeader layoutHeader{};
+  size_t segmentSize;
+
+  if (create) {
+    shardCount = shardCount > 0 ? shardCount : std::thread::hardware_concurrency();
+    size_t shardCapacity = (capacity + shardCount - 1) / shardCount;
+    if (shardCapacity == 0 || shardCapacity >= NullIndex) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+      return nullptr;
+    }
+
+    layoutHeader.shardCount_ = static_cast<uint32_t>(shardCount);
+    layoutHeader.shardCapacity_ = static_cast<uint32_t>(shardCapacity);
+    // load factor below 1 keeps hash chains short.
+    layoutHeader.bucketCount_ = static_cast<uint32_t>(shardCapacity + shardCapacity / 2 + 1);
+    layoutHeader.layout_ = layout;
+    layoutHeader.shardStride_ = layoutShard(layoutHeader);
+    segmentSize = headerSize(layout) + shardCount * layoutHeader.shardStride_;
+
+    if (fd >= 0 && ::ftruncate(fd, static_cast<off_t>(segmentSize)) != 0) {
+      ::close(fd);
+      return nullptr;
+    }
+  } else {
+    // wait for the creator to size the segment.
+    struct stat st;
+    bool sized = waitUntil([&] {
+      return ::fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= headerSize(Layout::Lru);
+    });
+    if (!sized) {
+      ::close(fd);
+      return nullptr;
+    }
+    segmentSize = static_cast<size_t>(st.st_size);
+  }
+
+  // fd < 0 asks for a private anonymous mapping.
+  void* addr = fd >= 0 ? ::mmap(nullptr, segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                       : ::mmap(nullptr, segmentSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return nullptr;
+  }
+
+  std::unique_ptr<SharedLRUCache> cache(new SharedLRUCache(fd, static_cast<char*>(addr), segmentSize));
+  SegmentHeader* header = cache->header_;
+
+  if (create) {
+    header->magic_ = SegmentHeader::Magic;
+    header->version_ = SegmentHeader::Version;
+    header->keySize_ = sizeof(TKey);
+    header->valueSize_ = sizeof(TValue);
+    header->shardCount_ = layoutHeader.shardCount_;
+    header->shardCapacity_ = layoutHeader.shardCapacity_;
+    header->bucketCount_ = layoutHeader.bucketCount_;
+    header->layout_ = layoutHeader.layout_;
+    header->shardStride_ = layoutHeader.shardStride_;
+    header->bucketOffset_ = layoutHeader.bucketOffset_;
+    header->nodeOffset_ = layoutHeader.nodeOffset_;
+    header->refOffset_ = layoutHeader.refOffset_;
+    header->segmentSize_ = segmentSize;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (size_t i = 0; i < shardCount; i++) {
+      ShardHeader& shard = cache->shardHeader(i);
+      pthread_mutex_init(&shard.mutex_, &attr);
+      cache->resetShard(shard);
+    }
+    pthread_mutexattr_destroy(&attr);
+
+    header->ready_.store(1, std::memory_order_release);
+    return cache;
+  }
+
+  if (!waitUntil([header] { return header->ready_.load(std::memory_order_acquire) != 0; })) {
+    return nullptr;
+  }
+
+  if (header->magic_ != SegmentHeader::Magic || header->version_ != SegmentHeader::Version ||
+      header->keySize_ != sizeof(TKey) || header->valueSize_ != sizeof(TValue) || header->segmentSize_ != segmentSize ||
+      header->shardCount_ == 0 || header->shardCapacity_ == 0 ||
+      (header->layout_ != Layout::Lru && header->layout_ != Layout::Clock)) {
+    return nullptr;
+  }
+
+  // recompute offsets rather than trusting them.
+  layoutHeader.shardCount_ = header->shardCount_;
+  layoutHeader.shardCapacity_ = header->shardCapacity_;
+  layoutHeader.bucketCount_ = header->bucketCount_;
+  layoutHeader.layout_ = header->layout_;
+  size_t stride = layoutShard(layoutHeader);
+  if (stride != header->shardStride_ || layoutHeader.bucketOffset_ != header->bucketOffset_ ||
+      layoutHeader.nodeOffset_ != header->nodeOffset_ || layoutHeader.refOffset_ != header->refOffset_ ||
+      headerSize(header->layout_) + header->shardCount_ * stride != segmentSize) {
+    return nullptr;
+  }
+
+  return cache;
+}
+// ---- private member functions end ----
+
+template <class TKey, class TValue, class THash>
+std::unique_ptr<SharedLRUCache<TKey, TValue, THash>> SharedLRUCache<TKey, TValue, THash>::open(const std::string& name,
+                                                                                                size_t capacity,
+                                                                                                size_t shardCount,
+                                                                                                Layout layout) {
+  int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  // wait for a live creator to finish initializing.
+  if (!waitUntil([fd] { return ::flock(fd, LOCK_EX | LOCK_NB) == 0; })) {
+    ::close(fd);
+    return nullptr;
+  }
+
+  struct stat st;
+  uint32_t ready = 0;
+  bool initialized = ::fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= headerSize(Layout::Lru) &&
+                     ::pread(fd, &ready, sizeof(ready), offsetof(SegmentHeader, ready_)) == sizeof(ready) &&
+                     ready != 0;
+  // new, or left half-initialized by a creator that died: start from zeroed pages.
+  if (!initialized && ::ftruncate(fd, 0) != 0) {
+    ::close(fd);
+    return nullptr;
+  }
+
+  // map() closes fd on failure, which releases the lock as well.
+  std::unique_ptr<SharedLRUCache> cache = map(fd, !initialized, capacity, shardCount, layout);
+  if (cache) {
+    ::flock(cache->fd_, LOCK_UN);
+  }
+  return cache;
+}
+
+template <class TKey, class TValue, class THash>
+std::unique_ptr<SharedLRUCache<TKey, TValue, THash>> SharedLRUCache<TKey, TValue, THash>::create(const std::string& name,
+                                                                                                  size_t capacity,
+                                                                                                  size_t shardCount,
+                                                                                                  Layout layout) {
+  int fd = ::memfd_create(name.c_str(), MFD_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+  return map(fd, true, capacity, shardCount, layout);
+}
+
+template <class TKey, class TValue, class THash>
+std::unique_ptr<SharedLRUCache<TKey, TValue, THash>> SharedLRUCache<TKey, TValue, THash>::createPrivate(
+  size_t capacity, size_t shardCount, Layout layout) {
+  return map(-1, true, capacity, shardCount, layout);
+}
+
+template <class TKey, class TValue, class THash>
+std::unique_ptr<SharedLRUCache<TKey, TValue, THash>> SharedLRUCache<TKey, TValue, THash>::adopt(
+  const std::string& socketPath, int timeoutMs) {
+  int sock = Handover::connect(socketPath, timeoutMs);
+  if (sock < 0) {
+    return nullptr;
+  }
+
+  std::unique_ptr<SharedLRUCache> cache;
+  int fd = Handover::receiveFd(sock, timeoutMs);
+  if (fd >= 0) {
+    cache = attach(fd);
+  }
+
+  Handover::sendAck(sock, cache != nullptr);
+  ::close(sock);
+  return cache;
+}
+
+template <class TKey, class TValue, class THash>
+bool SharedLRUCache<TKey, TValue, THash>::handOver(const std::string& socketPath, int timeoutMs) const {
+  if (fd_ < 0) {
+    // private mapping, nothing to share.
+    return false;
+  }
+
+  int listener = Handover::listen(socketPath);
+  if (listener < 0) {
+    return false;
+  }
+
+  bool ok = false;
+  int sock = Handover::accept(listener, timeoutMs);
+  if (sock >= 0) {
+    ok = Handover::sendFd(sock, fd_) && Handover::receiveAck(sock, timeoutMs);
+    ::close(sock);
+  }
+
+  ::close(listener);
+  ::unlink(socketPath.c_str());
+  return ok;
+}
+
+template <class TKey, class TValue, class THash>
+bool SharedLRUCache<TKey, TValue, THash>::find(TValue& value, const TKey& key) {
+  size_t hash = hashOf(key);
+  ShardHeader& shard = shardHeader(shardIndex(hash));
+  if (!lock(shard)) {
+    return false;
+  }
+
+  Index idx = lookup(shard, hash, key);
+  if (idx != NullIndex) {
+    value = nodes(shard)[idx].value_;
+    touch(shard, idx);
+  }
+
+  unlock(shard);
+  return idx != NullIndex;
+}
+
+template <class TKey, class TValue, class THash>
+bool SharedLRUCache<TKey, TValue, THash>::insert(const TKey& key, const TValue& value) {
+  size_t hash = hashOf(key);
+  ShardHeader& shard = shardHeader(shardIndex(hash));
+  if (!lock(shard)) {
+    return false;
+  }
+
+  if (lookup(shard, hash, key) != NullIndex) {
+    unlock(shard);
+    return false;
+  }
+
+  Index idx = allocate(shard);
+  Node& node = nodes(shard)[idx];
+  node.key_ = key;
+  node.value_ = value;
+  node.hashNext_ = bucket(shard, hash);
+  bucket(shard, hash) = idx;
+  if (!clock()) {
+    append(shard, idx);
+  }
+
+  unlock(shard);
+  return true;
+}
+
+template <class TKey, class TValue, class THash>
+bool SharedLRUCache<TKey, TValue, THash>::insertOrAssign(const TKey& key, const TValue& value) {
+  size_t hash = hashOf(key);
+  ShardHeader& shard = shardHeader(shardIndex(hash));
+  if (!lock(shard)) {
+    return false;
+  }
+
+  Index idx = lookup(shard, hash, key);
+  bool inserted = idx == NullIndex;
+  if (inserted) {
+    idx = allocate(shard);
+    Node& node = nodes(shard)[idx];
+    node.key_ = key;
+    node.hashNext_ = bucket(shard, hash);
+    bucket(shard, hash) = idx;
+    if (!clock()) {
+      append(shard, idx);
+    }
+  } else {
+    touch(shard, idx);
+  }
+
+  nodes(shard)[idx].value_ = value;
+
+  unlock(shard);
+  return inserted;
+}
+
+template <class TKey, class TValue, class THash>
+size_t SharedLRUCache<TKey, TValue, THash>::erase(const TKey& key) {
+  size_t hash = hashOf(key);
+  ShardHeader& shard = shardHeader(shardIndex(hash));
+  if (!lock(shard)) {
+    return 0;
+  }
+
+  Index idx = lookup(shard, hash, key);
+  if (idx != NullIndex) {
+    release(shard, idx);
+  }
+
+  unlock(shard);
+  return idx != NullIndex ? 1 : 0;
+}
+
+template <class TKey, class TValue, class THash>
+void SharedLRUCache<TKey, TValue, THash>::clear() {
+  for (size_t i = 0; i < header_->shardCount_; i++) {
+    ShardHeader& shard = shardHeader(i);
+    if (lock(shard)) {
+      resetShard(shard);
+      unlock(shard);
+    }
+  }
+}
+
+template <class TKey, class TValue, class THash>
+size_t SharedLRUCache<TKey, TValue, THash>::size() const {
+  size_t size = 0;
+  for (size_t i = 0; i < header_->shardCount_; i++) {
+    // racy read, good enough for reporting.
+    size += __atomic_load_n(&shardHeader(i).size_, __ATOMIC_RELAXED);
+  }
+  return size;
+}
+}  // namespace LRUC
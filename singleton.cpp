@@ -1,9 +1,14 @@
 #include "singleton.hpp"
+#include "feed-loader.h"
+#include "memory-pressure.h"
 
 namespace {
 std::once_flag init_soft_ip_flag;
 size_t soft_ip_cache_capacity;
 size_t soft_ip_cache_shardCount;
+
+std::once_flag init_shared_soft_ip_flag;
+std::unique_ptr<sentinel::SharedSoftIpCache> shared_soft_ip_cache;
 } // namespace
 
 void init_soft_ip_cache(size_t capacity, size_t shardCnt) {
@@ -16,6 +21,71 @@ void init_soft_ip_cache(size_t capacity, size_t shardCnt) {
 sentinel::SoftIpCache &getSoftIpCache() {
   static sentinel::SoftIpCache cache{soft_ip_cache_capacity,
                                      soft_ip_cache_shardCount};
+  static bool configured = [] {
+    // recent operations for postmortems of latency spikes.
+    cache.enableFlightRecorder();
+    return true;
+  }();
+  (void)configured;
 
   return cache;
 }
+
+void preconstruct_soft_ip_cache() { getSoftIpCache().preconstruct(); }
+
+void enable_soft_ip_admission_throttle() {
+  // scans of one-off addresses shouldn't flush the hot set.
+  getSoftIpCache().enableAdmissionThrottle();
+}
+
+void enable_soft_ip_fast_teardown() {
+  getSoftIpCache().enableFastTeardown();
+}
+
+void start_soft_ip_pressure_monitor() {
+  // constructed after the cache, thus stopped before it is destroyed.
+  auto &cache = getSoftIpCache();
+  static LRUC::MemoryPressureMonitor<sentinel::SoftIpCache> monitor{cache};
+  (void)monitor;
+}
+
+int64_t load_soft_ip_feed(const std::string &path, int64_t expiryTs,
+                          int denialInfoCode) {
+  LRUC::FeedStats stats;
+  bool ok = LRUC::loadFeed(
+      getSoftIpCache(), path,
+      [=](uint32_t, unsigned prefixLen) {
+        return sentinel::CacheValue<>(expiryTs, denialInfoCode,
+                                      static_cast<int>(prefixLen));
+      },
+      stats);
+  return ok ? static_cast<int64_t>(stats.loaded_) : -1;
+}
+
+void init_shared_soft_ip_cache(const std::string &name, size_t capacity,
+                               size_t shardCnt) {
+  std::call_once(init_shared_soft_ip_flag, [&] {
+    shared_soft_ip_cache =
+        sentinel::SharedSoftIpCache::open(name, capacity, shardCnt);
+  });
+}
+
+bool adopt_shared_soft_ip_cache(const std::string &socketPath, int timeoutMs) {
+  bool adopted = false;
+  std::call_once(init_shared_soft_ip_flag, [&] {
+    shared_soft_ip_cache =
+        sentinel::SharedSoftIpCache::adopt(socketPath, timeoutMs);
+    adopted = shared_soft_ip_cache != nullptr;
+  });
+  return adopted;
+}
+
+bool handover_shared_soft_ip_cache(const std::string &socketPath,
+                                   int timeoutMs) {
+  return shared_soft_ip_cache != nullptr &&
+         shared_soft_ip_cache->handOver(socketPath, timeoutMs);
+}
+
+sentinel::SharedSoftIpCache *getSharedSoftIpCache() {
+  return shared_soft_ip_cache.get();
+}
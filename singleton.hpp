@@ -2,7 +2,9 @@
 
 #include "lrucache.h"
 #include "scale-lrucache.h"
+#include "shared-lrucache.h"
 #include <mutex>
+#include <string>
 
 namespace sentinel {
 
@@ -24,9 +26,51 @@ struct CacheValue {
         requiresGoodBotUserAgent(requiresGoodUserAgent){};
 };
 
-using SoftIpCache = LRUC::ScalableLRUCache<int, CacheValue<>>;
+// Keys are indexed in order to support erasePrefix() for re-scored networks.
+using SoftIpCache = LRUC::ScalableLRUCache<int, CacheValue<>, tbb::tbb_hash_compare<int>, true>;
+
+// One cache shared by all worker processes on a host.
+using SharedSoftIpCache = LRUC::SharedLRUCache<int, CacheValue<>>;
 
 } // namespace sentinel
 
 void init_soft_ip_cache(size_t capacity, size_t shardCnt);
 sentinel::SoftIpCache &getSoftIpCache();
+// Build every shard of getSoftIpCache() in parallel, e.g. during init, so the
+// first requests don't pay for it. Shards are built on first touch otherwise.
+void preconstruct_soft_ip_cache();
+// Throttle admission of new addresses to getSoftIpCache() during eviction
+// storms, see LRUC::LRUCache::enableAdmissionThrottle(). Off by default: once
+// on, insert() and insertOrAssign() also return false for an address that was
+// not admitted, use tryInsert() and tryInsertOrAssign() to tell. Idempotent.
+void enable_soft_ip_admission_throttle();
+// Leave the elements of getSoftIpCache() to the OS when it is destroyed, instead
+// of freeing them one by one at exit, see
+// LRUC::ScalableLRUCache::enableFastTeardown(). Off by default: only for
+// processes that never dlclose() the library owning the cache, which would leak
+// it. Idempotent.
+void enable_soft_ip_fast_teardown();
+// Shrink getSoftIpCache() under memory pressure of the process' cgroup and grow
+// it back once pressure eases, see LRUC::MemoryPressureMonitor. Idempotent.
+void start_soft_ip_pressure_monitor();
+// Bulk load a feed of IPv4 addresses and CIDR networks, one per line, into
+// getSoftIpCache(), see LRUC::loadFeed(). Values expire at expiryTs and carry
+// the network's prefix length. Returns number of addresses loaded, -1 if path
+// can't be read.
+int64_t load_soft_ip_feed(const std::string &path, int64_t expiryTs,
+                          int denialInfoCode = 0);
+
+// name: POSIX shared memory object name, e.g. "/soft-ip-cache".
+// Every worker calls this with the same name, the first one creates the segment.
+void init_shared_soft_ip_cache(const std::string &name, size_t capacity,
+                               size_t shardCnt);
+// Hot restart: the new process adopts the segment of the old one, which calls
+// handover_shared_soft_ip_cache() on the same socket path. Takes the place of
+// init_shared_soft_ip_cache(), returns false if nothing could be adopted.
+bool adopt_shared_soft_ip_cache(const std::string &socketPath,
+                                int timeoutMs = 5000);
+// Pass the shared cache to a process calling adopt_shared_soft_ip_cache().
+bool handover_shared_soft_ip_cache(const std::string &socketPath,
+                                   int timeoutMs = 5000);
+// nullptr if not initialized or the segment could not be opened.
+sentinel::SharedSoftIpCache *getSharedSoftIpCache();